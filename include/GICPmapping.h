@@ -0,0 +1,170 @@
+#pragma once
+
+#include "registration.h"
+#include "cloudKdTree.h"
+
+// generalized ICP: plane-like covariances are precomputed for every map point (in setTarget) and every scan point
+// (in setSource), each iteration matches a point to its nearest map point and minimizes the distance under the
+// combined covariance. Correspondence search and the 6x6 normal equations run on all cores.
+class GICPmapping : public Registration, public RollConfig
+{
+    private:
+        pcl::PointCloud<PointType>::Ptr target;
+        CloudKdTree::Ptr kdtreeTarget;
+        vector<Eigen::Matrix3f> targetCov;
+        vector<Eigen::Vector3f> targetNormal;
+        pcl::PointCloud<PointType>::Ptr source;
+        vector<Eigen::Matrix3f> sourceCov;
+
+        Eigen::Matrix3f R;
+        Eigen::Vector3f t;
+        vector<float> pointError; // point-to-plane distance of the last iteration, -1 without correspondence
+        float targetTime = 0, sourceTime = 0, optTime = 0;
+
+        // covariance of the neighbourhood with its eigenvalues replaced by (eps, 1, 1), i.e. a plane with the fitted normal
+        void computeCovariances(const pcl::PointCloud<PointType>::Ptr& cloud, const CloudKdTree::Ptr& kdtree,
+                                vector<Eigen::Matrix3f>& covs, vector<Eigen::Vector3f>* normals)
+        {
+            int cloudSize = cloud->size();
+            covs.resize(cloudSize);
+            if (normals) normals->resize(cloudSize);
+            int k = min(gicpNeighbors, cloudSize);
+            #pragma omp parallel num_threads(numberOfCores)
+            {
+                std::vector<int> pointSearchInd;
+                std::vector<float> pointSearchSqDis;
+                #pragma omp for schedule(static)
+                for (int i = 0; i < cloudSize; i++)
+                {
+                    kdtree->nearestKSearch(cloud->points[i], k, pointSearchInd, pointSearchSqDis);
+                    Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+                    for (int j : pointSearchInd)
+                        mean += cloud->points[j].getVector3fMap();
+                    mean /= pointSearchInd.size();
+                    Eigen::Matrix3f cov = Eigen::Matrix3f::Zero();
+                    for (int j : pointSearchInd)
+                    {
+                        Eigen::Vector3f d = cloud->points[j].getVector3fMap() - mean;
+                        cov += d * d.transpose();
+                    }
+                    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver(cov);
+                    Eigen::Matrix3f V = solver.eigenvectors();
+                    covs[i] = V * Eigen::Vector3f(1e-3, 1, 1).asDiagonal() * V.transpose();
+                    if (normals) (*normals)[i] = V.col(0);
+                }
+            }
+        }
+
+    public:
+        explicit GICPmapping(const RollConfig& config) : RollConfig(config)
+        {
+            target.reset(new pcl::PointCloud<PointType>());
+            source.reset(new pcl::PointCloud<PointType>());
+            kdtreeTarget.reset(new CloudKdTree());
+        }
+
+        string name() const override { return "gicp"; }
+
+        // corner and surf points are treated alike
+        void setTarget(pcl::PointCloud<PointType>::Ptr cornerMap, pcl::PointCloud<PointType>::Ptr surfMap) override
+        {
+            TicToc build;
+            target.reset(new pcl::PointCloud<PointType>());
+            *target += *cornerMap;
+            *target += *surfMap;
+            kdtreeTarget.reset(new CloudKdTree());
+            targetCov.clear();
+            if (target->size() >= 3)
+            {
+                kdtreeTarget->setInputCloud(target);
+                computeCovariances(target, kdtreeTarget, targetCov, &targetNormal);
+            }
+            targetTime = build.toc();
+        }
+
+        void setSource(pcl::PointCloud<PointType>::Ptr corner, pcl::PointCloud<PointType>::Ptr surf) override
+        {
+            TicToc build;
+            source.reset(new pcl::PointCloud<PointType>());
+            *source += *corner;
+            *source += *surf;
+            sourceCov.clear();
+            if (source->size() >= 3)
+            {
+                CloudKdTree::Ptr kdtreeSource(new CloudKdTree());
+                kdtreeSource->setInputCloud(source);
+                computeCovariances(source, kdtreeSource, sourceCov, nullptr);
+            }
+            pointError.assign(source->size(), -1);
+            sourceTime = build.toc();
+        }
+
+        void align(const Eigen::Affine3f& guess) override
+        {
+            TicToc opt;
+            R = guess.rotation();
+            t = guess.translation();
+            iterate(targetCov.empty() || sourceCov.empty() ? 0 : optIteration, [this](int iteration) { return optimizationStep(iteration); });
+            affine_out.linear() = R;
+            affine_out.translation() = t;
+            pointErrorStats(pointError, inlierThreshold);
+            optTime = opt.toc();
+        }
+
+        string stats() const override
+        {
+            std::ostringstream ss;
+            ss << "target covariances " << targetTime << " ms, source covariances " << sourceTime << " ms, "
+               << optTime << " ms, " << iterCount << " iterations";
+            if (budgetLimited)
+                ss << ", budget limited, point stride " << pointStride;
+            return ss.str();
+        }
+
+        // one Gauss-Newton step on the current nearest neighbours, true once converged
+        bool optimizationStep(int iterCount)
+        {
+            Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();
+            Eigen::Matrix<double, 6, 1> b = Eigen::Matrix<double, 6, 1>::Zero();
+            int sourceSize = source->size();
+            int correspondences = 0;
+            float maxSqDis = gicpMaxCorrespondenceDistance * gicpMaxCorrespondenceDistance;
+
+            std::fill(pointError.begin(), pointError.end(), -1);
+            #pragma omp parallel num_threads(numberOfCores)
+            {
+                Eigen::Matrix<double, 6, 6> Hi = Eigen::Matrix<double, 6, 6>::Zero();
+                Eigen::Matrix<double, 6, 1> bi = Eigen::Matrix<double, 6, 1>::Zero();
+                int ci = 0;
+                #pragma omp for schedule(static) nowait
+                for (int i = 0; i < sourceSize; i += pointStride)
+                {
+                    Eigen::Vector3f p = source->points[i].getVector3fMap();
+                    Eigen::Vector3f Rp = R * p;
+                    PointType pointSel;
+                    pointSel.getVector3fMap() = Rp + t;
+                    Neighbours<1> nn = knn<1>(*kdtreeTarget, pointSel);
+                    if (!nn.full() || nn.sqDistances[0] > maxSqDis)
+                        continue;
+                    int j = nn.indices[0];
+                    Eigen::Vector3f e = pointSel.getVector3fMap() - target->points[j].getVector3fMap();
+                    pointError[i] = fabs(targetNormal[j].dot(e));
+                    Eigen::Matrix3f W = (targetCov[j] + R * sourceCov[i] * R.transpose()).inverse();
+                    Eigen::Matrix<float, 3, 6> J;
+                    J.leftCols<3>() = -skewSymmetric(Rp);
+                    J.rightCols<3>().setIdentity();
+                    Eigen::Matrix<float, 6, 3> JtW = J.transpose() * W;
+                    Hi += (JtW * J).cast<double>();
+                    bi += (JtW * e).cast<double>();
+                    ci++;
+                }
+                #pragma omp critical
+                {
+                    H += Hi;
+                    b += bi;
+                    correspondences += ci;
+                }
+            }
+            return gaussNewtonUpdate(H, b, correspondences, iterCount, R, t);
+        }
+};
@@ -1,16 +1,20 @@
-#include"utility.h"
+#pragma once
 
+#include "registration.h"
+#include "cloudKdTree.h"
+#include "symmetricEigen.h"
 
-
-class LOAMmapping : public ParamServer
+// edge/plane matching of LOAM: point-to-line and point-to-plane residuals against 5-NN fits in the kd-trees of the map
+class LOAMmapping : public Registration, public RollConfig
 {
     private: 
-        float transformTobeMapped[6];
-        float transformGuess[6];
+        // pose being optimized, map from body
+        Eigen::Matrix3f R;
+        Eigen::Vector3f t;
+        Eigen::Matrix<double, 6, 6> projection; // drops the degenerate directions of the update
     public: 
-        Eigen::Affine3f affine_out;
-        pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap;
-        pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap;
+        CloudKdTree::Ptr kdtreeCornerFromMap;
+        CloudKdTree::Ptr kdtreeSurfFromMap;
         pcl::PointCloud<PointType>::Ptr lidarCloudCornerLastDS;
         pcl::PointCloud<PointType>::Ptr lidarCloudSurfLastDS;
         pcl::PointCloud<PointType>::Ptr lidarCloudSurfFromMapDS;
@@ -27,67 +31,244 @@ class LOAMmapping : public ParamServer
         std::vector<bool> lidarCloudOriSurfFlag;
         vector<double> mapRegistrationError;
 
-        int iterCount = 0;
         int lidarCloudCornerLastDSNum = 0;
         int lidarCloudSurfLastDSNum = 0;
 
         int edgePointCorrNum = 0;
         int surfPointCorrNum = 0;
 
-        double inlier_ratio = 0;
-        double inlier_ratio2 = 0;
         float cornerTime = 0, surfTime = 0, optTime = 0;
-        double regiError;
-
-        double minEigen = 1e+6;
+        float targetTime = 0;
+        float iterationTime = 0; // of the last iteration, to tell whether the next one fits in the time budget
 
-        bool isDegenerate = false;
-        cv::Mat matP;
+        // precomputed planes/lines of the map, used instead of the kd-trees where available
+        MapField::Ptr mapField;
+        int fieldLookups = 0;
+        int fieldFallbacks = 0;
 
-        LOAMmapping(pcl::PointCloud<PointType>::Ptr lidarCloudCornerLastDSnew,pcl::PointCloud<PointType>::Ptr lidarCloudSurfLastDSnew,
-            pcl::PointCloud<PointType>::Ptr lidarCloudCornerFromMapDSnew, pcl::PointCloud<PointType>::Ptr lidarCloudSurfFromMapDSnew,
-            const Eigen::Affine3f affine_guess_new) // you don't wanna change affine_guess_new here
+        // map neighbourhood fit of a scan point, reused while the point moves less than correspondenceReuseDistance
+        struct Correspondence
+        {
+            bool searched = false; // the fit below was made for the point at 'at'
+            bool found = false;    // a line/plane passed the checks
+            Eigen::Vector3f at;
+            float p[6];            // line: centre and direction, plane: unit normal and offset
+        };
+        vector<Correspondence> cornerCache;
+        vector<Correspondence> surfCache;
+        int searches = 0;
+        int reuses = 0;
+
+        // corner neighbourhoods waiting for their line fit, solved together by cornerFits
+        struct PendingLine
+        {
+            int i; // scan point
+            PointType pointSel;
+            float cx, cy, cz; // neighbourhood centre
+        };
+        vector<PendingLine> pendingLines;
+        SymmetricEigen3Batch cornerFits;
+
+        // coarse-to-fine levels, coarsest first, the last one is the full resolution map and scan
+        struct PyramidLevel
         {
-            kdtreeCornerFromMap.reset(new pcl::KdTreeFLANN<PointType>());
-            kdtreeSurfFromMap.reset(new pcl::KdTreeFLANN<PointType>());
+            float leafSize = 0;
+            int maxIterations = 0;
+            pcl::PointCloud<PointType>::Ptr cornerMap, surfMap, corner, surf;
+            CloudKdTree::Ptr kdtreeCorner, kdtreeSurf;
+            int iterations = 0;
+            float time = 0;
+        };
+        vector<PyramidLevel> pyramid;
+        // leaf size of the active level relative to the full resolution, widens the neighbour and convergence thresholds
+        float levelScale = 1;
+
+        explicit LOAMmapping(const RollConfig& config) : RollConfig(config)
+        {
+            kdtreeCornerFromMap.reset(new CloudKdTree());
+            kdtreeSurfFromMap.reset(new CloudKdTree());
             lidarCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
-            lidarCloudCornerLastDS.reset(new pcl::PointCloud<PointType>());
             lidarCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
+            lidarCloudCornerLastDS.reset(new pcl::PointCloud<PointType>());
             lidarCloudSurfLastDS.reset(new pcl::PointCloud<PointType>());
-            pcl::copyPointCloud(*lidarCloudCornerFromMapDSnew,*lidarCloudCornerFromMapDS);
-            pcl::copyPointCloud(*lidarCloudSurfFromMapDSnew,*lidarCloudSurfFromMapDS);
-            kdtreeCornerFromMap->setInputCloud(lidarCloudCornerFromMapDS);
-            kdtreeSurfFromMap->setInputCloud(lidarCloudSurfFromMapDS);
-            pcl::copyPointCloud(*lidarCloudCornerLastDSnew,*lidarCloudCornerLastDS);
-            pcl::copyPointCloud(*lidarCloudSurfLastDSnew,*lidarCloudSurfLastDS);
+            lidarCloudOri.reset(new pcl::PointCloud<PointType>());
+            coeffSel.reset(new pcl::PointCloud<PointType>());
+
+            vector<double> leafSizes = registrationPyramid;
+            std::sort(leafSizes.begin(), leafSizes.end(), std::greater<double>());
+            for (double leafSize : leafSizes)
+            {
+                if (leafSize <= mappingSurfLeafSize) continue;
+                PyramidLevel level;
+                level.leafSize = leafSize;
+                level.maxIterations = 5;
+                pyramid.push_back(level);
+            }
+            PyramidLevel full;
+            full.leafSize = mappingSurfLeafSize;
+            full.maxIterations = optIteration;
+            pyramid.push_back(full);
+            if (pyramidIterations.size() == pyramid.size())
+                for (size_t i = 0; i < pyramid.size(); i++)
+                    pyramid[i].maxIterations = pyramidIterations[i];
+            else if (!pyramidIterations.empty())
+                ROLL_WARN("pyramidIterations has %lu entries for %lu levels, using the defaults", pyramidIterations.size(), pyramid.size());
+        }
+
+        static pcl::PointCloud<PointType>::Ptr downsample(const pcl::PointCloud<PointType>::Ptr& cloud, float leafSize)
+        {
+            pcl::PointCloud<PointType>::Ptr cloudDS(new pcl::PointCloud<PointType>());
+            pcl::VoxelGrid<PointType> downSizeFilter;
+            downSizeFilter.setLeafSize(leafSize, leafSize, leafSize);
+            downSizeFilter.setInputCloud(cloud);
+            downSizeFilter.filter(*cloudDS);
+            return cloudDS;
+        }
 
+        // makes a level the one cornerOptimization/surfOptimization work on
+        void useLevel(const PyramidLevel& level)
+        {
+            lidarCloudCornerFromMapDS = level.cornerMap;
+            lidarCloudSurfFromMapDS = level.surfMap;
+            kdtreeCornerFromMap = level.kdtreeCorner;
+            kdtreeSurfFromMap = level.kdtreeSurf;
+            lidarCloudCornerLastDS = level.corner;
+            lidarCloudSurfLastDS = level.surf;
             lidarCloudCornerLastDSNum = lidarCloudCornerLastDS->points.size();
             lidarCloudSurfLastDSNum = lidarCloudSurfLastDS->points.size();
-            affine_out = affine_guess_new;
+            levelScale = level.leafSize / mappingSurfLeafSize;
+            cornerCache.assign(lidarCloudCornerLastDSNum, Correspondence());
+            surfCache.assign(lidarCloudSurfLastDSNum, Correspondence());
+        }
+
+        // true if the last fit of a point may be used at its new position
+        bool reusable(const Correspondence& cache, const PointType& pointSel, int iterCount)
+        {
+            if (!cache.searched || correspondenceReuseDistance <= 0 || iterCount % max(correspondenceRefreshInterval, 1) == 0)
+                return false;
+            float dx = pointSel.x - cache.at(0), dy = pointSel.y - cache.at(1), dz = pointSel.z - cache.at(2);
+            return dx * dx + dy * dy + dz * dz < correspondenceReuseDistance * correspondenceReuseDistance;
+        }
 
-            Affine3f2Trans(affine_out, transformTobeMapped);
-            Affine3f2Trans(affine_out, transformGuess);
+        string name() const override { return "loam"; }
 
-            lidarCloudOri.reset(new pcl::PointCloud<PointType>());
-            coeffSel.reset(new pcl::PointCloud<PointType>());
+        void setMapField(MapField::Ptr field) override
+        {
+            mapField = field;
+        }
+
+        void setTarget(pcl::PointCloud<PointType>::Ptr cornerMap, pcl::PointCloud<PointType>::Ptr surfMap) override
+        {
+            TicToc build;
+            for (PyramidLevel& level : pyramid)
+            {
+                bool full = &level == &pyramid.back();
+                level.cornerMap = full ? cornerMap : downsample(cornerMap, max(level.leafSize, mappingCornerLeafSize));
+                level.surfMap = full ? surfMap : downsample(surfMap, level.leafSize);
+                level.kdtreeCorner.reset(new CloudKdTree());
+                level.kdtreeSurf.reset(new CloudKdTree());
+                level.kdtreeCorner->setInputCloud(level.cornerMap);
+                level.kdtreeSurf->setInputCloud(level.surfMap);
+            }
+            lidarCloudCornerFromMapDS = cornerMap;
+            lidarCloudSurfFromMapDS = surfMap;
+            kdtreeCornerFromMap = pyramid.back().kdtreeCorner;
+            kdtreeSurfFromMap = pyramid.back().kdtreeSurf;
+            targetTime = build.toc();
+        }
 
-            lidarCloudOriCornerVec.resize(N_SCAN * Horizon_SCAN);
-            coeffSelCornerVec.resize(N_SCAN * Horizon_SCAN);
-            lidarCloudOriCornerFlag.resize(N_SCAN * Horizon_SCAN);
-            lidarCloudOriSurfVec.resize(N_SCAN * Horizon_SCAN);
-            coeffSelSurfVec.resize(N_SCAN * Horizon_SCAN);
-            lidarCloudOriSurfFlag.resize(N_SCAN * Horizon_SCAN);
+        void setSource(pcl::PointCloud<PointType>::Ptr corner, pcl::PointCloud<PointType>::Ptr surf) override
+        {
+            for (PyramidLevel& level : pyramid)
+            {
+                bool full = &level == &pyramid.back();
+                level.corner = full ? corner : downsample(corner, max(level.leafSize, mappingCornerLeafSize));
+                level.surf = full ? surf : downsample(surf, level.leafSize);
+            }
+            lidarCloudCornerLastDS = corner;
+            lidarCloudSurfLastDS = surf;
+            lidarCloudCornerLastDSNum = lidarCloudCornerLastDS->points.size();
+            lidarCloudSurfLastDSNum = lidarCloudSurfLastDS->points.size();
+
+            lidarCloudOriCornerVec.resize(lidarCloudCornerLastDSNum);
+            coeffSelCornerVec.resize(lidarCloudCornerLastDSNum);
+            lidarCloudOriCornerFlag.resize(lidarCloudCornerLastDSNum);
+            lidarCloudOriSurfVec.resize(lidarCloudSurfLastDSNum);
+            coeffSelSurfVec.resize(lidarCloudSurfLastDSNum);
+            lidarCloudOriSurfFlag.resize(lidarCloudSurfLastDSNum);
+        }
+
+        void align(const Eigen::Affine3f& guess) override // you don't wanna change the guess here
+        {
+            affine_out = guess;
+            R = guess.linear();
+            t = guess.translation();
 
             std::fill(lidarCloudOriCornerFlag.begin(), lidarCloudOriCornerFlag.end(), false);
             std::fill(lidarCloudOriSurfFlag.begin(), lidarCloudOriSurfFlag.end(), false);
-            matP = cv::Mat(6, 6, CV_32F, cv::Scalar::all(0));
+            mapRegistrationError.clear();
+            minEigen = 1e+6;
+            isDegenerate = false;
+            inlier_ratio = inlier_ratio2 = regiError = 0;
+            cornerTime = surfTime = optTime = 0;
+            fieldLookups = fieldFallbacks = 0;
+            searches = reuses = 0;
+            startBudget();
+            iterationTime = 0;
+
+            // coarse levels only move the pose, the full resolution level sets the degeneracy and inlier results.
+            // The precomputed field has the full resolution planes/lines, so it is left to the last level.
+            MapField::Ptr field = mapField;
+            int totalIterations = 0;
+            for (PyramidLevel& level : pyramid)
+            {
+                bool full = &level == &pyramid.back();
+                TicToc levelTime;
+                useLevel(level);
+                mapField = full ? field : nullptr;
+                match(level.maxIterations, full);
+                level.iterations = iterCount;
+                level.time = levelTime.toc();
+                totalIterations += iterCount;
+            }
+            mapField = field;
+            iterCount = totalIterations;
+            ROLL_STAGE_RECORD("loam/corner", cornerTime);
+            ROLL_STAGE_RECORD("loam/surf", surfTime);
+            ROLL_STAGE_RECORD("loam/solve", optTime);
+        }
+
+        string stats() const override
+        {
+            std::ostringstream ss;
+            ss << "kd-trees " << targetTime << " ms, corner " << cornerTime << " ms, surf " << surfTime << " ms, "
+               << iterCount << " iterations";
+            if (budgetLimited)
+                ss << ", budget limited, point stride " << pointStride;
+            if (pyramid.size() > 1)
+                for (const PyramidLevel& level : pyramid)
+                    ss << ", " << level.leafSize << " m: " << level.iterations << " it " << level.time << " ms";
+            ss << ", kd-tree searches " << searches << ", reused " << reuses;
+            if (mapField)
+                ss << ", field lookups " << fieldLookups << ", kd-tree fallbacks " << fieldFallbacks;
+            return ss.str();
         }
 
-        void match( )
+        // the final level runs at least one iteration even over budget, it provides the inlier statistics
+        void match(int maxIterations, bool final = true)
         {
+            // nothing carries over from a coarser level: if this one stops before its first update, the results
+            // say no match instead of repeating the coarse level's
+            mapRegistrationError.clear();
+            minEigen = 1e+6;
+            isDegenerate = false;
+            projection.setIdentity();
             iterCount = 0;
-            for (; iterCount < optIteration; iterCount++)
+            for (; iterCount < maxIterations; iterCount++)
             {
+                if ((iterCount > 0 || !final) && !budgetAllows(iterationTime))
+                    break;
+                TicToc iteration;
                 lidarCloudOri->clear();
                 coeffSel->clear();
                 TicToc corner;
@@ -99,14 +280,17 @@ class LOAMmapping : public ParamServer
                 TicToc opt;
                 combineOptimizationCoeffs();
                 optTime += opt.toc();
-                inlier_ratio2 = (double)(surfPointCorrNum + edgePointCorrNum)/( lidarCloudSurfLastDSNum+ lidarCloudCornerLastDSNum);
+                int matchedNum = (lidarCloudSurfLastDSNum + pointStride - 1) / pointStride + (lidarCloudCornerLastDSNum + pointStride - 1) / pointStride;
+                inlier_ratio2 = (double)(surfPointCorrNum + edgePointCorrNum) / matchedNum;
                 // surf only
                 // inlier_ratio2 = (double)surfPointCorrNum/ lidarCloudSurfLastDSNum;
 
                 // it is actually for map extension, otherwise cv error happens
                 // 0.2 or higher would seriously deteriarate the performance
                 if (inlier_ratio2 < 0.1 ) break; 
-                if (LMOptimization(iterCount) == true)
+                bool converged = LMOptimization(iterCount);
+                iterationTime = iteration.toc();
+                if (converged == true)
                 {
                     // cout<<"converged"<<endl;
                     break;              
@@ -139,37 +323,69 @@ class LOAMmapping : public ParamServer
 
     void cornerOptimization(int iterCount)
     {
-        affine_out = trans2Affine3f(transformTobeMapped);
-
+        // lines are fitted after the search loop, batched
+        cornerFits.clear();
+        pendingLines.clear();
+        Eigen::Affine3d pose = affine_out.cast<double>(); // field lookups compose the scan point in double
         // #pragma omp parallel for num_threads(numberOfCores) // runtime error, don't use it!
-        for (int i = 0; i < lidarCloudCornerLastDSNum; i++)
+        for (int i = 0; i < lidarCloudCornerLastDSNum; i += pointStride)
         {
             PointType pointOri, pointSel, coeff;
-            std::vector<int> pointSearchInd;
-            std::vector<float> pointSearchSqDis;
 
             pointOri = lidarCloudCornerLastDS->points[i];
             pointAssociateToMap(&pointOri, &pointSel);
-            kdtreeCornerFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
 
-            cv::Mat matA1(3, 3, CV_32F, cv::Scalar::all(0));
-            cv::Mat matD1(1, 3, CV_32F, cv::Scalar::all(0));
-            cv::Mat matV1(3, 3, CV_32F, cv::Scalar::all(0));
-                    
-            if (pointSearchSqDis[4] < 1.0) {
+            if (mapField)
+            {
+                VoxelLine line;
+                Eigen::Vector3f local;
+                int found = mapField->line(pose * pointOri.getVector3fMap().cast<double>(), line, local);
+                if (found >= 0)
+                {
+                    fieldLookups++;
+                    if (found == 1 && cornerCoeff(local(0), local(1), local(2), line.px, line.py, line.pz, line.dx, line.dy, line.dz, coeff))
+                    {
+                        lidarCloudOriCornerVec[i] = pointOri;
+                        coeffSelCornerVec[i] = coeff;
+                        lidarCloudOriCornerFlag[i] = true;
+                    }
+                    continue;
+                }
+                fieldFallbacks++;
+            }
+
+            Correspondence& cache = cornerCache[i];
+            if (reusable(cache, pointSel, iterCount))
+            {
+                reuses++;
+                if (cache.found && cornerCoeff(pointSel.x, pointSel.y, pointSel.z, cache.p[0], cache.p[1], cache.p[2], cache.p[3], cache.p[4], cache.p[5], coeff))
+                {
+                    lidarCloudOriCornerVec[i] = pointOri;
+                    coeffSelCornerVec[i] = coeff;
+                    lidarCloudOriCornerFlag[i] = true;
+                }
+                continue;
+            }
+            searches++;
+            cache.searched = true;
+            cache.found = false;
+            cache.at = pointSel.getVector3fMap();
+
+            Neighbours<5> nn = knn<5>(*kdtreeCornerFromMap, pointSel);
+            if (nn.full() && nn.sqDistances[4] < 1.0 * levelScale * levelScale) {
                 float cx = 0, cy = 0, cz = 0;
                 for (int j = 0; j < 5; j++) {
-                    cx += lidarCloudCornerFromMapDS->points[pointSearchInd[j]].x;
-                    cy += lidarCloudCornerFromMapDS->points[pointSearchInd[j]].y;
-                    cz += lidarCloudCornerFromMapDS->points[pointSearchInd[j]].z;
+                    cx += lidarCloudCornerFromMapDS->points[nn.indices[j]].x;
+                    cy += lidarCloudCornerFromMapDS->points[nn.indices[j]].y;
+                    cz += lidarCloudCornerFromMapDS->points[nn.indices[j]].z;
                 }
                 cx /= 5; cy /= 5;  cz /= 5;
 
                 float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
                 for (int j = 0; j < 5; j++) {
-                    float ax = lidarCloudCornerFromMapDS->points[pointSearchInd[j]].x - cx;
-                    float ay = lidarCloudCornerFromMapDS->points[pointSearchInd[j]].y - cy;
-                    float az = lidarCloudCornerFromMapDS->points[pointSearchInd[j]].z - cz;
+                    float ax = lidarCloudCornerFromMapDS->points[nn.indices[j]].x - cx;
+                    float ay = lidarCloudCornerFromMapDS->points[nn.indices[j]].y - cy;
+                    float az = lidarCloudCornerFromMapDS->points[nn.indices[j]].z - cz;
 
                     a11 += ax * ax; a12 += ax * ay; a13 += ax * az;
                     a22 += ay * ay; a23 += ay * az;
@@ -177,72 +393,120 @@ class LOAMmapping : public ParamServer
                 }
                 a11 /= 5; a12 /= 5; a13 /= 5; a22 /= 5; a23 /= 5; a33 /= 5;
 
-                matA1.at<float>(0, 0) = a11; matA1.at<float>(0, 1) = a12; matA1.at<float>(0, 2) = a13;
-                matA1.at<float>(1, 0) = a12; matA1.at<float>(1, 1) = a22; matA1.at<float>(1, 2) = a23;
-                matA1.at<float>(2, 0) = a13; matA1.at<float>(2, 1) = a23; matA1.at<float>(2, 2) = a33;
-
-                cv::eigen(matA1, matD1, matV1);
+                cornerFits.push_back(a11, a12, a13, a22, a23, a33);
+                PendingLine pending = {i, pointSel, cx, cy, cz};
+                pendingLines.push_back(pending);
+            }
+        }
 
-                if (matD1.at<float>(0, 0) > 3 * matD1.at<float>(0, 1)) {
+        // all neighbourhoods of this iteration in one go
+        cornerFits.solve();
+        for (int k = 0; k < cornerFits.size(); k++)
+        {
+            if (!(cornerFits.l0[k] > 3 * cornerFits.l1[k]))
+                continue;
+            const PendingLine& pending = pendingLines[k];
+            Correspondence& cache = cornerCache[pending.i];
+            cache.found = true;
+            float line[6] = {pending.cx, pending.cy, pending.cz, cornerFits.vx[k], cornerFits.vy[k], cornerFits.vz[k]};
+            std::copy(line, line + 6, cache.p);
+            PointType coeff;
+            if (cornerCoeff(pending.pointSel.x, pending.pointSel.y, pending.pointSel.z, pending.cx, pending.cy, pending.cz,
+                            cornerFits.vx[k], cornerFits.vy[k], cornerFits.vz[k], coeff))
+            {
+                lidarCloudOriCornerVec[pending.i] = lidarCloudCornerLastDS->points[pending.i];
+                coeffSelCornerVec[pending.i] = coeff;
+                lidarCloudOriCornerFlag[pending.i] = true;
+            }
+        }
+    }
 
-                    float x0 = pointSel.x;
-                    float y0 = pointSel.y;
-                    float z0 = pointSel.z;
-                    float x1 = cx + 0.1 * matV1.at<float>(0, 0);
-                    float y1 = cy + 0.1 * matV1.at<float>(0, 1);
-                    float z1 = cz + 0.1 * matV1.at<float>(0, 2);
-                    float x2 = cx - 0.1 * matV1.at<float>(0, 0);
-                    float y2 = cy - 0.1 * matV1.at<float>(0, 1);
-                    float z2 = cz - 0.1 * matV1.at<float>(0, 2);
+    // point (x0, y0, z0) to the line through (cx, cy, cz) along (vx, vy, vz), false if the weight is too low
+    bool cornerCoeff(float x0, float y0, float z0, float cx, float cy, float cz, float vx, float vy, float vz, PointType& coeff)
+    {
+        float x1 = cx + 0.1 * vx;
+        float y1 = cy + 0.1 * vy;
+        float z1 = cz + 0.1 * vz;
+        float x2 = cx - 0.1 * vx;
+        float y2 = cy - 0.1 * vy;
+        float z2 = cz - 0.1 * vz;
 
-                    float a012 = sqrt(((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) * ((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
-                                    + ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) * ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
-                                    + ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1)) * ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1)));
+        float a012 = sqrt(((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) * ((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
+                        + ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) * ((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
+                        + ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1)) * ((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1)));
 
-                    float l12 = sqrt((x1 - x2)*(x1 - x2) + (y1 - y2)*(y1 - y2) + (z1 - z2)*(z1 - z2));
+        float l12 = sqrt((x1 - x2)*(x1 - x2) + (y1 - y2)*(y1 - y2) + (z1 - z2)*(z1 - z2));
 
-                    float la = ((y1 - y2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
-                              + (z1 - z2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1))) / a012 / l12;
+        float la = ((y1 - y2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
+                  + (z1 - z2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1))) / a012 / l12;
 
-                    float lb = -((x1 - x2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
-                               - (z1 - z2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
+        float lb = -((x1 - x2)*((x0 - x1)*(y0 - y2) - (x0 - x2)*(y0 - y1)) 
+                   - (z1 - z2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
 
-                    float lc = -((x1 - x2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
-                               + (y1 - y2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
+        float lc = -((x1 - x2)*((x0 - x1)*(z0 - z2) - (x0 - x2)*(z0 - z1)) 
+                   + (y1 - y2)*((y0 - y1)*(z0 - z2) - (y0 - y2)*(z0 - z1))) / a012 / l12;
 
-                    float ld2 = a012 / l12;
+        float ld2 = a012 / l12;
 
-                    float s = 1 - 0.9 * fabs(ld2);
+        float s = 1 - 0.9 * fabs(ld2);
 
-                    coeff.x = s * la;
-                    coeff.y = s * lb;
-                    coeff.z = s * lc;
-                    coeff.intensity = s * ld2;
+        coeff.x = s * la;
+        coeff.y = s * lb;
+        coeff.z = s * lc;
+        coeff.intensity = s * ld2;
 
-                    if (s > 0.1) 
-                    {
-                        lidarCloudOriCornerVec[i] = pointOri;
-                        coeffSelCornerVec[i] = coeff;
-                        lidarCloudOriCornerFlag[i] = true;
-                    }
-                }
-            }
-        }
+        return s > 0.1;
     }
 
     void surfOptimization(int iterCount)
     {
-        affine_out = trans2Affine3f(transformTobeMapped);
-
-        for (int i = 0; i < lidarCloudSurfLastDSNum; i++)
+        Eigen::Affine3d pose = affine_out.cast<double>(); // field lookups compose the scan point in double
+        for (int i = 0; i < lidarCloudSurfLastDSNum; i += pointStride)
         {
             PointType pointOri, pointSel, coeff;
-            std::vector<int> pointSearchInd;
-            std::vector<float> pointSearchSqDis;
 
             pointOri = lidarCloudSurfLastDS->points[i];
             pointAssociateToMap(&pointOri, &pointSel); 
-            kdtreeSurfFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
+
+            if (mapField)
+            {
+                VoxelPlane plane;
+                Eigen::Vector3f local;
+                int found = mapField->plane(pose * pointOri.getVector3fMap().cast<double>(), plane, local);
+                if (found >= 0)
+                {
+                    fieldLookups++;
+                    // the distance is taken in the tile frame, the weight still uses the map frame point
+                    if (found == 1 && surfCoeff(plane.nx, plane.ny, plane.nz, plane.nx * local(0) + plane.ny * local(1) + plane.nz * local(2) + plane.d, pointSel, coeff))
+                    {
+                        lidarCloudOriSurfVec[i] = pointOri;
+                        coeffSelSurfVec[i] = coeff;
+                        lidarCloudOriSurfFlag[i] = true;
+                    }
+                    continue;
+                }
+                fieldFallbacks++;
+            }
+
+            Correspondence& cache = surfCache[i];
+            if (reusable(cache, pointSel, iterCount))
+            {
+                reuses++;
+                if (cache.found && surfCoeff(cache.p[0], cache.p[1], cache.p[2],
+                                             cache.p[0] * pointSel.x + cache.p[1] * pointSel.y + cache.p[2] * pointSel.z + cache.p[3], pointSel, coeff))
+                {
+                    lidarCloudOriSurfVec[i] = pointOri;
+                    coeffSelSurfVec[i] = coeff;
+                    lidarCloudOriSurfFlag[i] = true;
+                }
+                continue;
+            }
+            searches++;
+            cache.searched = true;
+            cache.found = false;
+            cache.at = pointSel.getVector3fMap();
+
+            Neighbours<5> nn = knn<5>(*kdtreeSurfFromMap, pointSel);
 
             Eigen::Matrix<float, 5, 3> matA0;
             Eigen::Matrix<float, 5, 1> matB0;
@@ -252,12 +516,12 @@ class LOAMmapping : public ParamServer
             matB0.fill(-1);
             matX0.setZero();
 
-            if (pointSearchSqDis[4] < 1.0) {
+            if (nn.full() && nn.sqDistances[4] < 1.0 * levelScale * levelScale) {
                 for (int j = 0; j < 5; j++) 
                 {
-                    matA0(j, 0) = lidarCloudSurfFromMapDS->points[pointSearchInd[j]].x;
-                    matA0(j, 1) = lidarCloudSurfFromMapDS->points[pointSearchInd[j]].y;
-                    matA0(j, 2) = lidarCloudSurfFromMapDS->points[pointSearchInd[j]].z;
+                    matA0(j, 0) = lidarCloudSurfFromMapDS->points[nn.indices[j]].x;
+                    matA0(j, 1) = lidarCloudSurfFromMapDS->points[nn.indices[j]].y;
+                    matA0(j, 2) = lidarCloudSurfFromMapDS->points[nn.indices[j]].z;
                 }
                 // why Ax = B, means x is the unit normal vector of the plane?
                 matX0 = matA0.colPivHouseholderQr().solve(matB0);
@@ -272,25 +536,19 @@ class LOAMmapping : public ParamServer
 
                 bool planeValid = true;
                 for (int j = 0; j < 5; j++) {
-                    if (fabs(pa * lidarCloudSurfFromMapDS->points[pointSearchInd[j]].x +
-                             pb * lidarCloudSurfFromMapDS->points[pointSearchInd[j]].y +
-                             pc * lidarCloudSurfFromMapDS->points[pointSearchInd[j]].z + pd) > 0.2) {
+                    if (fabs(pa * lidarCloudSurfFromMapDS->points[nn.indices[j]].x +
+                             pb * lidarCloudSurfFromMapDS->points[nn.indices[j]].y +
+                             pc * lidarCloudSurfFromMapDS->points[nn.indices[j]].z + pd) > 0.2 * levelScale) {
                         planeValid = false;
                         break;
                     }
                 }
 
                 if (planeValid) {
+                    cache.found = true;
+                    cache.p[0] = pa; cache.p[1] = pb; cache.p[2] = pc; cache.p[3] = pd;
                     float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
-
-                    float s = 1 - 0.9 * fabs(pd2) / sqrt(sqrt(pointSel.x * pointSel.x
-                            + pointSel.y * pointSel.y + pointSel.z * pointSel.z));
-
-                    coeff.x = s * pa;
-                    coeff.y = s * pb;
-                    coeff.z = s * pc;
-                    coeff.intensity = s * pd2;
-                    if (s > 0.1) {
+                    if (surfCoeff(pa, pb, pc, pd2, pointSel, coeff)) {
                         lidarCloudOriSurfVec[i] = pointOri;
                         coeffSelSurfVec[i] = coeff;
                         lidarCloudOriSurfFlag[i] = true;   
@@ -301,6 +559,19 @@ class LOAMmapping : public ParamServer
         }
     }
 
+    // unit normal (pa, pb, pc) and signed distance pd2 of pointSel, false if the weight is too low
+    bool surfCoeff(float pa, float pb, float pc, float pd2, const PointType& pointSel, PointType& coeff)
+    {
+        float s = 1 - 0.9 * fabs(pd2) / sqrt(sqrt(pointSel.x * pointSel.x
+                + pointSel.y * pointSel.y + pointSel.z * pointSel.z));
+
+        coeff.x = s * pa;
+        coeff.y = s * pb;
+        coeff.z = s * pc;
+        coeff.intensity = s * pd2;
+        return s > 0.1;
+    }
+
     void combineOptimizationCoeffs()
     {
         // combine corner coeffs
@@ -328,175 +599,44 @@ class LOAMmapping : public ParamServer
 
     }
 
+    // Gauss-Newton step in the tangent space of SE(3), perturbed on the right: T <- T Exp(dx), dx = (rotation, translation).
+    // A residual n^T (R p + t) + d of the body frame point p has the Jacobian (p x R^T n, R^T n); coeff holds the
+    // weighted normal s*n and residual s*(n^T q + d), so the weight carries over to both.
     bool LMOptimization(int iterCount)
     {
-        // float s1 = sin(transformTobeMapped[0]);
-        // float c1 = cos(transformTobeMapped[0]);
-        // float s2 = sin(transformTobeMapped[1]);
-        // float c2 = cos(transformTobeMapped[1]);
-        // float s3 = sin(transformTobeMapped[2]);
-        // float c3 = cos(transformTobeMapped[2]);
-
-        // int lidarCloudSelNum = lidarCloudOri->size();
-        // if (lidarCloudSelNum < 50) {
-        //     return false;
-        // }
-
-        // cv::Mat matA(lidarCloudSelNum, 6, CV_32F, cv::Scalar::all(0));
-        // cv::Mat matAt(6, lidarCloudSelNum, CV_32F, cv::Scalar::all(0));
-        // cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
-        // cv::Mat matB(lidarCloudSelNum, 1, CV_32F, cv::Scalar::all(0));
-        // cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
-        // cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
-
-        // PointType pointOri, coeff;
-        // notice  the subscript in wiki is the sequence, not x y z!!!
-        // for (int i = 0; i < lidarCloudSelNum; i++) {
-        //     pointOri.x = lidarCloudOri->points[i].x;
-        //     pointOri.y = lidarCloudOri->points[i].y;
-        //     pointOri.z = lidarCloudOri->points[i].z;
-        //     coeff.x = coeffSel->points[i].x;
-        //     coeff.y = coeffSel->points[i].y;
-        //     coeff.z = coeffSel->points[i].z;
-        //     coeff.intensity = coeffSel->points[i].intensity;
-        //     // type it right the 3rd time. but why so slow?
-        //     float arx = ((-s1*s3+c1*s2*c3)*pointOri.x + (-s1*c3-c1*s2*s3)*pointOri.y - c1*c2*pointOri.z) * coeff.y
-        //               + ((c1*s3+s1*s2*c3)*pointOri.x + (c1*c3-s1*s2*s3)*pointOri.y - s1*c2*pointOri.z) * coeff.z;
-
-        //     float ary = (-s2*c3*pointOri.x + s2*s3*pointOri.y + c2*pointOri.z) * coeff.x
-        //               + (s1*c2*c3*pointOri.x - s1*c2*s3*pointOri.y + s1*s2*pointOri.z) * coeff.y
-        //               + (-c1*c2*c3*pointOri.x + c1*c2*s3*pointOri.y - c1*s2*pointOri.z) * coeff.z;
-
-        //     float arz = (-c2*s3*pointOri.x - c2*c3*pointOri.y)*coeff.x
-        //               + ((c1*c3-s1*s2*s3)*pointOri.x + (-c1*s3-s1*s2*c3)*pointOri.y) * coeff.y
-        //               + ((s1*c3 + c1*s2*s3)*pointOri.x + (-s1*s3+c1*s2*c3)*pointOri.y)*coeff.z;
-        //     matA.at<float>(i, 0) = arx;
-        //     matA.at<float>(i, 1) = ary;
-        //     matA.at<float>(i, 2) = arz;
-        //     matA.at<float>(i, 3) = coeff.x;
-        //     matA.at<float>(i, 4) = coeff.y;
-        //     matA.at<float>(i, 5) = coeff.z;
-        //     matB.at<float>(i, 0) = -coeff.intensity; // -f, no 0.05 here,same in LOAM
-        // }
-
-        // this way much faster, why?
-       // lidar -> camera
-
-        float srx = sin(transformTobeMapped[1]);
-        float crx = cos(transformTobeMapped[1]);
-        float sry = sin(transformTobeMapped[2]);
-        float cry = cos(transformTobeMapped[2]);
-        float srz = sin(transformTobeMapped[0]);
-        float crz = cos(transformTobeMapped[0]);
-
         int lidarCloudSelNum = lidarCloudOri->size();
-
-        cv::Mat matA(lidarCloudSelNum, 6, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAt(6, lidarCloudSelNum, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
-        cv::Mat matB(lidarCloudSelNum, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
-        cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
-
-        PointType pointOri, coeff;
+        Eigen::Matrix3f Rt = R.transpose();
+        Eigen::Matrix<float, 6, 6> H = Eigen::Matrix<float, 6, 6>::Zero();
+        Eigen::Matrix<float, 6, 1> b = Eigen::Matrix<float, 6, 1>::Zero();
         mapRegistrationError.clear(); // only get the last iteration error
         for (int i = 0; i < lidarCloudSelNum; i++) {
-            mapRegistrationError.push_back(fabs(coeffSel->points[i].intensity));
-            // lidar -> camera
-            pointOri.x = lidarCloudOri->points[i].y;
-            pointOri.y = lidarCloudOri->points[i].z;
-            pointOri.z = lidarCloudOri->points[i].x;
-            // lidar -> camera
-            coeff.x = coeffSel->points[i].y;
-            coeff.y = coeffSel->points[i].z;
-            coeff.z = coeffSel->points[i].x;
-            coeff.intensity = coeffSel->points[i].intensity;
-            // in camera
-            float arx = (crx*sry*srz*pointOri.x + crx*crz*sry*pointOri.y - srx*sry*pointOri.z) * coeff.x
-                      + (-srx*srz*pointOri.x - crz*srx*pointOri.y - crx*pointOri.z) * coeff.y
-                      + (crx*cry*srz*pointOri.x + crx*cry*crz*pointOri.y - cry*srx*pointOri.z) * coeff.z;
-
-            float ary = ((cry*srx*srz - crz*sry)*pointOri.x 
-                      + (sry*srz + cry*crz*srx)*pointOri.y + crx*cry*pointOri.z) * coeff.x
-                      + ((-cry*crz - srx*sry*srz)*pointOri.x 
-                      + (cry*srz - crz*srx*sry)*pointOri.y - crx*sry*pointOri.z) * coeff.z;
-
-            float arz = ((crz*srx*sry - cry*srz)*pointOri.x + (-cry*crz-srx*sry*srz)*pointOri.y)*coeff.x
-                      + (crx*crz*pointOri.x - crx*srz*pointOri.y) * coeff.y
-                      + ((sry*srz + cry*crz*srx)*pointOri.x + (crz*sry-cry*srx*srz)*pointOri.y)*coeff.z;
-            // camera -> lidar
-            matA.at<float>(i, 0) = arz;
-            matA.at<float>(i, 1) = arx;
-            matA.at<float>(i, 2) = ary;
-            matA.at<float>(i, 3) = coeff.z;
-            matA.at<float>(i, 4) = coeff.x;
-            matA.at<float>(i, 5) = coeff.y;
-            matB.at<float>(i, 0) = -coeff.intensity;
+            const PointType& coeff = coeffSel->points[i];
+            mapRegistrationError.push_back(fabs(coeff.intensity));
+            Eigen::Vector3f p = lidarCloudOri->points[i].getVector3fMap();
+            Eigen::Vector3f n = Rt * coeff.getVector3fMap();
+            Eigen::Matrix<float, 6, 1> J;
+            J << p.cross(n), n;
+            H.selfadjointView<Eigen::Upper>().rankUpdate(J);
+            b += J * coeff.intensity;
         }
-        cv::transpose(matA, matAt);
-        matAtA = matAt * matA;
-        matAtB = matAt * matB;
-        cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
+        H.triangularView<Eigen::StrictlyLower>() = H.transpose();
+        Eigen::Matrix<double, 6, 6> Hd = H.cast<double>();
+        Eigen::Matrix<double, 6, 1> dx = Hd.colPivHouseholderQr().solve(-b.cast<double>());
 
         if (iterCount == 0) 
         {
-            cv::Mat matE(1, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matVf(6, 6, CV_32F, cv::Scalar::all(0));
-            cv::Mat matVu(6, 6, CV_32F, cv::Scalar::all(0));
-            cv::eigen(matAtA, matE, matVf);
-            matVf.copyTo(matVu);
-
-            isDegenerate = false;
-            float eigenThre[6] = {0,0,0,0,0,0}; // 100 may not be good
-            float degeneracyThre =100;
-            for (int i = 0; i < 6; i++) eigenThre[i] = degeneracyThre;
-            for (int i = 5; i >= 0; i--) {
-                if (matE.at<float>(0, i) < minEigen) minEigen = matE.at<float>(0, i);
-                if (matE.at<float>(0, i) < eigenThre[i]) 
-                {
-                    for (int j = 0; j < 6; j++) 
-                    {
-                        matVu.at<float>(i, j) = 0; // zero out the underconstrained DOFs, which will not be updated on transformTobeMapped
-                    }
-                    isDegenerate = true;
-                }
-                else {
-                    break;
-                }
-            }
-            matP = matVf.inv() * matVu;
+            // eigenvalues below 100 mean an underconstrained direction, it will not be updated
+            projection = degeneracyProjection(Hd, 0, 100);
         }
-        
         if (isDegenerate)
-        {
-            cv::Mat matX2(6, 1, CV_32F, cv::Scalar::all(0));
-            matX.copyTo(matX2);
-            matX = matP * matX2; // here matX is xu', matX2 is xu
-        }
-        
-        transformTobeMapped[0] += matX.at<float>(0, 0);
-        transformTobeMapped[1] += matX.at<float>(1, 0);
-        transformTobeMapped[2] += matX.at<float>(2, 0);
-        transformTobeMapped[3] += matX.at<float>(3, 0);
-        transformTobeMapped[4] += matX.at<float>(4, 0);
-        transformTobeMapped[5] += matX.at<float>(5, 0);
-
-        float deltaR = sqrt(
-                            pow(pcl::rad2deg(matX.at<float>(0, 0)), 2) +
-                            pow(pcl::rad2deg(matX.at<float>(1, 0)), 2) +
-                            pow(pcl::rad2deg(matX.at<float>(2, 0)), 2));
-        float deltaT = sqrt(
-                            pow(matX.at<float>(3, 0) * 100, 2) +
-                            pow(matX.at<float>(4, 0) * 100, 2) +
-                            pow(matX.at<float>(5, 0) * 100, 2));
-
-        if (deltaR < 0.05 && deltaT < 0.05) {
-            return true; // converged
-        }
-        return false; // keep optimizing
-    }
-
+            dx = projection * dx;
 
+        // coarse levels stop at a coarser step, the full resolution one refines
+        bool converged = applyRightUpdate(dx, R, t, levelScale);
+        affine_out.linear() = R;
+        affine_out.translation() = t;
+        return converged;
+    }
 
     void pointAssociateToMap(PointType const * const pi, PointType * const po)
     {
@@ -508,7 +648,7 @@ class LOAMmapping : public ParamServer
 
     void getTransformation(float transformTobeMappedI[6])
     {
-        for (int i = 0; i < 6; i++) transformTobeMappedI[i] = transformTobeMapped[i];
+        Affine3f2Trans(affine_out, transformTobeMappedI);
     }
 
 };
\ No newline at end of file
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "registration.h"
+
+// map as voxel Gaussians (mean and inverse covariance), built once per local map
+class NDTTarget
+{
+    public:
+        typedef std::shared_ptr<NDTTarget> Ptr;
+
+        struct Voxel
+        {
+            Eigen::Vector3f mean;
+            Eigen::Matrix3f infoMat; // inverse covariance
+            Eigen::Vector3f normal;  // direction of least spread, for the point-to-surface error
+        };
+
+        float resolution = 1.0;
+        std::unordered_map<int64_t, int> index; // voxel key -> voxels
+        vector<Voxel> voxels;
+
+        NDTTarget(pcl::PointCloud<PointType>::ConstPtr corner, pcl::PointCloud<PointType>::ConstPtr surf, float resolution_, int minPoints)
+            : resolution(resolution_)
+        {
+            struct Moments
+            {
+                Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+                Eigen::Matrix3d sumSq = Eigen::Matrix3d::Zero();
+                int n = 0;
+            };
+            std::unordered_map<int64_t, Moments> moments;
+            // the sample covariance divides by n - 1, and fewer than 4 points cannot span a volume anyway
+            minPoints = max(minPoints, 4);
+            float invRes = 1.0 / resolution;
+            for (const pcl::PointCloud<PointType>* cloud : {corner.get(), surf.get()})
+                for (const auto& p : cloud->points)
+                {
+                    Moments& m = moments[voxelKey(p.x, p.y, p.z, invRes)];
+                    Eigen::Vector3d v(p.x, p.y, p.z);
+                    m.sum += v;
+                    m.sumSq += v * v.transpose();
+                    m.n++;
+                }
+
+            voxels.reserve(moments.size());
+            for (const auto& it : moments)
+            {
+                const Moments& m = it.second;
+                if (m.n < minPoints)
+                    continue;
+                Eigen::Vector3d mean = m.sum / m.n;
+                Eigen::Matrix3d cov = (m.sumSq - m.n * mean * mean.transpose()) / (m.n - 1);
+                // flat and thin voxels would get an unbounded information matrix, clamp their small axes
+                Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(cov);
+                Eigen::Vector3d lambda = solver.eigenvalues();
+                double minLambda = max(0.01 * lambda(2), 1e-4);
+                for (int k = 0; k < 3; k++)
+                    lambda(k) = max(lambda(k), minLambda);
+                Eigen::Matrix3d V = solver.eigenvectors();
+                Voxel voxel;
+                voxel.mean = mean.cast<float>();
+                voxel.infoMat = (V * lambda.cwiseInverse().asDiagonal() * V.transpose()).cast<float>();
+                voxel.normal = V.col(0).cast<float>();
+                index[it.first] = voxels.size();
+                voxels.push_back(voxel);
+            }
+        }
+
+        const Voxel* find(const Eigen::Vector3f& p) const
+        {
+            auto it = index.find(voxelKey(p(0), p(1), p(2), 1.0 / resolution));
+            return it == index.end() ? nullptr : &voxels[it->second];
+        }
+};
+
+// scan-to-map registration against voxel Gaussians: one hash lookup per point, Gauss-Newton with the 6x6 normal
+// equations accumulated per thread. The inlier error is the distance along the voxel normal, so the temporary
+// mapping thresholds mean the same as with LOAMmapping.
+class NDTmapping : public Registration, public RollConfig
+{
+    private:
+        NDTTarget::Ptr target;
+        vector<Eigen::Vector3f> source;
+        Eigen::Matrix3f R;
+        Eigen::Vector3f t;
+        vector<float> pointError; // point-to-surface distance of the last iteration, -1 without correspondence
+        float targetTime = 0, optTime = 0;
+
+    public:
+        explicit NDTmapping(const RollConfig& config) : RollConfig(config) {}
+
+        string name() const override { return "ndt"; }
+
+        void setTarget(pcl::PointCloud<PointType>::Ptr cornerMap, pcl::PointCloud<PointType>::Ptr surfMap) override
+        {
+            TicToc build;
+            target.reset(new NDTTarget(cornerMap, surfMap, ndtResolution, ndtMinPoints));
+            targetTime = build.toc();
+        }
+
+        void setSource(pcl::PointCloud<PointType>::Ptr corner, pcl::PointCloud<PointType>::Ptr surf) override
+        {
+            source.clear();
+            source.reserve(corner->size() + surf->size());
+            for (const pcl::PointCloud<PointType>* cloud : {corner.get(), surf.get()})
+                for (const auto& p : cloud->points)
+                    source.push_back(p.getVector3fMap());
+            pointError.assign(source.size(), -1);
+        }
+
+        void align(const Eigen::Affine3f& guess) override
+        {
+            TicToc opt;
+            R = guess.rotation();
+            t = guess.translation();
+            iterate(optIteration, [this](int iteration) { return optimizationStep(iteration); });
+            affine_out.linear() = R;
+            affine_out.translation() = t;
+            pointErrorStats(pointError, inlierThreshold);
+            optTime = opt.toc();
+        }
+
+        string stats() const override
+        {
+            std::ostringstream ss;
+            ss << target->voxels.size() << " voxels (" << targetTime << " ms), " << optTime << " ms, " << iterCount << " iterations";
+            if (budgetLimited)
+                ss << ", budget limited, point stride " << pointStride;
+            return ss.str();
+        }
+
+        // one Gauss-Newton step, true once converged
+        bool optimizationStep(int iterCount)
+        {
+            Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();
+            Eigen::Matrix<double, 6, 1> b = Eigen::Matrix<double, 6, 1>::Zero();
+            int sourceSize = source.size();
+            int correspondences = 0;
+
+            std::fill(pointError.begin(), pointError.end(), -1);
+            #pragma omp parallel num_threads(numberOfCores)
+            {
+                Eigen::Matrix<double, 6, 6> Hi = Eigen::Matrix<double, 6, 6>::Zero();
+                Eigen::Matrix<double, 6, 1> bi = Eigen::Matrix<double, 6, 1>::Zero();
+                int ci = 0;
+                #pragma omp for schedule(static) nowait
+                for (int i = 0; i < sourceSize; i += pointStride)
+                {
+                    Eigen::Vector3f Rp = R * source[i];
+                    Eigen::Vector3f q = Rp + t;
+                    const NDTTarget::Voxel* voxel = target->find(q);
+                    if (voxel == nullptr)
+                        continue;
+                    Eigen::Vector3f e = q - voxel->mean;
+                    float distance = fabs(voxel->normal.dot(e));
+                    // same down-weighting of far points as the LOAM matcher
+                    float s = 1 - 0.9 * distance;
+                    if (s <= 0.1)
+                        continue;
+                    pointError[i] = distance;
+                    Eigen::Matrix<float, 3, 6> J;
+                    J.leftCols<3>() = -skewSymmetric(Rp);
+                    J.rightCols<3>().setIdentity();
+                    Eigen::Matrix<float, 6, 3> JtW = J.transpose() * (s * voxel->infoMat);
+                    Hi += (JtW * J).cast<double>();
+                    bi += (JtW * e).cast<double>();
+                    ci++;
+                }
+                #pragma omp critical
+                {
+                    H += Hi;
+                    b += bi;
+                    correspondences += ci;
+                }
+            }
+            return gaussNewtonUpdate(H, b, correspondences, iterCount, R, t);
+        }
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// fixed-capacity FIFO between two pipeline threads: push blocks while it is full, pop while it is empty, so a slow
+// stage holds the one before it back instead of letting frames pile up. close() wakes everyone up for shutdown.
+template <typename T>
+class BoundedQueue
+{
+    public:
+        explicit BoundedQueue(size_t capacity_) : capacity(std::max<size_t>(capacity_, 1)) {}
+
+        // false once closed, the item is dropped then
+        bool push(T item)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+            if (closed)
+                return false;
+            items.push_back(std::move(item));
+            notEmpty.notify_one();
+            return true;
+        }
+
+        // false once closed, whatever is still queued is dropped
+        bool pop(T& item)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+            if (closed)
+                return false;
+            item = std::move(items.front());
+            items.pop_front();
+            notFull.notify_one();
+            return true;
+        }
+
+        // blocks until a push would not, so a single producer can pick its input as late as possible
+        bool waitForSpace()
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+            return !closed;
+        }
+
+        // returns how many queued items are dropped
+        size_t close()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            size_t dropped = closed ? 0 : items.size();
+            closed = true;
+            notFull.notify_all();
+            notEmpty.notify_all();
+            return dropped;
+        }
+
+        size_t size()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return items.size();
+        }
+
+    private:
+        const size_t capacity;
+        std::deque<T> items;
+        bool closed = false;
+        std::mutex mtx;
+        std::condition_variable notFull;
+        std::condition_variable notEmpty;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+
+#include "rollCommon.h"
+#include "MISC/nanoflann.hpp"
+
+// result of a search for the K nearest neighbours, closest first; only the first size entries are valid
+template <int K>
+struct Neighbours
+{
+    std::array<int, K> indices;
+    std::array<float, K> sqDistances;
+    int size = 0;
+
+    bool full() const { return size == K; }
+};
+
+// nanoflann kd-tree straight on a pcl cloud: no copy of the points, the cloud is shared and must stay unchanged until
+// the next setInputCloud. Neighbours can be written to caller arrays, so a query allocates nothing.
+// Queries are const and may run from several threads.
+class CloudKdTree
+{
+    public:
+        typedef std::shared_ptr<CloudKdTree> Ptr;
+
+        // interface expected by nanoflann
+        struct Adaptor
+        {
+            pcl::PointCloud<PointType>::ConstPtr cloud;
+
+            inline size_t kdtree_get_point_count() const { return cloud ? cloud->size() : 0; }
+
+            inline float kdtree_get_pt(const size_t idx, const size_t dim) const
+            {
+                const PointType& p = cloud->points[idx];
+                return dim == 0 ? p.x : (dim == 1 ? p.y : p.z);
+            }
+
+            template <class BBOX>
+            bool kdtree_get_bbox(BBOX&) const { return false; }
+        };
+        typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<float, Adaptor>, Adaptor, 3, int> Index;
+
+        void setInputCloud(const pcl::PointCloud<PointType>::ConstPtr& cloud)
+        {
+            adaptor.cloud = cloud;
+            index.reset(new Index(3, adaptor, nanoflann::KDTreeSingleIndexAdaptorParams(leafMaxSize)));
+            index->buildIndex();
+        }
+
+        pcl::PointCloud<PointType>::ConstPtr getInputCloud() const { return adaptor.cloud; }
+
+        // the k nearest points, closest first, into arrays with room for k; returns how many were found
+        int nearestKSearch(const PointType& point, int k, int* indices, float* sqDistances) const
+        {
+            if (!index || k <= 0)
+                return 0;
+            nanoflann::KNNResultSet<float, int> resultSet(k);
+            resultSet.init(indices, sqDistances);
+            float query[3] = {point.x, point.y, point.z};
+            index->findNeighbors(resultSet, query, nanoflann::SearchParams());
+            return resultSet.size();
+        }
+
+        // fixed K, the result lives on the stack
+        template <int K>
+        Neighbours<K> knn(const PointType& point) const
+        {
+            Neighbours<K> result;
+            result.size = nearestKSearch(point, K, result.indices.data(), result.sqDistances.data());
+            return result;
+        }
+
+        // same as pcl::KdTreeFLANN, for callers outside the hot loops
+        int nearestKSearch(const PointType& point, int k, std::vector<int>& indices, std::vector<float>& sqDistances) const
+        {
+            indices.resize(max(k, 0));
+            sqDistances.resize(max(k, 0));
+            int found = nearestKSearch(point, k, indices.data(), sqDistances.data());
+            indices.resize(found);
+            sqDistances.resize(found);
+            return found;
+        }
+
+        // all points within radius, closest first
+        int radiusSearch(const PointType& point, double radius, std::vector<int>& indices, std::vector<float>& sqDistances) const
+        {
+            indices.clear();
+            sqDistances.clear();
+            if (!index)
+                return 0;
+            std::vector<std::pair<int, float>> matches;
+            float query[3] = {point.x, point.y, point.z};
+            index->radiusSearch(query, radius * radius, matches, nanoflann::SearchParams());
+            indices.reserve(matches.size());
+            sqDistances.reserve(matches.size());
+            for (const auto& match : matches)
+            {
+                indices.push_back(match.first);
+                sqDistances.push_back(match.second);
+            }
+            return matches.size();
+        }
+
+    private:
+        static const int leafMaxSize = 10;
+        Adaptor adaptor;
+        std::unique_ptr<Index> index;
+};
+
+// knn<K>(tree, point) for every spatial index in use
+template <int K>
+Neighbours<K> knn(const CloudKdTree& kdtree, const PointType& point)
+{
+    return kdtree.knn<K>(point);
+}
+
+// pcl only fills vectors, these are reused per thread so repeated searches do not allocate
+template <int K>
+Neighbours<K> knn(const pcl::KdTreeFLANN<PointType>& kdtree, const PointType& point)
+{
+    static thread_local std::vector<int> indices;
+    static thread_local std::vector<float> sqDistances;
+    Neighbours<K> result;
+    result.size = min<int>(kdtree.nearestKSearch(point, K, indices, sqDistances), K);
+    std::copy(indices.begin(), indices.begin() + result.size, result.indices.begin());
+    std::copy(sqDistances.begin(), sqDistances.begin() + result.size, result.sqDistances.begin());
+    return result;
+}
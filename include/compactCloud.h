@@ -0,0 +1,188 @@
+#pragma once
+
+#include "rollCommon.h"
+
+// keyframe feature cloud stored as int16 coordinates (SoA) in the keyframe frame, 6 bytes per point (+2 with intensity)
+// instead of the 32 bytes of a padded PointXYZI. The step is the requested resolution unless the cloud reaches
+// farther than int16 allows at that step, then it is coarsened for this cloud only.
+class CompactCloud
+{
+    public:
+        typedef std::shared_ptr<CompactCloud> Ptr;
+        typedef std::shared_ptr<const CompactCloud> ConstPtr;
+
+        float scale = 0.01;          // meters per unit
+        float intensityScale = 0;    // intensity per unit, 0 if intensity is dropped
+        vector<int16_t> x, y, z;
+        vector<uint16_t> intensity;  // empty if dropped
+
+        size_t size() const { return x.size(); }
+        bool empty() const { return x.empty(); }
+
+        size_t bytes() const
+        {
+            return sizeof(CompactCloud) + 3 * x.capacity() * sizeof(int16_t) + intensity.capacity() * sizeof(uint16_t);
+        }
+
+        static Ptr encode(const pcl::PointCloud<PointType>& cloud, float resolution, bool keepIntensity)
+        {
+            Ptr out(new CompactCloud());
+            int cloudSize = cloud.size();
+            float maxAbs = 0, maxIntensity = 0;
+            for (const auto& p : cloud.points)
+            {
+                maxAbs = max(maxAbs, max(fabs(p.x), max(fabs(p.y), fabs(p.z))));
+                maxIntensity = max(maxIntensity, p.intensity);
+            }
+            out->scale = max(resolution, maxAbs / 32767.0f);
+            float inv = 1.0 / out->scale;
+            out->x.resize(cloudSize);
+            out->y.resize(cloudSize);
+            out->z.resize(cloudSize);
+            for (int i = 0; i < cloudSize; i++)
+            {
+                const auto& p = cloud.points[i];
+                out->x[i] = (int16_t)max(-32767l, min(32767l, lrintf(p.x * inv)));
+                out->y[i] = (int16_t)max(-32767l, min(32767l, lrintf(p.y * inv)));
+                out->z[i] = (int16_t)max(-32767l, min(32767l, lrintf(p.z * inv)));
+            }
+            if (keepIntensity)
+            {
+                out->intensityScale = maxIntensity > 0 ? maxIntensity / 65535.0f : 1.0f;
+                float invI = 1.0 / out->intensityScale;
+                out->intensity.resize(cloudSize);
+                for (int i = 0; i < cloudSize; i++)
+                    out->intensity[i] = (uint16_t)max(0l, min(65535l, lrintf(cloud.points[i].intensity * invI)));
+            }
+            return out;
+        }
+
+        // decode into the given frame, one pass over the SoA arrays so the compiler can vectorize it
+        void decode(const Eigen::Affine3f& trans, pcl::PointCloud<PointType>& out) const
+        {
+            int cloudSize = size();
+            out.resize(cloudSize);
+            Eigen::Matrix3f R = trans.linear() * scale;
+            Eigen::Vector3f t = trans.translation();
+            const float r00 = R(0,0), r01 = R(0,1), r02 = R(0,2);
+            const float r10 = R(1,0), r11 = R(1,1), r12 = R(1,2);
+            const float r20 = R(2,0), r21 = R(2,1), r22 = R(2,2);
+            const float t0 = t(0), t1 = t(1), t2 = t(2);
+            const int16_t* px = x.data();
+            const int16_t* py = y.data();
+            const int16_t* pz = z.data();
+            PointType* po = out.points.data();
+            #pragma omp simd
+            for (int i = 0; i < cloudSize; ++i)
+            {
+                float fx = px[i], fy = py[i], fz = pz[i];
+                po[i].x = r00 * fx + r01 * fy + r02 * fz + t0;
+                po[i].y = r10 * fx + r11 * fy + r12 * fz + t1;
+                po[i].z = r20 * fx + r21 * fy + r22 * fz + t2;
+            }
+            if (intensity.empty())
+            {
+                for (int i = 0; i < cloudSize; ++i)
+                    po[i].intensity = 0;
+            }
+            else
+            {
+                const uint16_t* pi = intensity.data();
+                #pragma omp simd
+                for (int i = 0; i < cloudSize; ++i)
+                    po[i].intensity = pi[i] * intensityScale;
+            }
+        }
+
+        void decode(pcl::PointCloud<PointType>& out) const
+        {
+            decode(Eigen::Affine3f::Identity(), out);
+        }
+
+        pcl::PointCloud<PointType>::Ptr toCloud() const
+        {
+            pcl::PointCloud<PointType>::Ptr out(new pcl::PointCloud<PointType>());
+            decode(*out);
+            return out;
+        }
+
+        // distance to the farthest point
+        float range() const
+        {
+            int64_t maxSq = 0;
+            for (size_t i = 0; i < size(); i++)
+                maxSq = max(maxSq, (int64_t)x[i]*x[i] + (int64_t)y[i]*y[i] + (int64_t)z[i]*z[i]);
+            return sqrt((double)maxSq) * scale;
+        }
+
+        // compact keyframe file: "RCKF", version, point count, flags, scale, intensity scale, then the arrays
+        bool save(const string& fileName) const
+        {
+            FILE* file = fopen(fileName.c_str(), "wb");
+            if (file == nullptr)
+                return false;
+            uint32_t header[4] = {0x464b4352, 1, (uint32_t)size(), intensity.empty() ? 0u : 1u};
+            fwrite(header, sizeof(uint32_t), 4, file);
+            fwrite(&scale, sizeof(float), 1, file);
+            fwrite(&intensityScale, sizeof(float), 1, file);
+            fwrite(x.data(), sizeof(int16_t), size(), file);
+            fwrite(y.data(), sizeof(int16_t), size(), file);
+            fwrite(z.data(), sizeof(int16_t), size(), file);
+            if (!intensity.empty())
+                fwrite(intensity.data(), sizeof(uint16_t), size(), file);
+            bool ok = !ferror(file);
+            return fclose(file) == 0 && ok;
+        }
+
+        static Ptr load(const string& fileName)
+        {
+            FILE* file = fopen(fileName.c_str(), "rb");
+            if (file == nullptr)
+                return nullptr;
+            Ptr out(new CompactCloud());
+            uint32_t header[4];
+            bool ok = fread(header, sizeof(uint32_t), 4, file) == 4 && header[0] == 0x464b4352 && header[1] == 1;
+            ok = ok && fread(&out->scale, sizeof(float), 1, file) == 1;
+            ok = ok && fread(&out->intensityScale, sizeof(float), 1, file) == 1;
+            // the point count must match the file size before anything is allocated for it, a truncated or corrupt
+            // file would otherwise ask for gigabytes
+            if (ok)
+            {
+                long dataStart = ftell(file);
+                ok = dataStart >= 0 && fseek(file, 0, SEEK_END) == 0;
+                int64_t dataSize = ok ? (int64_t)ftell(file) - dataStart : -1;
+                ok = ok && fseek(file, dataStart, SEEK_SET) == 0;
+                int64_t expected = (int64_t)header[2] * (3 * sizeof(int16_t) + (header[3] & 1u ? sizeof(uint16_t) : 0));
+                ok = ok && expected == dataSize;
+            }
+            if (ok)
+            {
+                size_t n = header[2];
+                out->x.resize(n);
+                out->y.resize(n);
+                out->z.resize(n);
+                ok = fread(out->x.data(), sizeof(int16_t), n, file) == n
+                  && fread(out->y.data(), sizeof(int16_t), n, file) == n
+                  && fread(out->z.data(), sizeof(int16_t), n, file) == n;
+                if (ok && header[3] & 1u)
+                {
+                    out->intensity.resize(n);
+                    ok = fread(out->intensity.data(), sizeof(uint16_t), n, file) == n;
+                }
+            }
+            fclose(file);
+            return ok ? out : nullptr;
+        }
+
+        // keyframe cloud saved by the mapping node, fileName without extension: .ckf is preferred and .pcd is the fallback
+        static Ptr loadKeyframe(const string& fileName, float resolution, bool keepIntensity)
+        {
+            Ptr cloud = load(fileName + ".ckf");
+            if (cloud)
+                return cloud;
+            pcl::PointCloud<PointType>::Ptr pcdCloud(new pcl::PointCloud<PointType>());
+            if (pcl::io::loadPCDFile<PointType> (fileName + ".pcd", *pcdCloud) == -1) 
+                cout<< "Couldn't read file"+ fileName + ".pcd" <<endl;
+            return encode(*pcdCloud, resolution, keepIntensity);
+        }
+};
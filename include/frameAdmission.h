@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// which of the buffered LiDAR frames the mapping pipeline takes (roll/admissionPolicy):
+//   latest  - only the newest frame, everything older is dropped (lowest latency)
+//   backlog - all frames in order while at most admissionBacklog wait, the oldest beyond that are dropped
+//   nth     - every admissionNth-th synchronized frame
+// Every frame taken from the buffer is either published or counted under the reason it was dropped, frames still
+// buffered at shutdown are not. The latency from the frame stamp to its pose publish gives the percentiles. Shared
+// by the ROS callbacks and the pipeline threads.
+class FrameAdmission
+{
+    public:
+        enum Policy { LATEST, BACKLOG, NTH };
+
+        static bool parsePolicy(const std::string& name, Policy& policy)
+        {
+            if (name == "latest") policy = LATEST;
+            else if (name == "backlog") policy = BACKLOG;
+            else if (name == "nth") policy = NTH;
+            else return false;
+            return true;
+        }
+
+        static std::string policyName(Policy policy)
+        {
+            return policy == LATEST ? "latest" : (policy == BACKLOG ? "backlog" : "nth");
+        }
+
+        FrameAdmission(Policy policy_, int backlog_, int nth_)
+            : policy(policy_), backlog(std::max(backlog_, 1)), nth(std::max(nth_, 1)) {}
+
+        Policy getPolicy() const { return policy; }
+
+        void received()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            receivedCount++;
+        }
+
+        // how many of the oldest buffered frames to drop before the next one is taken
+        int trim(int buffered)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            int drop = 0;
+            if (policy == LATEST)
+                drop = std::max(buffered - 1, 0);
+            else if (policy == BACKLOG)
+                drop = std::max(buffered - backlog, 0);
+            droppedPolicy += drop;
+            return drop;
+        }
+
+        // a synchronized frame: false if the policy skips it
+        bool admit()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (policy == NTH && candidates++ % nth != 0)
+            {
+                droppedPolicy++;
+                return false;
+            }
+            return true;
+        }
+
+        // no odometry within the sync tolerance
+        void unsynced()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            droppedUnsynced++;
+        }
+
+        // closer than 1 / globalMatchingRate to the previous frame
+        void throttled()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            droppedRate++;
+        }
+
+        // admitted but not published: not registered (no relocalization yet) or cut off in the queue by the shutdown
+        void droppedInPipeline(int count = 1)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            droppedPipeline += count;
+        }
+
+        // pose published, latency from the frame stamp
+        void published(double latencyMs)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            publishedCount++;
+            latencies.push_back(latencyMs);
+            if ((int)latencies.size() > latencyWindow)
+                latencies.pop_front();
+        }
+
+        // received, published, dropped by the policy, unsynced, by the rate limit and in the pipeline, then p50 and
+        // p99 latency in ms over the last latencyWindow frames
+        std::vector<double> summary()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return {(double)receivedCount, (double)publishedCount, (double)droppedPolicy, (double)droppedUnsynced,
+                    (double)droppedRate, (double)droppedPipeline, percentile(0.5), percentile(0.99)};
+        }
+
+        std::string stats()
+        {
+            std::vector<double> s = summary();
+            std::ostringstream ss;
+            ss << "admission " << policyName(policy) << ": " << s[0] << " frames received, " << s[1] << " published, dropped "
+               << s[2] << " by the policy, " << s[3] << " unsynced, " << s[4] << " by the rate limit, " << s[5]
+               << " in the pipeline; latency p50 " << s[6] << " ms, p99 " << s[7] << " ms";
+            return ss.str();
+        }
+
+    private:
+        static const int latencyWindow = 1000;
+
+        const Policy policy;
+        const int backlog;
+        const int nth;
+        long candidates = 0;
+
+        long receivedCount = 0;
+        long publishedCount = 0;
+        long droppedPolicy = 0;
+        long droppedUnsynced = 0;
+        long droppedRate = 0;
+        long droppedPipeline = 0;
+        std::deque<double> latencies;
+        std::mutex mtx;
+
+        // nearest rank, 0 without samples; called with mtx held
+        double percentile(double p) const
+        {
+            if (latencies.empty())
+                return 0;
+            std::vector<double> sorted(latencies.begin(), latencies.end());
+            size_t rank = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+            std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+            return sorted[rank];
+        }
+};
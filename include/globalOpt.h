@@ -13,22 +13,22 @@
 
 #include <vector>
 #include <map>
+#include <memory>
 #include <iostream>
 #include <mutex>
 #include <thread>
 #include <eigen3/Eigen/Dense>
 #include <eigen3/Eigen/Geometry>
-#include <ceres/ceres.h>
-#include <nav_msgs/Odometry.h>
-#include <nav_msgs/Path.h>
 
 #include "tic_toc.h"
+#include "traceRecorder.h"
 using namespace std;
 
 class GlobalOptimization
 {
 public:
-	GlobalOptimization(int maxNo);
+	// without runThread nothing optimizes in the background, optimizeOnce is called by hand (benchmarks)
+	GlobalOptimization(int maxNo, bool runThread = true);
 	~GlobalOptimization();
 	void setTgl(Eigen::Matrix4d mat);
 	void getTgl(Eigen::Matrix4d &tgl);
@@ -40,14 +40,13 @@ public:
 	void getGlobalAffine(Eigen::Affine3f &Tml);
 
 	void resetOptimization(Eigen::Matrix4d Tgl);
-	nav_msgs::Path global_path;
+	void optimizeOnce();
 
 	bool isInitialized;
 	bool reInitialize;
 private:
 	// void GPS2XYZ(double latitude, double longitude, double altitude, double* xyz);
 	void optimize();
-	void updateGlobalPath();
 
 	// format t, tx,ty,tz,qw,qx,qy,qz
 	map<double, vector<double>> localPoseMap;
@@ -58,7 +57,7 @@ private:
 	bool newGPS;
 	bool newGlobalLocPose;
 	// GeographicLib::LocalCartesian geoConverter;
-	std::mutex mPoseMap;
+	TracedMutex mPoseMap{ROLL_TRACED_MUTEX_NAMES("globalOpt/mPoseMap")};
 	Eigen::Matrix4d WGlobal_T_WLocal;
 	Eigen::Vector3d lastP;
 	Eigen::Quaterniond lastQ;
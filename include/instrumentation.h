@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "traceRecorder.h"
+
+// HDR-style latency histogram in microseconds: 8 linear sub-buckets per power of two, so every value is kept to
+// within 12.5% from 1 us to hours in 256 counters. Written by its owning thread only, read by any thread; relaxed
+// atomics without read-modify-write, so recording costs a few plain loads and stores.
+class LatencyHistogram
+{
+    public:
+        static const int subBuckets = 8;
+        static const int bucketCount = 32 * subBuckets;
+
+        LatencyHistogram()
+        {
+            for (auto& c : counts) c.store(0, std::memory_order_relaxed);
+        }
+
+        static int bucketOf(uint64_t us)
+        {
+            if (us < subBuckets)
+                return us;
+            int e = 63 - __builtin_clzll(us); // >= 3
+            int b = (e - 2) * subBuckets + ((us >> (e - 3)) & (subBuckets - 1));
+            return std::min(b, bucketCount - 1);
+        }
+
+        // middle of the bucket
+        static double bucketValue(int b)
+        {
+            if (b < subBuckets)
+                return b;
+            int e = b / subBuckets + 2;
+            uint64_t width = 1ull << (e - 3);
+            return (double)((subBuckets + b % subBuckets) * width) + 0.5 * (width - 1);
+        }
+
+        void record(uint64_t us)
+        {
+            add(counts[bucketOf(us)], 1);
+            add(total, 1);
+            add(sumUs, us);
+            if (us > maxUs.load(std::memory_order_relaxed))
+                maxUs.store(us, std::memory_order_relaxed);
+        }
+
+        std::array<std::atomic<uint64_t>, bucketCount> counts;
+        std::atomic<uint64_t> total{0};
+        std::atomic<uint64_t> sumUs{0};
+        std::atomic<uint64_t> maxUs{0};
+
+    private:
+        static void add(std::atomic<uint64_t>& a, uint64_t v)
+        {
+            a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        }
+};
+
+// one named stage, merged over all threads
+struct StageStats
+{
+    std::string stage;
+    uint64_t count = 0;
+    double meanMs = 0, p50Ms = 0, p90Ms = 0, p99Ms = 0, maxMs = 0;
+};
+
+// process-wide registry of named stages; every thread records into its own histograms, the first time a thread
+// records a stage is the only time a lock is taken. Disabled (the default) a scope costs one relaxed load.
+class Instrumentation
+{
+    public:
+        static const int maxStages = 64;
+
+        static Instrumentation& instance()
+        {
+            static Instrumentation registry;
+            return registry;
+        }
+
+        static bool enabled() { return enabledFlag().load(std::memory_order_relaxed); }
+        static void setEnabled(bool on) { enabledFlag().store(on, std::memory_order_relaxed); }
+
+        // -1 once maxStages names are in use
+        int stageId(const std::string& name)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = std::find(stageNames.begin(), stageNames.end(), name);
+            if (it != stageNames.end())
+                return it - stageNames.begin();
+            if ((int)stageNames.size() >= maxStages)
+                return -1;
+            stageNames.push_back(name);
+            return stageNames.size() - 1;
+        }
+
+        void record(int stage, uint64_t us)
+        {
+            if (stage < 0 || stage >= maxStages)
+                return;
+            ThreadHistograms& local = threadHistograms();
+            LatencyHistogram* histogram = local.stages[stage].load(std::memory_order_acquire);
+            if (histogram == nullptr)
+            {
+                histogram = new LatencyHistogram();
+                local.stages[stage].store(histogram, std::memory_order_release);
+            }
+            histogram->record(us);
+        }
+
+        // stages with samples, in registration order
+        std::vector<StageStats> snapshot()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::vector<StageStats> result;
+            for (int s = 0; s < (int)stageNames.size(); s++)
+            {
+                std::array<uint64_t, LatencyHistogram::bucketCount> merged{};
+                uint64_t total = 0, sumUs = 0, maxUs = 0;
+                for (const auto& thread : threads)
+                {
+                    const LatencyHistogram* h = thread->stages[s].load(std::memory_order_acquire);
+                    if (h == nullptr)
+                        continue;
+                    for (int b = 0; b < LatencyHistogram::bucketCount; b++)
+                        merged[b] += h->counts[b].load(std::memory_order_relaxed);
+                    total += h->total.load(std::memory_order_relaxed);
+                    sumUs += h->sumUs.load(std::memory_order_relaxed);
+                    maxUs = std::max(maxUs, h->maxUs.load(std::memory_order_relaxed));
+                }
+                if (total == 0)
+                    continue;
+                StageStats stats;
+                stats.stage = stageNames[s];
+                stats.count = total;
+                stats.meanMs = sumUs * 1e-3 / total;
+                stats.p50Ms = percentile(merged, total, 0.5);
+                stats.p90Ms = percentile(merged, total, 0.9);
+                stats.p99Ms = percentile(merged, total, 0.99);
+                stats.maxMs = maxUs * 1e-3;
+                result.push_back(stats);
+            }
+            return result;
+        }
+
+        // one row per stage, cumulative since start; the header is written with the first rows
+        bool appendCsv(const std::string& fileName, double time, const std::vector<StageStats>& stats)
+        {
+            std::lock_guard<std::mutex> lock(mtxCsv);
+            std::ofstream file(fileName, std::ios::app);
+            if (!file)
+                return false;
+            if (file.tellp() == 0)
+                file << "time,stage,count,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+            file << std::fixed << std::setprecision(3);
+            for (const auto& s : stats)
+                file << time << "," << s.stage << "," << s.count << "," << s.meanMs << "," << s.p50Ms << ","
+                     << s.p90Ms << "," << s.p99Ms << "," << s.maxMs << "\n";
+            return true;
+        }
+
+    private:
+        struct ThreadHistograms
+        {
+            std::array<std::atomic<LatencyHistogram*>, maxStages> stages;
+            ThreadHistograms() { for (auto& s : stages) s.store(nullptr); }
+            ~ThreadHistograms() { for (auto& s : stages) delete s.load(); }
+        };
+
+        std::mutex mtx;
+        std::mutex mtxCsv;
+        std::vector<std::string> stageNames;
+        // owned here rather than by the threads, a finished thread's samples stay in the totals
+        std::vector<std::unique_ptr<ThreadHistograms>> threads;
+
+        static std::atomic<bool>& enabledFlag()
+        {
+            static std::atomic<bool> flag{false};
+            return flag;
+        }
+
+        ThreadHistograms& threadHistograms()
+        {
+            static thread_local ThreadHistograms* local = nullptr;
+            if (local == nullptr)
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                threads.emplace_back(new ThreadHistograms());
+                local = threads.back().get();
+            }
+            return *local;
+        }
+
+        static double percentile(const std::array<uint64_t, LatencyHistogram::bucketCount>& counts, uint64_t total, double p)
+        {
+            uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p * total + 0.5));
+            uint64_t seen = 0;
+            for (int b = 0; b < LatencyHistogram::bucketCount; b++)
+            {
+                seen += counts[b];
+                if (seen >= rank)
+                    return LatencyHistogram::bucketValue(b) * 1e-3;
+            }
+            return LatencyHistogram::bucketValue(LatencyHistogram::bucketCount - 1) * 1e-3;
+        }
+};
+
+// times the enclosing scope into a stage; reads no clock while instrumentation is disabled
+class ScopedStage
+{
+    public:
+        explicit ScopedStage(int stage_) : stage(Instrumentation::enabled() ? stage_ : -1)
+        {
+            if (stage >= 0)
+                start = std::chrono::steady_clock::now();
+        }
+
+        ~ScopedStage()
+        {
+            if (stage >= 0)
+                Instrumentation::instance().record(stage, std::chrono::duration_cast<std::chrono::microseconds>(
+                                                              std::chrono::steady_clock::now() - start).count());
+        }
+
+    private:
+        int stage;
+        std::chrono::steady_clock::time_point start;
+};
+
+#define ROLL_STAGE_CONCAT_(a, b) a##b
+#define ROLL_STAGE_CONCAT(a, b) ROLL_STAGE_CONCAT_(a, b)
+// ROLL_STAGE("mapping/registration"); times the rest of the scope, the name is looked up once per call site. The
+// scope is also a trace event, name must be a string literal.
+#define ROLL_STAGE(name) \
+    static const int ROLL_STAGE_CONCAT(rollStageId, __LINE__) = Instrumentation::instance().stageId(name); \
+    ScopedStage ROLL_STAGE_CONCAT(rollStage, __LINE__)(ROLL_STAGE_CONCAT(rollStageId, __LINE__)); \
+    TraceScope ROLL_STAGE_CONCAT(rollStageTrace, __LINE__)(name, "stage")
+// ROLL_STAGE_RECORD("feature/sort", ms); for times summed up by hand, e.g. over a loop
+#define ROLL_STAGE_RECORD(name, ms) \
+    do { \
+        static const int rollStageId = Instrumentation::instance().stageId(name); \
+        if (Instrumentation::enabled()) \
+            Instrumentation::instance().record(rollStageId, (uint64_t)((ms) * 1000)); \
+    } while (0)
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "rollCommon.h"
+#include "cloudKdTree.h"
+#include "keyframeStore.h"
+
+/*
+    * A point cloud type that has 6D pose info ([x,y,z,roll,pitch,yaw] intensity is time stamp)
+    */
+
+struct PointXYZIRPYT
+{
+    PCL_ADD_POINT4D
+    PCL_ADD_INTENSITY;                  // preferred way of adding a XYZ+padding
+    float roll;
+    float pitch;
+    float yaw;
+    double time;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW   // make sure our new allocators are aligned
+} EIGEN_ALIGN16;                    // enforce SSE padding for correct memory alignment
+
+POINT_CLOUD_REGISTER_POINT_STRUCT (PointXYZIRPYT,
+                                   (float, x, x) (float, y, y)
+                                   (float, z, z) (float, intensity, intensity)
+                                   (float, roll, roll) (float, pitch, pitch) (float, yaw, yaw)
+                                   (double, time, time))
+
+typedef PointXYZIRPYT  PointTypePose;
+
+// keyframe poses and clouds, and the scan-to-map local map fused from the keyframes around the current pose: the
+// part of the mapping front end that the mapping node and roll_replay share, so both select keyframes and build
+// local maps alike. Not synchronized, the owner guards the keyframes against its other threads.
+class KeyframeMap
+{
+    public:
+        pcl::PointCloud<PointType>::Ptr cloudKeyPoses3D{new pcl::PointCloud<PointType>()}; // intensity is the keyframe index
+        pcl::PointCloud<PointTypePose>::Ptr cloudKeyPoses6D{new pcl::PointCloud<PointTypePose>()};
+        KeyframeStore cornerCloudKeyFrames;
+        KeyframeStore surfCloudKeyFrames;
+
+        // local map, fused from the keyframes and downsampled
+        pcl::PointCloud<PointType>::Ptr lidarCloudCornerFromMap{new pcl::PointCloud<PointType>()};
+        pcl::PointCloud<PointType>::Ptr lidarCloudSurfFromMap{new pcl::PointCloud<PointType>()};
+        pcl::PointCloud<PointType>::Ptr lidarCloudCornerFromMapDS{new pcl::PointCloud<PointType>()};
+        pcl::PointCloud<PointType>::Ptr lidarCloudSurfFromMapDS{new pcl::PointCloud<PointType>()};
+        int lidarCloudCornerFromMapDSNum = 0;
+        int lidarCloudSurfFromMapDSNum = 0;
+        bool localMapUpdated = true;    // set whenever the local map changes, for map-side precomputation
+
+        explicit KeyframeMap(const RollConfig& config) : mapConfig(config)
+        {
+            downSizeFilterCorner.setLeafSize(config.mappingCornerLeafSize, config.mappingCornerLeafSize, config.mappingCornerLeafSize);
+            downSizeFilterSurf.setLeafSize(config.mappingSurfLeafSize, config.mappingSurfLeafSize, config.mappingSurfLeafSize);
+            downSizeFilterSurroundingKeyPoses.setLeafSize(config.surroundingKeyframeDensity, config.surroundingKeyframeDensity, config.surroundingKeyframeDensity);
+            // surf clouds are the larger part of a keyframe
+            cornerCloudKeyFrames.configure("corner", config.keyframeMemoryBudget * 0.3, config.keyframeCacheDirectory);
+            surfCloudKeyFrames.configure("surf", config.keyframeMemoryBudget * 0.7, config.keyframeCacheDirectory);
+        }
+
+        // local map from the keyframes within surroundingKeyframeSearchRadius of position, one per
+        // surroundingKeyframeDensity voxel; with recentSince > 0 also every keyframe since then, in case the robot
+        // rotates in one position, more recent ones match better with the current frame.
+        // Keeps the previous local map when no keyframe is near.
+        void extractNearby(const PointType& position, double recentSince = -1)
+        {
+            pcl::PointCloud<PointType>::Ptr surroundingKeyPoses(new pcl::PointCloud<PointType>());
+            pcl::PointCloud<PointType>::Ptr surroundingKeyPosesDS(new pcl::PointCloud<PointType>());
+            std::vector<int> pointSearchInd;
+            std::vector<float> pointSearchSqDis;
+
+            // extract all the nearby key poses and downsample them
+            kdtreeSurroundingKeyPoses->setInputCloud(cloudKeyPoses3D); // create kd-tree
+            kdtreeSurroundingKeyPoses->radiusSearch(position, (double)mapConfig.surroundingKeyframeSearchRadius, pointSearchInd, pointSearchSqDis);
+            if (pointSearchInd.empty())
+                return;
+
+            for (int i = 0; i < (int)pointSearchInd.size(); ++i)
+            {
+                int id = pointSearchInd[i];
+                surroundingKeyPoses->push_back(cloudKeyPoses3D->points[id]);
+            }
+
+            // downsampling is important especially at places where trajectories overlap when doing slam
+            downSizeFilterSurroundingKeyPoses.setInputCloud(surroundingKeyPoses);
+            downSizeFilterSurroundingKeyPoses.filter(*surroundingKeyPosesDS);
+
+            for(auto& pt : surroundingKeyPosesDS->points) // recover the intensity field averaged by voxel filter
+            {
+                pt.intensity = cloudKeyPoses3D->points[knn<1>(*kdtreeSurroundingKeyPoses, pt).indices[0]].intensity;
+            }
+
+            if (recentSince > 0)
+            {
+                int numPoses = cloudKeyPoses3D->size();
+                for (int i = numPoses-1; i >= 0; --i)
+                {
+                    if (cloudKeyPoses6D->points[i].time > recentSince)
+                        surroundingKeyPosesDS->push_back(cloudKeyPoses3D->points[i]);
+                    else
+                        break;
+                }
+            }
+            extractCloud(surroundingKeyPosesDS);
+        }
+
+        // fuses the keyframes whose indices are in the intensity of cloudToExtract
+        void extractCloud(pcl::PointCloud<PointType>::Ptr cloudToExtract)
+        {
+            // new clouds rather than clearing, the previous ones may still be referenced elsewhere
+            lidarCloudCornerFromMap.reset(new pcl::PointCloud<PointType>());
+            lidarCloudSurfFromMap.reset(new pcl::PointCloud<PointType>());
+            for (int i = 0; i < (int)cloudToExtract->size(); ++i)
+            {
+                int thisKeyInd = (int)cloudToExtract->points[i].intensity;
+
+                *lidarCloudCornerFromMap += *keyframeToMap(*cornerCloudKeyFrames[thisKeyInd], cloudKeyPoses6D->points[thisKeyInd]);
+                *lidarCloudSurfFromMap   += *keyframeToMap(*surfCloudKeyFrames[thisKeyInd],   cloudKeyPoses6D->points[thisKeyInd]);
+            }
+
+            // Downsample the surrounding corner key frames (or map)
+            lidarCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
+            downSizeFilterCorner.setInputCloud(lidarCloudCornerFromMap);
+            downSizeFilterCorner.filter(*lidarCloudCornerFromMapDS);
+            lidarCloudCornerFromMapDSNum = lidarCloudCornerFromMapDS->size();
+            // Downsample the surrounding surf key frames (or map)
+            lidarCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
+            downSizeFilterSurf.setInputCloud(lidarCloudSurfFromMap);
+            downSizeFilterSurf.filter(*lidarCloudSurfFromMapDS);
+            lidarCloudSurfFromMapDSNum = lidarCloudSurfFromMapDS->size();
+            if (mapConfig.mortonOrder)
+            {
+                mortonSort(*lidarCloudCornerFromMapDS, mapConfig.mappingCornerLeafSize);
+                mortonSort(*lidarCloudSurfFromMapDS, mapConfig.mappingSurfLeafSize);
+            }
+            localMapUpdated = true;
+        }
+
+        // a new keyframe once the pose moved surroundingkeyframeAddingDistThreshold from the last one; for a
+        // panoramic lidar an angle threshold is not needed
+        bool isKeyframe(const PointTypePose& last, const Eigen::Affine3f& current) const
+        {
+            Eigen::Affine3f transBetween = poseToAffine3f(last).inverse() * current;
+            float x, y, z, roll, pitch, yaw;
+            pcl::getTranslationAndEulerAngles(transBetween, x, y, z, roll, pitch, yaw);
+            return sqrt(x*x + y*y + z*z) > mapConfig.surroundingkeyframeAddingDistThreshold;
+        }
+
+        // keyframe clouds are stored quantized to keyframeResolution
+        CompactCloud::Ptr encode(const pcl::PointCloud<PointType>& cloud) const
+        {
+            return CompactCloud::encode(cloud, mapConfig.keyframeResolution, mapConfig.keyframeKeepIntensity);
+        }
+
+        // appends a keyframe; its index goes into the intensity of both key poses
+        void addKeyframe(PointTypePose pose, const CompactCloud::Ptr& corner, const CompactCloud::Ptr& surf)
+        {
+            PointType pose3D;
+            pose3D.x = pose.x;
+            pose3D.y = pose.y;
+            pose3D.z = pose.z;
+            pose3D.intensity = pose.intensity = cloudKeyPoses3D->size();
+            cloudKeyPoses3D->push_back(pose3D);
+            cloudKeyPoses6D->push_back(pose);
+            cornerCloudKeyFrames.push_back(corner);
+            surfCloudKeyFrames.push_back(surf);
+        }
+
+        static Eigen::Affine3f poseToAffine3f(const PointTypePose& pose)
+        {
+            return pcl::getTransformation(pose.x, pose.y, pose.z, pose.roll, pose.pitch, pose.yaw);
+        }
+
+        static pcl::PointCloud<PointType>::Ptr keyframeToMap(const CompactCloud& cloud, const PointTypePose& pose)
+        {
+            pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
+            cloud.decode(poseToAffine3f(pose), *cloudOut);
+            return cloudOut;
+        }
+
+    protected:
+        const RollConfig& mapConfig;
+        CloudKdTree::Ptr kdtreeSurroundingKeyPoses{new CloudKdTree()};
+        pcl::VoxelGrid<PointType> downSizeFilterCorner;
+        pcl::VoxelGrid<PointType> downSizeFilterSurf;
+        pcl::VoxelGrid<PointType> downSizeFilterSurroundingKeyPoses; // for surrounding key poses of scan-to-map optimization
+};
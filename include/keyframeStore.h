@@ -0,0 +1,274 @@
+#pragma once
+
+#include <list>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compactCloud.h"
+
+// keyframe clouds with a RAM budget: least recently used clouds are spilled to a memory-mapped backing file
+// and paged back in on access. Keyframes never change once stored, so a cloud is written at most once.
+// Returned pointers stay valid after eviction, eviction only drops the store's reference.
+class KeyframeStore
+{
+    private:
+        struct Entry
+        {
+            CompactCloud::Ptr cloud;   // null while spilled
+            int64_t offset = -1;       // position in the backing file, -1 if never written
+            size_t bytes = 0;
+            bool inLru = false;
+            std::list<std::shared_ptr<Entry>>::iterator lruIt;
+        };
+        typedef std::shared_ptr<Entry> EntryPtr;
+
+        std::mutex mtx;
+        vector<EntryPtr> entries;
+        std::list<EntryPtr> lru;     // front is the most recently used
+        size_t budget = 0;           // bytes, 0 keeps everything resident
+        size_t residentBytes = 0;
+        string name;
+
+        int fd = -1;
+        int64_t fileEnd = 0;
+        char* mapped = nullptr;
+        size_t mappedLength = 0;
+
+        // statistics
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t spills = 0;
+        double stallTime = 0; // ms spent paging in
+
+        void touch(const EntryPtr& e)
+        {
+            if (e->inLru)
+                lru.erase(e->lruIt);
+            lru.push_front(e);
+            e->lruIt = lru.begin();
+            e->inLru = true;
+        }
+
+        bool spill(const EntryPtr& e)
+        {
+            if (e->offset >= 0)
+                return true;
+            const CompactCloud& c = *e->cloud;
+            uint32_t header[2] = {(uint32_t)c.size(), c.intensity.empty() ? 0u : 1u};
+            float scales[2] = {c.scale, c.intensityScale};
+            size_t n = c.size();
+            bool ok = pwrite(fd, header, sizeof(header), fileEnd) == sizeof(header);
+            int64_t pos = fileEnd + sizeof(header);
+            ok = ok && pwrite(fd, scales, sizeof(scales), pos) == sizeof(scales);
+            pos += sizeof(scales);
+            const vector<int16_t>* axes[3] = {&c.x, &c.y, &c.z};
+            for (int k = 0; k < 3 && ok; k++)
+            {
+                ok = pwrite(fd, axes[k]->data(), n * sizeof(int16_t), pos) == (ssize_t)(n * sizeof(int16_t));
+                pos += n * sizeof(int16_t);
+            }
+            if (ok && !c.intensity.empty())
+            {
+                ok = pwrite(fd, c.intensity.data(), n * sizeof(uint16_t), pos) == (ssize_t)(n * sizeof(uint16_t));
+                pos += n * sizeof(uint16_t);
+            }
+            if (!ok)
+                return false;
+            e->offset = fileEnd;
+            fileEnd = pos;
+            spills++;
+            return true;
+        }
+
+        CompactCloud::Ptr pageIn(const EntryPtr& e)
+        {
+            if ((size_t)fileEnd > mappedLength)
+            {
+                if (mapped != nullptr)
+                    munmap(mapped, mappedLength);
+                // grow in large steps so remapping stays rare
+                mappedLength = max((size_t)fileEnd, mappedLength * 2);
+                if (ftruncate(fd, max((int64_t)mappedLength, fileEnd)) != 0)
+                    mappedLength = fileEnd;
+                mapped = (char*)mmap(nullptr, mappedLength, PROT_READ, MAP_SHARED, fd, 0);
+                if (mapped == MAP_FAILED)
+                {
+                    mapped = nullptr;
+                    mappedLength = 0;
+                    return nullptr;
+                }
+            }
+            const char* p = mapped + e->offset;
+            uint32_t header[2];
+            memcpy(header, p, sizeof(header));
+            p += sizeof(header);
+            CompactCloud::Ptr c(new CompactCloud());
+            memcpy(&c->scale, p, sizeof(float));
+            memcpy(&c->intensityScale, p + sizeof(float), sizeof(float));
+            p += 2 * sizeof(float);
+            size_t n = header[0];
+            vector<int16_t>* axes[3] = {&c->x, &c->y, &c->z};
+            for (int k = 0; k < 3; k++)
+            {
+                axes[k]->resize(n);
+                memcpy(axes[k]->data(), p, n * sizeof(int16_t));
+                p += n * sizeof(int16_t);
+            }
+            if (header[1] & 1u)
+            {
+                c->intensity.resize(n);
+                memcpy(c->intensity.data(), p, n * sizeof(uint16_t));
+            }
+            return c;
+        }
+
+        void evict()
+        {
+            if (budget == 0)
+                return;
+            while (residentBytes > budget && lru.size() > 1)
+            {
+                EntryPtr e = lru.back();
+                if (!spill(e))
+                {
+                    ROLL_WARN_THROTTLE(10, "keyframe store %s: failed to write the backing file, keeping keyframes in RAM", name.c_str());
+                    return;
+                }
+                lru.pop_back();
+                e->inLru = false;
+                e->cloud.reset();
+                residentBytes -= e->bytes;
+            }
+        }
+
+        CompactCloud::Ptr get(const EntryPtr& e)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (e->cloud)
+            {
+                hits++;
+                touch(e);
+                return e->cloud;
+            }
+            TicToc stall;
+            misses++;
+            CompactCloud::Ptr c = pageIn(e);
+            if (!c)
+            {
+                ROLL_ERROR("keyframe store %s: failed to map the backing file", name.c_str());
+                return CompactCloud::Ptr(new CompactCloud());
+            }
+            e->cloud = c;
+            residentBytes += e->bytes;
+            touch(e);
+            evict();
+            stallTime += stall.toc();
+            return c;
+        }
+
+    public:
+        // a consistent list of keyframes that stays readable while the store goes on changing (see MapSnapshot)
+        class View
+        {
+            private:
+                KeyframeStore* store = nullptr;
+                vector<EntryPtr> entries;
+                friend class KeyframeStore;
+            public:
+                CompactCloud::Ptr operator[](size_t i) const { return store->get(entries[i]); }
+                size_t size() const { return entries.size(); }
+        };
+
+        ~KeyframeStore()
+        {
+            if (mapped != nullptr)
+                munmap(mapped, mappedLength);
+            if (fd >= 0)
+                close(fd);
+        }
+
+        // budgetMB <= 0 keeps every keyframe in RAM and no file is created
+        void configure(const string& name_, float budgetMB, const string& directory)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            name = name_;
+            budget = budgetMB > 0 ? (size_t)(budgetMB * 1048576.0) : 0;
+            if (budget == 0 || fd >= 0)
+                return;
+            string fileName = directory + "/roll_keyframes_" + name + "_" + std::to_string(getpid()) + ".bin";
+            fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0)
+            {
+                ROLL_ERROR("keyframe store %s: cannot create %s, keeping keyframes in RAM", name.c_str(), fileName.c_str());
+                budget = 0;
+                return;
+            }
+            // the file is only needed while the node runs
+            unlink(fileName.c_str());
+        }
+
+        CompactCloud::Ptr operator[](size_t i)
+        {
+            EntryPtr e;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                e = entries[i];
+            }
+            return get(e);
+        }
+
+        void push_back(const CompactCloud::Ptr& cloud)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            EntryPtr e(new Entry());
+            e->cloud = cloud;
+            e->bytes = cloud->bytes();
+            entries.push_back(e);
+            residentBytes += e->bytes;
+            touch(e);
+            evict();
+        }
+
+        // the backing file is append only, space of erased keyframes is not reused
+        void erase(size_t i)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            EntryPtr e = entries[i];
+            entries.erase(entries.begin() + i);
+            if (e->inLru)
+            {
+                lru.erase(e->lruIt);
+                e->inLru = false;
+            }
+            if (e->cloud)
+                residentBytes -= e->bytes;
+        }
+
+        size_t size()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return entries.size();
+        }
+
+        View view()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            View v;
+            v.store = this;
+            v.entries = entries;
+            return v;
+        }
+
+        string stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::ostringstream ss;
+            size_t accesses = hits + misses;
+            ss << name << ": " << entries.size() << " keyframes, " << std::fixed << std::setprecision(1)
+               << residentBytes / 1048576.0 << " MB resident, " << fileEnd / 1048576.0 << " MB spilled, hit rate "
+               << (accesses > 0 ? 100.0 * hits / accesses : 100.0) << "% (" << misses << " misses), stall "
+               << stallTime << " ms";
+            return ss.str();
+        }
+};
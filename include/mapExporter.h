@@ -0,0 +1,187 @@
+#pragma once
+
+#include "rollCommon.h"
+
+// streaming export of large maps: points are appended to the files as they come,
+// so the whole map never has to be held in memory
+
+// binary pcd (x y z intensity) written incrementally, the point count is patched into the header on close
+class PCDStreamWriter
+{
+    private:
+        FILE* file = nullptr;
+        long countPos[2];
+        size_t pointN = 0;
+        vector<float> buffer;
+
+    public:
+        ~PCDStreamWriter()
+        {
+            close();
+        }
+
+        bool open(const string& fileName)
+        {
+            close();
+            file = fopen(fileName.c_str(), "wb");
+            if (file == nullptr)
+            {
+                cout<<"Cannot open "<<fileName<<endl;
+                return false;
+            }
+            pointN = 0;
+            fprintf(file, "# .PCD v0.7 - Point Cloud Data file format\nVERSION 0.7\nFIELDS x y z intensity\n"
+                          "SIZE 4 4 4 4\nTYPE F F F F\nCOUNT 1 1 1 1\nWIDTH ");
+            countPos[0] = ftell(file);
+            fprintf(file, "%010d\nHEIGHT 1\nVIEWPOINT 0 0 0 1 0 0 0\nPOINTS ", 0);
+            countPos[1] = ftell(file);
+            fprintf(file, "%010d\nDATA binary\n", 0);
+            return true;
+        }
+
+        bool isOpen() const { return file != nullptr; }
+
+        size_t size() const { return pointN; }
+
+        void write(const pcl::PointCloud<PointType>& cloud)
+        {
+            if (file == nullptr || cloud.empty())
+                return;
+            buffer.resize(cloud.size() * 4);
+            for (size_t i = 0; i < cloud.size(); i++)
+            {
+                buffer[4*i]   = cloud.points[i].x;
+                buffer[4*i+1] = cloud.points[i].y;
+                buffer[4*i+2] = cloud.points[i].z;
+                buffer[4*i+3] = cloud.points[i].intensity;
+            }
+            fwrite(buffer.data(), sizeof(float), buffer.size(), file);
+            pointN += cloud.size();
+        }
+
+        // returns false if anything went wrong while writing
+        bool close()
+        {
+            if (file == nullptr)
+                return false;
+            bool ok = !ferror(file);
+            for (int k = 0; k < 2; k++)
+            {
+                fseek(file, countPos[k], SEEK_SET);
+                fprintf(file, "%010d", (int)pointN);
+            }
+            ok = fclose(file) == 0 && ok;
+            file = nullptr;
+            return ok;
+        }
+};
+
+// voxel centroids (same grid and averaging as pcl::VoxelGrid) kept in square tiles on the xy plane.
+// A tile is written out and freed as soon as the caller releases it, i.e. once nothing can fall into it anymore.
+class TiledVoxelAccumulator
+{
+    private:
+        struct VoxelSum
+        {
+            float x = 0, y = 0, z = 0, intensity = 0;
+            int n = 0;
+        };
+        typedef std::unordered_map<int64_t, VoxelSum> Tile;
+
+        float leafSize;
+        float invLeaf;
+        float tileSize;
+        string tileDirectory; // empty: everything goes into the single stream
+        string tilePrefix;
+        PCDStreamWriter writer;
+        std::unordered_map<int64_t, Tile> tiles;
+        size_t residentVoxels = 0;
+        size_t peakVoxels = 0;
+        int writtenTiles = 0;
+        bool ok = true;
+
+    public:
+        TiledVoxelAccumulator(float leafSize_, float tileSize_, const string& fileName, const string& tileDirectory_ = "", const string& tilePrefix_ = "")
+            : leafSize(leafSize_), invLeaf(1.0 / leafSize_), tileSize(tileSize_), tileDirectory(tileDirectory_), tilePrefix(tilePrefix_)
+        {
+            if (tileDirectory.empty())
+                ok = writer.open(fileName);
+        }
+
+        // tiles are taken from the voxel index rather than the point, so every voxel lies in exactly one tile
+        int64_t tileIndex(int64_t voxelIndex) const
+        {
+            return (int64_t)floor(voxelIndex * (double)leafSize / tileSize);
+        }
+
+        // tile index along x or y of the voxel a coordinate falls into; monotonic, so the tiles of the points in
+        // [a, b] lie within [tileIndexAt(a), tileIndexAt(b)]
+        int64_t tileIndexAt(float v) const
+        {
+            return tileIndex((int64_t)floor(v * invLeaf));
+        }
+
+        void add(const pcl::PointCloud<PointType>& cloud)
+        {
+            for (const auto& p : cloud.points)
+            {
+                int64_t ix = floor(p.x * invLeaf), iy = floor(p.y * invLeaf), iz = floor(p.z * invLeaf);
+                VoxelSum& v = tiles[voxelKey(tileIndex(ix), tileIndex(iy), 0)][voxelKey(ix, iy, iz)];
+                if (v.n == 0) residentVoxels++;
+                v.x += p.x; v.y += p.y; v.z += p.z; v.intensity += p.intensity;
+                v.n++;
+            }
+            peakVoxels = max(peakVoxels, residentVoxels);
+        }
+
+        void release(int64_t key)
+        {
+            auto it = tiles.find(key);
+            if (it == tiles.end())
+                return;
+            pcl::PointCloud<PointType> cloud;
+            cloud.reserve(it->second.size());
+            for (const auto& v : it->second)
+            {
+                PointType p;
+                float inv = 1.0 / v.second.n;
+                p.x = v.second.x * inv;
+                p.y = v.second.y * inv;
+                p.z = v.second.z * inv;
+                p.intensity = v.second.intensity * inv;
+                cloud.push_back(p);
+            }
+            residentVoxels -= it->second.size();
+            tiles.erase(it);
+
+            if (tileDirectory.empty())
+            {
+                writer.write(cloud);
+            }
+            else if (!cloud.empty())
+            {
+                int64_t mask = (1 << 21) - 1;
+                int tx = (int)(((key >> 42) & mask) - (1 << 20));
+                int ty = (int)(((key >> 21) & mask) - (1 << 20));
+                cloud.width = cloud.size();
+                cloud.height = 1;
+                string fileName = tileDirectory + "/" + tilePrefix + std::to_string(tx) + "_" + std::to_string(ty) + ".pcd";
+                ok = pcl::io::savePCDFileBinary(fileName, cloud) == 0 && ok;
+            }
+            writtenTiles++;
+        }
+
+        // returns false if any file failed
+        bool releaseAll()
+        {
+            while (!tiles.empty())
+                release(tiles.begin()->first);
+            if (writer.isOpen())
+                ok = writer.close() && ok;
+            return ok;
+        }
+
+        size_t size() const { return writer.size(); }
+        size_t peakResidentVoxels() const { return peakVoxels; }
+        int tilesWritten() const { return writtenTiles; }
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include "rollCommon.h"
+#include "tileMap.h"
+
+// scan-to-map registration as used by scan2MapOptimization. A backend is created once per node, so its parameters
+// are read once, and reused for every frame: setTarget whenever the local map changes, setSource and align per scan.
+// Clouds are shared, not copied: the target must stay unchanged until the next setTarget.
+class Registration
+{
+    public:
+        typedef std::shared_ptr<Registration> Ptr;
+
+        // results of the last align
+        Eigen::Affine3f affine_out = Eigen::Affine3f::Identity();
+        double inlier_ratio = 0;   // correspondences with an error below inlierThreshold
+        double inlier_ratio2 = 0;  // scan points with a correspondence
+        double regiError = 0;      // mean error of the correspondences, meters
+        double minEigen = 1e+6;
+        bool isDegenerate = false;
+        int iterCount = 0;
+        bool budgetLimited = false; // points were thinned out or iterations cut to meet the time budget
+
+        virtual ~Registration() {}
+
+        virtual void setTarget(pcl::PointCloud<PointType>::Ptr cornerMap, pcl::PointCloud<PointType>::Ptr surfMap) = 0;
+        virtual void setSource(pcl::PointCloud<PointType>::Ptr corner, pcl::PointCloud<PointType>::Ptr surf) = 0;
+        virtual void align(const Eigen::Affine3f& guess) = 0;
+        virtual string name() const = 0;
+
+        // precomputed planes/lines of the map, only used by backends that can
+        virtual void setMapField(MapField::Ptr field) {}
+
+        // timing and counters of the last align, for debug output
+        virtual string stats() const { return ""; }
+
+        // milliseconds the next align may take, 0 for no limit
+        void setTimeBudget(float ms) { timeBudget = ms; }
+
+    protected:
+        float timeBudget = 0;
+        TicToc budgetClock;
+        int pointStride = 1; // every pointStride-th scan point is matched
+        Eigen::Matrix<double, 6, 6> stepProjection; // drops the degenerate directions of the update (gaussNewtonUpdate)
+
+        void startBudget()
+        {
+            budgetClock.tic();
+            budgetLimited = false;
+            pointStride = 1;
+        }
+
+        // anytime behaviour: when the next iteration, expected to take as long as the last one, would not fit in
+        // the budget the scan points are thinned out (up to every 4th), after that false stops at the current pose
+        bool budgetAllows(float iterationTime)
+        {
+            if (timeBudget <= 0)
+                return true;
+            float left = timeBudget - budgetClock.toc();
+            while (iterationTime > left && pointStride < 4)
+            {
+                pointStride *= 2;
+                iterationTime /= 2;
+                budgetLimited = true;
+            }
+            if (iterationTime > left)
+            {
+                budgetLimited = true;
+                return false;
+            }
+            return true;
+        }
+
+        // iteration driver of the Gauss-Newton backends: step(iteration) runs one iteration and returns true once
+        // converged, at most maxIterations are run and only as many as the time budget allows.
+        // Resets the results of the previous align.
+        template <typename Step>
+        void iterate(int maxIterations, Step step)
+        {
+            minEigen = 1e+6;
+            isDegenerate = false;
+            iterCount = 0;
+            startBudget();
+            float iterationTime = 0;
+            for (; iterCount < maxIterations; iterCount++)
+            {
+                if (iterCount > 0 && !budgetAllows(iterationTime))
+                    break;
+                TicToc iteration;
+                bool converged = step(iterCount);
+                iterationTime = iteration.toc();
+                if (converged)
+                    break;
+            }
+        }
+
+        // inlier_ratio, inlier_ratio2 and regiError from the error of every scan point in the last iteration,
+        // -1 without correspondence
+        void pointErrorStats(const vector<float>& pointError, float inlierThreshold)
+        {
+            int matched = 0, inlierCnt = 0;
+            regiError = 0;
+            for (float e : pointError)
+            {
+                if (e < 0) continue;
+                matched++;
+                regiError += e;
+                if (e < inlierThreshold) inlierCnt++;
+            }
+            int matchable = (pointError.size() + pointStride - 1) / pointStride;
+            inlier_ratio2 = matchable > 0 ? (double)matched / matchable : 0;
+            inlier_ratio = matched > 0 ? (double)inlierCnt / matched : 0;
+            regiError = matched > 0 ? regiError / matched : 0;
+            if (matched == 0) minEigen = 0;
+        }
+
+        // solves the normal equations H dx = -b and applies dx as a left update; the directions found degenerate
+        // in the first iteration stay fixed. True once converged or with too few correspondences to solve.
+        bool gaussNewtonUpdate(const Eigen::Matrix<double, 6, 6>& H, const Eigen::Matrix<double, 6, 1>& b, int correspondences,
+                               int iterCount, Eigen::Matrix3f& R, Eigen::Vector3f& t)
+        {
+            if (correspondences < 6)
+                return true;
+
+            if (iterCount == 0)
+                stepProjection = degeneracyProjection(H);
+
+            Eigen::Matrix<double, 6, 1> dx = H.ldlt().solve(-b);
+            if (isDegenerate)
+                dx = stepProjection * dx;
+            return applyUpdate(dx, R, t);
+        }
+
+        // directions of H with little information relative to the best constrained one (or below an absolute
+        // eigenvalue) are not updated. Returns the projection applied to the updates, minEigen and isDegenerate are set.
+        Eigen::Matrix<double, 6, 6> degeneracyProjection(const Eigen::Matrix<double, 6, 6>& H, double ratio = 1e-3, double absolute = 0)
+        {
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 6, 6>> solver(H);
+            Eigen::Matrix<double, 6, 1> lambda = solver.eigenvalues();
+            minEigen = lambda(0);
+            isDegenerate = false;
+            Eigen::Matrix<double, 6, 6> V = solver.eigenvectors();
+            Eigen::Matrix<double, 6, 6> Vu = V;
+            for (int i = 0; i < 6; i++)
+            {
+                if (lambda(i) >= ratio * lambda(5) && lambda(i) >= absolute)
+                    break;
+                Vu.col(i).setZero();
+                isDegenerate = true;
+            }
+            return Vu * V.transpose();
+        }
+
+        // R <- Exp(dtheta) R, t <- t + dt; true once the step is below 0.05 deg and 0.05 cm
+        static bool applyUpdate(const Eigen::Matrix<double, 6, 1>& dx, Eigen::Matrix3f& R, Eigen::Vector3f& t)
+        {
+            Eigen::Vector3d dtheta = dx.head<3>();
+            double angle = dtheta.norm();
+            if (angle > 1e-12)
+                R = Eigen::AngleAxisf(angle, (dtheta / angle).cast<float>()).toRotationMatrix() * R;
+            t += dx.tail<3>().cast<float>();
+            return pcl::rad2deg(angle) < 0.05 && dx.tail<3>().norm() * 100 < 0.05;
+        }
+
+        // R <- R Exp(dtheta), t <- t + R dt; the thresholds are multiplied by scale
+        static bool applyRightUpdate(const Eigen::Matrix<double, 6, 1>& dx, Eigen::Matrix3f& R, Eigen::Vector3f& t, float scale = 1)
+        {
+            Eigen::Vector3d dtheta = dx.head<3>();
+            double angle = dtheta.norm();
+            t += R * dx.tail<3>().cast<float>();
+            if (angle > 1e-12)
+                R = R * Eigen::AngleAxisf(angle, (dtheta / angle).cast<float>()).toRotationMatrix();
+            return pcl::rad2deg(angle) < 0.05 * scale && dx.tail<3>().norm() * 100 < 0.05 * scale;
+        }
+
+        static Eigen::Matrix3f skewSymmetric(const Eigen::Vector3f& v)
+        {
+            Eigen::Matrix3f m;
+            m << 0, -v(2), v(1),
+                 v(2), 0, -v(0),
+                 -v(1), v(0), 0;
+            return m;
+        }
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "LOAMmapping.h"
+#include "NDTmapping.h"
+#include "GICPmapping.h"
+
+// scan-to-map registration backend by name (roll/registrationMethod): loam, ndt or gicp. The backend keeps a copy of
+// the parameters.
+inline Registration::Ptr createRegistration(const string& method, const RollConfig& config)
+{
+    if (method == "ndt")
+        return Registration::Ptr(new NDTmapping(config));
+    if (method == "gicp")
+        return Registration::Ptr(new GICPmapping(config));
+    if (method != "loam")
+        ROLL_WARN("Unknown registrationMethod %s, using loam", method.c_str());
+    return Registration::Ptr(new LOAMmapping(config));
+}
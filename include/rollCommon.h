@@ -0,0 +1,174 @@
+#pragma once
+
+// the ROS-free part of utility.h: point type, math and cloud helpers, parameters and instrumentation. The processing
+// code (feature extraction, registration, keyframe store, fusion) includes only this, utility.h adds the node side.
+#include "tic_toc.h"
+#include "instrumentation.h"
+#include "rollConfig.h"
+#include "rollLog.h"
+
+#include <Eigen/Dense>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/common/common.h>
+#include <pcl/common/transforms.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/filters/filter.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/filters/crop_box.h> 
+
+#include <vector>
+#include <unordered_map>
+#include <cmath>
+#include <algorithm>
+#include <queue>
+#include <deque>
+#include <iostream>
+#include <fstream>
+#include <ctime>
+#include <cfloat>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <limits>
+#include <iomanip>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <future>
+#include<cassert>
+#include <utility>
+#include <cstdlib>
+#include <memory>
+#include <numeric>
+
+using namespace std;
+
+typedef pcl::PointXYZI PointType;
+
+inline float pointDistance(PointType p)
+{
+    return sqrt(p.x*p.x + p.y*p.y + p.z*p.z);
+}
+
+
+inline float pointDistance(PointType p1, PointType p2)
+{
+    return sqrt((p1.x-p2.x)*(p1.x-p2.x) + (p1.y-p2.y)*(p1.y-p2.y) + (p1.z-p2.z)*(p1.z-p2.z));
+}
+
+
+inline void printTrans(std::string message, vector<double> transformIn){
+    if (transformIn.size() != 6) return;
+    cout<<message<<transformIn[0]<<" "<<transformIn[1]<<" "
+        <<transformIn[2]<<" "<<transformIn[3]<<" "<<transformIn[4]<<" "<<transformIn[5];
+    return;
+}
+// returning c array is not easy to pull off, just forget it
+inline void Affine3f2Trans(Eigen::Affine3f t,float transformOut[6])
+{
+    pcl::getTranslationAndEulerAngles(t,transformOut[3], transformOut[4], transformOut[5], transformOut[0], transformOut[1], transformOut[2]);
+}
+
+inline Eigen::Affine3f trans2Affine3f(float transformIn[6])
+{
+    return pcl::getTransformation(transformIn[3], transformIn[4], transformIn[5], transformIn[0], transformIn[1], transformIn[2]);
+}
+
+inline Eigen::Affine3f trans2Affine3f(const vector<double>& transformIn)
+{
+    if (transformIn.size() != 6) return Eigen::Affine3f::Identity();
+    return pcl::getTransformation(transformIn[3], transformIn[4], transformIn[5], transformIn[0], transformIn[1], transformIn[2]);
+}
+
+// cloudIn moved by transCur, intensities kept
+inline pcl::PointCloud<PointType>::Ptr transformPointCloud(const pcl::PointCloud<PointType>& cloudIn, const Eigen::Affine3f& transCur)
+{
+    pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
+
+    int cloudSize = cloudIn.size();
+    cloudOut->resize(cloudSize);
+    for (int i = 0; i < cloudSize; ++i)
+    {
+        const auto &pointFrom = cloudIn.points[i];
+        cloudOut->points[i].x = transCur(0,0) * pointFrom.x + transCur(0,1) * pointFrom.y + transCur(0,2) * pointFrom.z + transCur(0,3);
+        cloudOut->points[i].y = transCur(1,0) * pointFrom.x + transCur(1,1) * pointFrom.y + transCur(1,2) * pointFrom.z + transCur(1,3);
+        cloudOut->points[i].z = transCur(2,0) * pointFrom.x + transCur(2,1) * pointFrom.y + transCur(2,2) * pointFrom.z + transCur(2,3);
+        cloudOut->points[i].intensity = pointFrom.intensity;
+    }
+    return cloudOut;
+}
+
+inline double rad2deg(double radians)
+{
+  return radians * 180.0 / M_PI;
+}
+
+inline double deg2rad(double degrees)
+{
+  return degrees * M_PI / 180.0;
+}
+
+// key of the voxel containing (x,y,z), 21 bits per axis
+inline int64_t voxelKey(float x, float y, float z, float invLeaf)
+{
+    int64_t ix = (int64_t)floor(x * invLeaf) + (1 << 20);
+    int64_t iy = (int64_t)floor(y * invLeaf) + (1 << 20);
+    int64_t iz = (int64_t)floor(z * invLeaf) + (1 << 20);
+    return (ix << 42) | (iy << 21) | iz;
+}
+
+inline int64_t voxelKey(int64_t ix, int64_t iy, int64_t iz)
+{
+    return ((ix + (1 << 20)) << 42) | ((iy + (1 << 20)) << 21) | (iz + (1 << 20));
+}
+
+// low 21 bits of v spread to every third bit
+inline uint64_t mortonSpread(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+// Z-order (Morton) code of a cell, the bits of x, y and z interleaved
+inline uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+    return mortonSpread(x) | (mortonSpread(y) << 1) | (mortonSpread(z) << 2);
+}
+
+// reorders the points along a Z-order curve over cells of cellSize, so that points close in space are also close in
+// memory and consecutive nearest neighbour queries walk through neighbouring parts of a kd-tree
+template <typename PointT>
+void mortonSort(pcl::PointCloud<PointT>& cloud, float cellSize)
+{
+    int cloudSize = cloud.size();
+    if (cloudSize < 2)
+        return;
+    float minX = cloud.points[0].x, minY = cloud.points[0].y, minZ = cloud.points[0].z;
+    for (const auto& p : cloud.points)
+    {
+        minX = min(minX, p.x);
+        minY = min(minY, p.y);
+        minZ = min(minZ, p.z);
+    }
+    float invCell = 1.0 / cellSize;
+    vector<std::pair<uint64_t, int>> order(cloudSize);
+    for (int i = 0; i < cloudSize; i++)
+    {
+        const PointT& p = cloud.points[i];
+        order[i].first = mortonCode((p.x - minX) * invCell, (p.y - minY) * invCell, (p.z - minZ) * invCell);
+        order[i].second = i;
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<PointT, Eigen::aligned_allocator<PointT>> sorted(cloudSize);
+    for (int i = 0; i < cloudSize; i++)
+        sorted[i] = cloud.points[order[i].second];
+    cloud.points.swap(sorted);
+}
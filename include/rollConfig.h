@@ -0,0 +1,413 @@
+#pragma once
+
+#include <cfloat>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum class SensorType { VELODYNE, OUSTER, LIVOX};
+
+// source of the roll/ parameters: the ROS parameter server in the nodes (ParamServer), a yaml file in the offline
+// tools (YamlParamReader). Names are without the roll/ prefix; a parameter that is not set gets the default.
+class ParamReader
+{
+public:
+    virtual ~ParamReader() {}
+    virtual void param(const string& name, bool& value, bool defaultValue) = 0;
+    virtual void param(const string& name, int& value, int defaultValue) = 0;
+    virtual void param(const string& name, float& value, float defaultValue) = 0;
+    virtual void param(const string& name, double& value, double defaultValue) = 0;
+    virtual void param(const string& name, string& value, const string& defaultValue) = 0;
+    virtual void param(const string& name, vector<double>& value, const vector<double>& defaultValue) = 0;
+    virtual void param(const string& name, vector<int>& value, const vector<int>& defaultValue) = 0;
+};
+
+// every roll/ parameter, without any ROS dependency, so the processing code can be driven from outside a node
+class RollConfig
+{
+public:
+    float globalMatchingRate = 1.0;
+
+    bool debugMode = false;
+    bool useGPS = false;
+
+    // gps 
+    double alti0;
+    double lati0;
+    double longi0;
+
+    int optIteration;
+    string registrationMethod;
+    float ndtResolution;
+    int ndtMinPoints;
+    int gicpNeighbors;
+    float gicpMaxCorrespondenceDistance;
+    vector<double> registrationPyramid;
+    vector<int> pyramidIterations;
+    float correspondenceReuseDistance;
+    int correspondenceRefreshInterval;
+    float registrationTimeBudget;
+    bool mortonOrder;
+    int pipelineQueueSize;
+    float pathPublishInterval;
+    string admissionPolicy;
+    int admissionBacklog;
+    int admissionNth;
+    bool stageTiming;
+    float stageTimingPeriod;
+    bool trace;
+    int traceBufferSize;
+
+
+    //Topics
+    string pointCloudTopic;
+    string imuTopic;
+    string odomTopic;
+    string gpsTopic;
+    string gtTopic;
+
+    //Frames
+    string lidarFrame;
+    string baselinkFrame;
+    string odometryFrame;
+    string mapFrame;
+
+    // GPS Settings
+    bool useImuHeadingInitialization;
+    bool useGpsElevation;
+    float gpsCovThreshold;
+    float poseCovThreshold;
+
+    // Save pcd
+    bool savePCD;
+    bool savePose;
+    bool saveKeyframeMap;
+    bool saveRawCloud;
+    bool mapUpdateEnabled;
+    bool saveLog;
+    string saveMapDirectory;
+    string saveKeyframeMapDirectory;
+    string loadKeyframeMapDirectory;
+    float exportTileSize;
+    bool exportTiledPCD;
+    int exportBatchSize;
+    float keyframeResolution;
+    bool keyframeKeepIntensity;
+    string keyframeFileFormat;
+    float keyframeMemoryBudget;
+    string keyframeCacheDirectory;
+
+    // tiled localization map
+    bool useTileMap;
+    float tileSize;
+    float tileLocalMapRadius;
+    float tileLoadRadius;
+    float tileUnloadRadius;
+    float tileFieldResolution;
+    string compiledMapDirectory;
+    bool useMapField;
+
+    bool generateVocab;
+
+    bool localizationMode;
+
+    // Lidar Sensor Configuration
+    string sensorName;
+    SensorType sensor;
+    int N_SCAN;
+    int Horizon_SCAN;
+    int downsampleRate;
+    float lidarMinRange;
+    float lidarMaxRange;
+
+    vector<double> initialGuess;
+
+    // extrinsics to the body frame, roll pitch yaw x y z as initialGuess
+    vector<double> imuToBody;
+    vector<double> lidarToBody;
+    vector<double> gpsToBody;
+    
+    
+    float edgeThreshold;
+    float surfThreshold;
+    int edgeFeatureMinValidNum;
+    int surfFeatureMinValidNum;
+
+    // voxel filter paprams
+    float odometrySurfLeafSize;
+    float mappingCornerLeafSize;
+    float mappingSurfLeafSize ;
+
+    float z_tollerance; 
+    float rotation_tollerance;
+
+    // CPU Params
+    int numberOfCores;
+
+    // Surrounding map
+    float surroundingkeyframeAddingDistThreshold; 
+    float surroundingkeyframeAddingAngleThreshold; 
+    float surroundingKeyframeDensity;
+    float surroundingKeyframeSearchRadius;
+    
+    // Loop closure
+    bool  loopClosureEnableFlag;
+    float loopClosureFrequency;
+    int   surroundingKeyframeSize;
+    float historyKeyframeSearchRadius;
+    float historyKeyframeSearchTimeDiff;
+    int   historyKeyframeSearchNum;
+    float historyKeyframeFitnessScore;
+
+    // global map visualization radius
+    float globalMapVisualizationSearchRadius;
+    float globalMapVisualizationPoseDensity;
+    float globalMapVisualizationLeafSize;
+
+    // temporary mapping
+    float starttemporaryMappingDistThre; // key poses sparsified by 2.0 m
+    float inlierThreshold; // if no serious map out-of-date, it suffice 99% of the time
+    float startTemporaryMappingInlierRatioThre; 
+    float exitTemporaryMappingInlierRatioThre; 
+    int slidingWindowSize;
+
+    // false if roll/sensor is not a known sensor type
+    bool read(ParamReader& r)
+    {
+        r.param("globalMatchingRate", globalMatchingRate, 1.0);
+
+        r.param("debugMode", debugMode, false);
+
+        r.param("lati0", lati0, 0.0);
+        r.param("longi0", longi0, 0.0);
+        r.param("alti0", alti0, 0.0);
+
+        r.param("starttemporaryMappingDistThre", starttemporaryMappingDistThre, 20.0);
+        r.param("inlierThreshold", inlierThreshold, 0.1);
+        r.param("startTemporaryMappingInlierRatioThre", startTemporaryMappingInlierRatioThre, 0.4);
+        r.param("exitTemporaryMappingInlierRatioThre", exitTemporaryMappingInlierRatioThre, 0.4);
+        r.param("slidingWindowSize", slidingWindowSize, 30);
+
+        r.param("optIteration", optIteration, 30);
+        r.param("registrationMethod", registrationMethod, "loam");
+        r.param("ndtResolution", ndtResolution, 1.0);
+        r.param("ndtMinPoints", ndtMinPoints, 6);
+        r.param("gicpNeighbors", gicpNeighbors, 10);
+        r.param("gicpMaxCorrespondenceDistance", gicpMaxCorrespondenceDistance, 1.0);
+        r.param("registrationPyramid", registrationPyramid, vector<double>());
+        r.param("pyramidIterations", pyramidIterations, vector<int>());
+        r.param("correspondenceReuseDistance", correspondenceReuseDistance, 0.05);
+        r.param("correspondenceRefreshInterval", correspondenceRefreshInterval, 5);
+        r.param("registrationTimeBudget", registrationTimeBudget, 0.0);
+        r.param("mortonOrder", mortonOrder, true);
+        r.param("pipelineQueueSize", pipelineQueueSize, 2);
+        r.param("pathPublishInterval", pathPublishInterval, 1.0);
+        r.param("admissionPolicy", admissionPolicy, "latest");
+        r.param("admissionBacklog", admissionBacklog, 10);
+        r.param("admissionNth", admissionNth, 2);
+        r.param("stageTiming", stageTiming, false);
+        r.param("stageTimingPeriod", stageTimingPeriod, 5.0);
+        r.param("trace", trace, false);
+        r.param("traceBufferSize", traceBufferSize, 100000);
+        r.param("pointCloudTopic", pointCloudTopic, "points_raw");
+        r.param("imuTopic", imuTopic, "imu_correct");
+        r.param("odomTopic", odomTopic, "odometry/imu");
+        r.param("gpsTopic", gpsTopic, "fix");
+        r.param("gtTopic", gtTopic, "ground_truth");
+
+        r.param("lidarFrame", lidarFrame, "base_link");
+        r.param("baselinkFrame", baselinkFrame, "base_link");
+        r.param("odometryFrame", odometryFrame, "odom");
+        r.param("mapFrame", mapFrame, "map");
+
+        r.param("useImuHeadingInitialization", useImuHeadingInitialization, false);
+        r.param("useGpsElevation", useGpsElevation, false);
+        r.param("gpsCovThreshold", gpsCovThreshold, 2.0);
+        r.param("poseCovThreshold", poseCovThreshold, 25.0);
+
+        r.param("saveLog", saveLog, true);
+        r.param("savePCD", savePCD, false);
+        r.param("savePose", savePose, false);
+        r.param("saveKeyframeMap", saveKeyframeMap, false);
+        r.param("saveRawCloud", saveRawCloud, false);
+        r.param("localizationMode", localizationMode, false);
+        r.param("mapUpdateEnabled", mapUpdateEnabled, false);
+
+        
+        r.param("saveMapDirectory", saveMapDirectory, "/Downloads/LOAM/");
+        r.param("loadKeyframeMapDirectory", loadKeyframeMapDirectory, "/Downloads/LOAM/");
+        r.param("saveKeyframeMapDirectory", saveKeyframeMapDirectory, "/Downloads/LOAM/");        
+        r.param("exportTileSize", exportTileSize, 100.0);
+        r.param("exportTiledPCD", exportTiledPCD, false);
+        r.param("exportBatchSize", exportBatchSize, 64);
+        r.param("keyframeResolution", keyframeResolution, 0.005);
+        r.param("keyframeKeepIntensity", keyframeKeepIntensity, true);
+        r.param("keyframeFileFormat", keyframeFileFormat, "pcd");
+        r.param("keyframeMemoryBudget", keyframeMemoryBudget, 0.0);
+        r.param("keyframeCacheDirectory", keyframeCacheDirectory, "/tmp");
+
+        r.param("useTileMap", useTileMap, false);
+        r.param("tileSize", tileSize, 50.0);
+        r.param("tileLocalMapRadius", tileLocalMapRadius, 80.0);
+        r.param("tileLoadRadius", tileLoadRadius, 150.0);
+        r.param("tileUnloadRadius", tileUnloadRadius, 250.0);
+        r.param("tileFieldResolution", tileFieldResolution, 0.5);
+        r.param("compiledMapDirectory", compiledMapDirectory, "");
+        r.param("useMapField", useMapField, false);
+
+
+        r.param("sensor", sensorName, "");
+
+        r.param("N_SCAN", N_SCAN, 16);
+        r.param("Horizon_SCAN", Horizon_SCAN, 1800);
+        r.param("downsampleRate", downsampleRate, 1);
+        r.param("lidarMinRange", lidarMinRange, 1.0);
+        r.param("lidarMaxRange", lidarMaxRange, 1000.0);
+
+        r.param("initialGuess", initialGuess, vector<double>(6, 0));
+        r.param("imuToBody", imuToBody, vector<double>{0.0, 0.0, 0.0, -0.11, -0.18, -0.71});
+        r.param("lidarToBody", lidarToBody, vector<double>{0.014084807063594, 0.002897246558311, -1.583065991436417, 0.002, -0.004, -0.957});
+        r.param("gpsToBody", gpsToBody, vector<double>{0.0, 0.0, 0.0, -0.24, 0.0, -1.24});
+
+        r.param("edgeThreshold", edgeThreshold, 0.1);
+        r.param("surfThreshold", surfThreshold, 0.1);
+        r.param("edgeFeatureMinValidNum", edgeFeatureMinValidNum, 10);
+        r.param("surfFeatureMinValidNum", surfFeatureMinValidNum, 100);
+
+        r.param("odometrySurfLeafSize", odometrySurfLeafSize, 0.2);
+        r.param("mappingCornerLeafSize", mappingCornerLeafSize, 0.2);
+        r.param("mappingSurfLeafSize", mappingSurfLeafSize, 0.2);
+
+        r.param("z_tollerance", z_tollerance, FLT_MAX);
+        r.param("rotation_tollerance", rotation_tollerance, FLT_MAX);
+
+        r.param("numberOfCores", numberOfCores, 2);
+
+        r.param("surroundingkeyframeAddingDistThreshold", surroundingkeyframeAddingDistThreshold, 1.0);
+        r.param("surroundingkeyframeAddingAngleThreshold", surroundingkeyframeAddingAngleThreshold, 0.2);
+        r.param("surroundingKeyframeDensity", surroundingKeyframeDensity, 1.0);
+        r.param("surroundingKeyframeSearchRadius", surroundingKeyframeSearchRadius, 50.0);
+
+        r.param("loopClosureEnableFlag", loopClosureEnableFlag, false);
+        r.param("loopClosureFrequency", loopClosureFrequency, 1.0);
+        r.param("surroundingKeyframeSize", surroundingKeyframeSize, 50);
+        r.param("historyKeyframeSearchRadius", historyKeyframeSearchRadius, 10.0);
+        r.param("historyKeyframeSearchTimeDiff", historyKeyframeSearchTimeDiff, 30.0);
+        r.param("historyKeyframeSearchNum", historyKeyframeSearchNum, 25);
+        r.param("historyKeyframeFitnessScore", historyKeyframeFitnessScore, 0.3);
+
+        r.param("globalMapVisualizationSearchRadius", globalMapVisualizationSearchRadius, 1e3);
+        r.param("globalMapVisualizationPoseDensity", globalMapVisualizationPoseDensity, 10.0);
+        r.param("globalMapVisualizationLeafSize", globalMapVisualizationLeafSize, 1.0);
+
+        if (sensorName == "velodyne")
+            sensor = SensorType::VELODYNE;
+        else if (sensorName == "ouster")
+            sensor = SensorType::OUSTER;
+        else if (sensorName == "livox")
+            sensor = SensorType::LIVOX;
+        else
+            return false;
+        return true;
+    }
+};
+
+// the roll: section of a params_*.yaml: one "name: value" per line, lists as [a, b, c]; nested blocks are skipped
+class YamlParamReader : public ParamReader
+{
+public:
+    bool load(const string& fileName)
+    {
+        ifstream file(fileName);
+        if (!file)
+            return false;
+        string line;
+        bool inRoll = false;
+        while (getline(file, line))
+        {
+            line = line.substr(0, line.find('#'));
+            size_t colon = line.find(':');
+            if (colon == string::npos)
+                continue;
+            bool indented = !line.empty() && (line[0] == ' ' || line[0] == '\t');
+            string key = trim(line.substr(0, colon));
+            string value = trim(line.substr(colon + 1));
+            if (!indented)
+                inRoll = key == "roll";
+            else if (inRoll && !value.empty())
+                values[key] = value;
+        }
+        return true;
+    }
+
+    // e.g. from the command line, overrides the file
+    void set(const string& name, const string& value) { values[name] = value; }
+
+    void param(const string& name, bool& value, bool defaultValue) override
+    {
+        value = has(name) ? values[name] == "true" || values[name] == "True" : defaultValue;
+    }
+    void param(const string& name, int& value, int defaultValue) override
+    {
+        value = has(name) ? atoi(values[name].c_str()) : defaultValue;
+    }
+    void param(const string& name, float& value, float defaultValue) override
+    {
+        value = has(name) ? atof(values[name].c_str()) : defaultValue;
+    }
+    void param(const string& name, double& value, double defaultValue) override
+    {
+        value = has(name) ? atof(values[name].c_str()) : defaultValue;
+    }
+    void param(const string& name, string& value, const string& defaultValue) override
+    {
+        value = has(name) ? unquote(values[name]) : defaultValue;
+    }
+    void param(const string& name, vector<double>& value, const vector<double>& defaultValue) override
+    {
+        value = has(name) ? list<double>(values[name]) : defaultValue;
+    }
+    void param(const string& name, vector<int>& value, const vector<int>& defaultValue) override
+    {
+        value = has(name) ? list<int>(values[name]) : defaultValue;
+    }
+
+private:
+    map<string, string> values;
+
+    bool has(const string& name) const { return values.count(name) > 0; }
+
+    static string trim(const string& s)
+    {
+        size_t first = s.find_first_not_of(" \t\r");
+        if (first == string::npos)
+            return "";
+        return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    }
+
+    static string unquote(const string& s)
+    {
+        if (s.size() >= 2 && (s[0] == '"' || s[0] == '\'') && s.back() == s[0])
+            return s.substr(1, s.size() - 2);
+        return s;
+    }
+
+    template <typename T>
+    static vector<T> list(string s)
+    {
+        vector<T> result;
+        for (char& c : s)
+            if (c == '[' || c == ']' || c == ',')
+                c = ' ';
+        istringstream ss(s);
+        T v;
+        while (ss >> v)
+            result.push_back(v);
+        return result;
+    }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+
+// log output of the ROS-free code: stderr by default, the nodes forward it to rosout (ParamServer)
+enum class RollLogLevel { INFO, WARN, ERROR };
+
+class RollLog
+{
+    public:
+        typedef void (*Sink)(RollLogLevel level, const char* message);
+
+        static void setSink(Sink sink) { sinkRef().store(sink, std::memory_order_relaxed); }
+
+        static void write(RollLogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)))
+        {
+            char message[1024];
+            va_list args;
+            va_start(args, format);
+            vsnprintf(message, sizeof(message), format, args);
+            va_end(args);
+            sinkRef().load(std::memory_order_relaxed)(level, message);
+        }
+
+        // seconds on the monotonic clock, for the throttled macros
+        static double now()
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+    private:
+        static void stderrSink(RollLogLevel level, const char* message)
+        {
+            fprintf(stderr, "[%s] %s\n", level == RollLogLevel::INFO ? "INFO" : (level == RollLogLevel::WARN ? "WARN" : "ERROR"),
+                    message);
+        }
+
+        static std::atomic<Sink>& sinkRef()
+        {
+            static std::atomic<Sink> sink{&RollLog::stderrSink};
+            return sink;
+        }
+};
+
+#define ROLL_INFO(...) RollLog::write(RollLogLevel::INFO, __VA_ARGS__)
+#define ROLL_WARN(...) RollLog::write(RollLogLevel::WARN, __VA_ARGS__)
+#define ROLL_ERROR(...) RollLog::write(RollLogLevel::ERROR, __VA_ARGS__)
+// at most once per period seconds from this call site
+#define ROLL_WARN_THROTTLE(period, ...) \
+    do { \
+        static std::atomic<double> rollLogLast{-1e18}; \
+        double rollLogNow = RollLog::now(); \
+        if (rollLogNow - rollLogLast.load(std::memory_order_relaxed) >= (period)) \
+        { \
+            rollLogLast.store(rollLogNow, std::memory_order_relaxed); \
+            ROLL_WARN(__VA_ARGS__); \
+        } \
+    } while (0)
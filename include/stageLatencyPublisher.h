@@ -0,0 +1,51 @@
+#pragma once
+
+#include <ros/ros.h>
+
+#include "instrumentation.h"
+#include "roll/stage_latencies.h"
+
+// periodic output of this node's stage histograms, as roll/stage_latencies on /roll/<node>/stage_latency and as rows
+// appended to a CSV file; runs on the ROS spinner
+class StageLatencyPublisher
+{
+    public:
+        void start(ros::NodeHandle& nh, const std::string& node_, const std::string& csvFile_, double period)
+        {
+            node = node_;
+            csvFile = csvFile_;
+            pub = nh.advertise<roll::stage_latencies>("/roll/" + node + "/stage_latency", 1);
+            timer = nh.createWallTimer(ros::WallDuration(period), &StageLatencyPublisher::publish, this);
+        }
+
+        void publish(const ros::WallTimerEvent&)
+        {
+            std::vector<StageStats> stats = Instrumentation::instance().snapshot();
+            if (stats.empty())
+                return;
+            roll::stage_latencies msg;
+            msg.header.stamp = ros::Time::now();
+            msg.node = node;
+            for (const auto& s : stats)
+            {
+                roll::stage_latency stage;
+                stage.stage = s.stage;
+                stage.count = s.count;
+                stage.mean_ms = s.meanMs;
+                stage.p50_ms = s.p50Ms;
+                stage.p90_ms = s.p90Ms;
+                stage.p99_ms = s.p99Ms;
+                stage.max_ms = s.maxMs;
+                msg.stages.push_back(stage);
+            }
+            pub.publish(msg);
+            if (!csvFile.empty() && !Instrumentation::instance().appendCsv(csvFile, msg.header.stamp.toSec(), stats))
+                ROS_WARN_ONCE("Cannot write stage latencies to %s", csvFile.c_str());
+        }
+
+    private:
+        std::string node;
+        std::string csvFile;
+        ros::Publisher pub;
+        ros::WallTimer timer;
+};
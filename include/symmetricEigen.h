@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+// eigen decomposition of many symmetric 3x3 matrices at once. The matrices are stored as structure of arrays
+// (a11, a12, a13, a22, a23, a33), and each one is solved in closed form (trigonometric solution of the
+// characteristic cubic plus cross products for the eigenvectors), branch-free so that the loop vectorizes:
+// 8 (AVX) or 16 (AVX-512) neighbourhoods per instruction. GCC only if-converts it with -fno-math-errno and
+// -fno-trapping-math, set in CMakeLists.txt on the targets that include this.
+class SymmetricEigen3Batch
+{
+    public:
+        // input
+        std::vector<float> a11, a12, a13, a22, a23, a33;
+        // eigenvalues, descending
+        std::vector<float> l0, l1, l2;
+        // unit eigenvectors of the largest (line direction) and the smallest (plane normal) eigenvalue
+        std::vector<float> vx, vy, vz;
+        std::vector<float> nx, ny, nz;
+
+        int size() const { return a11.size(); }
+
+        void clear()
+        {
+            for (std::vector<float>* v : {&a11, &a12, &a13, &a22, &a23, &a33})
+                v->clear();
+        }
+
+        void push_back(float b11, float b12, float b13, float b22, float b23, float b33)
+        {
+            a11.push_back(b11); a12.push_back(b12); a13.push_back(b13);
+            a22.push_back(b22); a23.push_back(b23); a33.push_back(b33);
+        }
+
+        void solve()
+        {
+            int n = size();
+            for (std::vector<float>* v : {&l0, &l1, &l2, &vx, &vy, &vz, &nx, &ny, &nz})
+                v->resize(n);
+            const float* A11 = a11.data(); const float* A12 = a12.data(); const float* A13 = a13.data();
+            const float* A22 = a22.data(); const float* A23 = a23.data(); const float* A33 = a33.data();
+            float* L0 = l0.data(); float* L1 = l1.data(); float* L2 = l2.data();
+            float* VX = vx.data(); float* VY = vy.data(); float* VZ = vz.data();
+            float* NX = nx.data(); float* NY = ny.data(); float* NZ = nz.data();
+
+            #pragma omp simd
+            for (int i = 0; i < n; i++)
+            {
+                float b11 = A11[i], b12 = A12[i], b13 = A13[i], b22 = A22[i], b23 = A23[i], b33 = A33[i];
+                // A = q I + p B with tr(B) = 0, the eigenvalues of B are 2 cos(phi + 2 pi k / 3), det(B) = 2 cos(3 phi)
+                float q = (b11 + b22 + b33) / 3.0f;
+                float c11 = b11 - q, c22 = b22 - q, c33 = b33 - q;
+                float offDiagonal = b12 * b12 + b13 * b13 + b23 * b23;
+                float p2 = (c11 * c11 + c22 * c22 + c33 * c33 + 2.0f * offDiagonal) / 6.0f;
+                float p = std::sqrt(p2);
+                float detC = c11 * (c22 * c33 - b23 * b23) - b12 * (b12 * c33 - b23 * b13) + b13 * (b12 * b23 - c22 * b13);
+                // p = 0 (all three equal q) gives r = 0; the divisions stay unconditional so that the loop if-converts
+                float r = 0.5f * detC / (p2 * p + 1e-30f);
+                r = r < -1.0f ? -1.0f : (r > 1.0f ? 1.0f : r);
+                float phi = acos(r) / 3.0f;
+                float cosPhi = cos(phi), sinPhi = sin(phi);
+                float e0 = q + 2.0f * p * cosPhi;
+                // cos(phi + 2 pi / 3)
+                float e2 = q + 2.0f * p * (-0.5f * cosPhi - 0.8660254f * sinPhi);
+                L0[i] = e0;
+                L2[i] = e2;
+                L1[i] = 3.0f * q - e0 - e2;
+
+                eigenvector(b11, b12, b13, b22, b23, b33, e0, VX[i], VY[i], VZ[i]);
+                eigenvector(b11, b12, b13, b22, b23, b33, e2, NX[i], NY[i], NZ[i]);
+            }
+        }
+
+    private:
+        // the libm versions have no vector variants without -ffast-math and would keep the loop scalar. Float accurate
+        // on the ranges used here: acos on [-1, 1] (Abramowitz & Stegun 4.4.46), cos and sin on [0, pi / 3].
+        static inline float acos(float x)
+        {
+            float a = std::fabs(x);
+            float poly = 1.5707963050f + a * (-0.2145988016f + a * (0.0889789874f + a * (-0.0501743046f
+                         + a * (0.0308918810f + a * (-0.0170881256f + a * (0.0066700901f + a * -0.0012624911f))))));
+            float angle = std::sqrt(a < 1.0f ? 1.0f - a : 0.0f) * poly;
+            return x < 0 ? 3.1415926536f - angle : angle;
+        }
+
+        static inline float cos(float x)
+        {
+            float x2 = x * x;
+            return 1.0f + x2 * (-1.0f / 2 + x2 * (1.0f / 24 + x2 * (-1.0f / 720 + x2 * (1.0f / 40320 + x2 * (-1.0f / 3628800)))));
+        }
+
+        static inline float sin(float x)
+        {
+            float x2 = x * x;
+            return x * (1.0f + x2 * (-1.0f / 6 + x2 * (1.0f / 120 + x2 * (-1.0f / 5040 + x2 * (1.0f / 362880)))));
+        }
+
+        // null vector of A - lambda I: the longest cross product of two of its rows; (1, 0, 0) if there is none
+        static inline void eigenvector(float b11, float b12, float b13, float b22, float b23, float b33, float lambda,
+                                       float& x, float& y, float& z)
+        {
+            float r0x = b11 - lambda, r0y = b12, r0z = b13;
+            float r1x = b12, r1y = b22 - lambda, r1z = b23;
+            float r2x = b13, r2y = b23, r2z = b33 - lambda;
+
+            float c01x = r0y * r1z - r0z * r1y, c01y = r0z * r1x - r0x * r1z, c01z = r0x * r1y - r0y * r1x;
+            float c02x = r0y * r2z - r0z * r2y, c02y = r0z * r2x - r0x * r2z, c02z = r0x * r2y - r0y * r2x;
+            float c12x = r1y * r2z - r1z * r2y, c12y = r1z * r2x - r1x * r2z, c12z = r1x * r2y - r1y * r2x;
+            float d01 = c01x * c01x + c01y * c01y + c01z * c01z;
+            float d02 = c02x * c02x + c02y * c02y + c02z * c02z;
+            float d12 = c12x * c12x + c12y * c12y + c12z * c12z;
+
+            bool use02 = d02 > d01;
+            float bx = use02 ? c02x : c01x, by = use02 ? c02y : c01y, bz = use02 ? c02z : c01z;
+            float bd = use02 ? d02 : d01;
+            bool use12 = d12 > bd;
+            bx = use12 ? c12x : bx;
+            by = use12 ? c12y : by;
+            bz = use12 ? c12z : bz;
+            bd = use12 ? d12 : bd;
+
+            bool valid = bd > 1e-30f;
+            float invNorm = 1.0f / std::sqrt(bd + 1e-30f);
+            x = valid ? bx * invNorm : 1.0f;
+            y = valid ? by * invNorm : 0.0f;
+            z = valid ? bz * invNorm : 0.0f;
+        }
+};
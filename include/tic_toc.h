@@ -17,16 +17,16 @@ class TicToc
 
     void tic()
     {
-        start = std::chrono::system_clock::now();
+        start = std::chrono::steady_clock::now();
     }
 
     double toc()
     {
-        end = std::chrono::system_clock::now();
+        end = std::chrono::steady_clock::now();
         std::chrono::duration<double> elapsed_seconds = end - start; // micro secs or us
         return elapsed_seconds.count() * 1000; //ms
     }
 
   private:
-    std::chrono::time_point<std::chrono::system_clock> start, end;
+    std::chrono::time_point<std::chrono::steady_clock> start, end; // monotonic, immune to clock adjustments
 };
@@ -0,0 +1,638 @@
+#pragma once
+
+#include <functional>
+#include <unordered_set>
+
+#include "compactCloud.h"
+#include "cloudKdTree.h"
+
+// plane through a map voxel: nx*x + ny*y + nz*z + d = 0 in tile-local coordinates
+struct VoxelPlane
+{
+    float nx, ny, nz, d;
+};
+
+// line through a map voxel: point and unit direction in tile-local coordinates
+struct VoxelLine
+{
+    float px, py, pz, dx, dy, dz;
+};
+
+// world map cut into square tiles on the xy plane. A tile holds the voxelized corner and surf features of every
+// keyframe reaching it, in tile-local coordinates (the origin is kept in double) so floats stay precise far from
+// the map origin. Tiles are built in the background around the robot and dropped again once it is far away.
+struct MapTile
+{
+    typedef std::shared_ptr<MapTile> Ptr;
+
+    int tx = 0, ty = 0;
+    double originX = 0, originY = 0;
+    pcl::PointCloud<PointType>::Ptr corner;
+    pcl::PointCloud<PointType>::Ptr surf;
+
+    // primitives fitted around every voxel near the map, keys are voxelKey of tile-local coordinates
+    float fieldResolution = 0;
+    std::unordered_map<int64_t, VoxelPlane> planes;
+    std::unordered_map<int64_t, VoxelLine> lines;
+
+    // tile file: "RTIL", version, tx, ty, counts, field resolution, then the clouds and the field
+    bool save(const string& fileName) const
+    {
+        FILE* file = fopen(fileName.c_str(), "wb");
+        if (file == nullptr)
+            return false;
+        int32_t header[8] = {0x4c495452, 1, tx, ty, (int32_t)corner->size(), (int32_t)surf->size(), (int32_t)planes.size(), (int32_t)lines.size()};
+        fwrite(header, sizeof(int32_t), 8, file);
+        fwrite(&fieldResolution, sizeof(float), 1, file);
+        for (const pcl::PointCloud<PointType>* cloud : {corner.get(), surf.get()})
+            for (const auto& p : cloud->points)
+            {
+                float v[4] = {p.x, p.y, p.z, p.intensity};
+                fwrite(v, sizeof(float), 4, file);
+            }
+        for (const auto& plane : planes)
+        {
+            fwrite(&plane.first, sizeof(int64_t), 1, file);
+            fwrite(&plane.second, sizeof(VoxelPlane), 1, file);
+        }
+        for (const auto& line : lines)
+        {
+            fwrite(&line.first, sizeof(int64_t), 1, file);
+            fwrite(&line.second, sizeof(VoxelLine), 1, file);
+        }
+        bool ok = !ferror(file);
+        return fclose(file) == 0 && ok;
+    }
+
+    static Ptr load(const string& fileName, float tileSize)
+    {
+        FILE* file = fopen(fileName.c_str(), "rb");
+        if (file == nullptr)
+            return nullptr;
+        Ptr tile(new MapTile());
+        int32_t header[8];
+        bool ok = fread(header, sizeof(int32_t), 8, file) == 8 && header[0] == 0x4c495452 && header[1] == 1;
+        ok = ok && fread(&tile->fieldResolution, sizeof(float), 1, file) == 1;
+        // the counts must add up to the file size before anything is allocated for them, a truncated or
+        // corrupt file would otherwise ask for gigabytes
+        if (ok)
+        {
+            long dataStart = ftell(file);
+            ok = dataStart >= 0 && fseek(file, 0, SEEK_END) == 0;
+            int64_t dataSize = ok ? (int64_t)ftell(file) - dataStart : -1;
+            ok = ok && fseek(file, dataStart, SEEK_SET) == 0;
+            for (int k = 4; k < 8; k++)
+                ok = ok && header[k] >= 0;
+            int64_t expected = ((int64_t)header[4] + header[5]) * 4 * sizeof(float)
+                             + (int64_t)header[6] * (sizeof(int64_t) + sizeof(VoxelPlane))
+                             + (int64_t)header[7] * (sizeof(int64_t) + sizeof(VoxelLine));
+            ok = ok && expected == dataSize;
+        }
+        if (ok)
+        {
+            tile->tx = header[2];
+            tile->ty = header[3];
+            tile->originX = (double)tile->tx * tileSize;
+            tile->originY = (double)tile->ty * tileSize;
+            tile->corner.reset(new pcl::PointCloud<PointType>());
+            tile->surf.reset(new pcl::PointCloud<PointType>());
+            pcl::PointCloud<PointType>* clouds[2] = {tile->corner.get(), tile->surf.get()};
+            for (int k = 0; k < 2 && ok; k++)
+            {
+                clouds[k]->resize(header[4 + k]);
+                for (auto& p : clouds[k]->points)
+                {
+                    float v[4];
+                    if (fread(v, sizeof(float), 4, file) != 4) { ok = false; break; }
+                    p.x = v[0]; p.y = v[1]; p.z = v[2]; p.intensity = v[3];
+                }
+            }
+            tile->planes.reserve(header[6]);
+            for (int i = 0; i < header[6] && ok; i++)
+            {
+                int64_t key;
+                VoxelPlane plane;
+                ok = fread(&key, sizeof(int64_t), 1, file) == 1 && fread(&plane, sizeof(VoxelPlane), 1, file) == 1;
+                tile->planes[key] = plane;
+            }
+            tile->lines.reserve(header[7]);
+            for (int i = 0; i < header[7] && ok; i++)
+            {
+                int64_t key;
+                VoxelLine line;
+                ok = fread(&key, sizeof(int64_t), 1, file) == 1 && fread(&line, sizeof(VoxelLine), 1, file) == 1;
+                tile->lines[key] = line;
+            }
+        }
+        fclose(file);
+        return ok ? tile : nullptr;
+    }
+
+    // append the tile to clouds in the frame of (frameX, frameY), a tile corner: the offset is a whole number of
+    // tiles, so the points stay as precise as in the tile
+    void appendTo(pcl::PointCloud<PointType>& cornerOut, pcl::PointCloud<PointType>& surfOut, double frameX, double frameY) const
+    {
+        const pcl::PointCloud<PointType>* in[2] = {corner.get(), surf.get()};
+        pcl::PointCloud<PointType>* out[2] = {&cornerOut, &surfOut};
+        for (int k = 0; k < 2; k++)
+        {
+            size_t offset = out[k]->size();
+            out[k]->resize(offset + in[k]->size());
+            float ox = originX - frameX, oy = originY - frameY;
+            for (size_t i = 0; i < in[k]->size(); i++)
+            {
+                PointType p = in[k]->points[i];
+                p.x += ox;
+                p.y += oy;
+                out[k]->points[offset + i] = p;
+            }
+        }
+    }
+};
+
+// plane/line lookup over a set of tiles: one hash lookup per scan point instead of a kd-tree search and a fit
+class MapField
+{
+    private:
+        float tileSize;
+        double frameX, frameY; // origin of the frame of the query points
+        std::unordered_map<int64_t, MapTile::Ptr> tiles; // only tiles that carry a field
+
+        const MapTile* find(const Eigen::Vector3d& p, Eigen::Vector3f& local, int64_t& key) const
+        {
+            double x = p(0) + frameX, y = p(1) + frameY;
+            int64_t tx = floor(x / tileSize), ty = floor(y / tileSize);
+            auto it = tiles.find(voxelKey(tx, ty, 0));
+            if (it == tiles.end())
+                return nullptr;
+            const MapTile* tile = it->second.get();
+            local = Eigen::Vector3d(x - tile->originX, y - tile->originY, p(2)).cast<float>();
+            float invRes = 1.0 / tile->fieldResolution;
+            key = voxelKey((int64_t)floor(local(0) * invRes), (int64_t)floor(local(1) * invRes), (int64_t)floor(local(2) * invRes));
+            return tile;
+        }
+
+    public:
+        typedef std::shared_ptr<MapField> Ptr;
+
+        // query points are given in the frame of (frameX_, frameY_), as the local map built by MapTile::appendTo
+        MapField(float tileSize_, const vector<MapTile::Ptr>& tiles_, double frameX_ = 0, double frameY_ = 0)
+            : tileSize(tileSize_), frameX(frameX_), frameY(frameY_)
+        {
+            for (const auto& tile : tiles_)
+                if (tile->fieldResolution > 0)
+                    tiles[voxelKey(tile->tx, tile->ty, 0)] = tile;
+        }
+
+        bool empty() const { return tiles.empty(); }
+
+        // -1: no field around p, 0: no primitive in its voxel, 1: found.
+        // p is in double, so a point composed in double from the scan keeps its precision down to the tile frame;
+        // local is p in the tile frame, the primitive is in the same frame
+        int plane(const Eigen::Vector3d& p, VoxelPlane& plane, Eigen::Vector3f& local) const
+        {
+            int64_t key;
+            const MapTile* tile = find(p, local, key);
+            if (tile == nullptr)
+                return -1;
+            auto it = tile->planes.find(key);
+            if (it == tile->planes.end())
+                return 0;
+            plane = it->second;
+            return 1;
+        }
+
+        int line(const Eigen::Vector3d& p, VoxelLine& line, Eigen::Vector3f& local) const
+        {
+            int64_t key;
+            const MapTile* tile = find(p, local, key);
+            if (tile == nullptr)
+                return -1;
+            auto it = tile->lines.find(key);
+            if (it == tile->lines.end())
+                return 0;
+            line = it->second;
+            return 1;
+        }
+};
+
+// keyframe going into a tile
+struct TileSource
+{
+    Eigen::Affine3d pose;
+    CompactCloud::Ptr corner;
+    CompactCloud::Ptr surf;
+
+    // as pcl::getTransformation, but in double: the transform to a tile is composed from it and must not carry the
+    // float rounding of map frame coordinates
+    static Eigen::Affine3d keyframePose(double x, double y, double z, double roll, double pitch, double yaw)
+    {
+        return Eigen::Translation3d(x, y, z) * Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ())
+               * Eigen::AngleAxisd(pitch, Eigen::Vector3d::UnitY()) * Eigen::AngleAxisd(roll, Eigen::Vector3d::UnitX());
+    }
+};
+
+class TileMap
+{
+    private:
+        float tileSize = 50.0;
+        float cornerLeaf = 0.2;
+        float surfLeaf = 0.4;
+        int numberOfCores = 2;
+        float fieldResolution = 0;   // 0: no primitive field
+        float margin = 1.0;          // neighbours from around the tile used for the field
+        string compiledDirectory;    // tiles come from roll_map_compile output if set
+        std::unordered_set<int64_t> rebuiltTiles; // compiled tiles replaced by keyframe builds after merging
+
+        std::mutex mtx;
+        std::unordered_map<int64_t, vector<int>> tileKeyframes;   // tile -> keyframes reaching it
+        std::unordered_map<int64_t, MapTile::Ptr> tiles;          // resident
+        std::unordered_map<int64_t, std::shared_future<MapTile::Ptr>> pending;
+
+        // statistics
+        int built = 0;
+        int unloaded = 0;
+        int stalls = 0;
+        double stallTime = 0;
+
+        MapTile::Ptr build(int tx, int ty, const vector<TileSource>& sources) const
+        {
+            MapTile::Ptr tile(new MapTile());
+            tile->tx = tx;
+            tile->ty = ty;
+            tile->originX = (double)tx * tileSize;
+            tile->originY = (double)ty * tileSize;
+            tile->corner.reset(new pcl::PointCloud<PointType>());
+            tile->surf.reset(new pcl::PointCloud<PointType>());
+
+            pcl::PointCloud<PointType>::Ptr corner(new pcl::PointCloud<PointType>());
+            pcl::PointCloud<PointType>::Ptr surf(new pcl::PointCloud<PointType>());
+            pcl::PointCloud<PointType> cloud;
+            Eigen::Affine3d toTile(Eigen::Translation3d(-tile->originX, -tile->originY, 0));
+            float border = fieldResolution > 0 ? margin : 0;
+            for (const auto& source : sources)
+            {
+                // composed in double, so the float transform is already tile-local
+                Eigen::Affine3f trans = (toTile * source.pose).cast<float>();
+                source.corner->decode(trans, cloud);
+                crop(cloud, *corner, border);
+                source.surf->decode(trans, cloud);
+                crop(cloud, *surf, border);
+            }
+
+            pcl::PointCloud<PointType>::Ptr cornerDS(new pcl::PointCloud<PointType>());
+            pcl::PointCloud<PointType>::Ptr surfDS(new pcl::PointCloud<PointType>());
+            pcl::VoxelGrid<PointType> downSizeFilter;
+            downSizeFilter.setLeafSize(cornerLeaf, cornerLeaf, cornerLeaf);
+            downSizeFilter.setInputCloud(corner);
+            downSizeFilter.filter(*cornerDS);
+            downSizeFilter.setLeafSize(surfLeaf, surfLeaf, surfLeaf);
+            downSizeFilter.setInputCloud(surf);
+            downSizeFilter.filter(*surfDS);
+
+            if (fieldResolution > 0)
+                buildField(*tile, cornerDS, surfDS);
+            crop(*cornerDS, *tile->corner, 0);
+            crop(*surfDS, *tile->surf, 0);
+            return tile;
+        }
+
+        void crop(const pcl::PointCloud<PointType>& in, pcl::PointCloud<PointType>& out, float border) const
+        {
+            for (const auto& p : in.points)
+                if (p.x >= -border && p.x < tileSize + border && p.y >= -border && p.y < tileSize + border)
+                    out.push_back(p);
+        }
+
+        // fit the same primitives the scan-to-map matching fits (5 neighbours within 1 m, plane residuals below 0.2,
+        // lines with a dominant eigenvalue 3 times the second) at the centre of every voxel next to map points
+        void buildField(MapTile& tile, pcl::PointCloud<PointType>::Ptr corner, pcl::PointCloud<PointType>::Ptr surf) const
+        {
+            tile.fieldResolution = fieldResolution;
+            float invRes = 1.0 / fieldResolution;
+            int cells = ceil(tileSize * invRes);
+            pcl::PointCloud<PointType>::Ptr clouds[2] = {corner, surf};
+            for (int k = 0; k < 2; k++)
+            {
+                if (clouds[k]->size() < 5)
+                    continue;
+                std::unordered_set<int64_t> voxelSet;
+                for (const auto& p : clouds[k]->points)
+                {
+                    int64_t ix = floor(p.x * invRes), iy = floor(p.y * invRes), iz = floor(p.z * invRes);
+                    for (int dx = -1; dx <= 1; dx++)
+                        for (int dy = -1; dy <= 1; dy++)
+                            for (int dz = -1; dz <= 1; dz++)
+                                if (ix + dx >= 0 && ix + dx < cells && iy + dy >= 0 && iy + dy < cells)
+                                    voxelSet.insert(voxelKey(ix + dx, iy + dy, iz + dz));
+                }
+                vector<int64_t> voxels(voxelSet.begin(), voxelSet.end());
+                CloudKdTree kdtree;
+                kdtree.setInputCloud(clouds[k]);
+                vector<char> valid(voxels.size(), 0);
+                vector<VoxelPlane> planes(k == 1 ? voxels.size() : 0);
+                vector<VoxelLine> lines(k == 0 ? voxels.size() : 0);
+
+                #pragma omp parallel for num_threads(numberOfCores) schedule(dynamic, 256)
+                for (int v = 0; v < (int)voxels.size(); v++)
+                {
+                    int64_t mask = (1 << 21) - 1;
+                    PointType center;
+                    center.x = ((((voxels[v] >> 42) & mask) - (1 << 20)) + 0.5) * fieldResolution;
+                    center.y = ((((voxels[v] >> 21) & mask) - (1 << 20)) + 0.5) * fieldResolution;
+                    center.z = (((voxels[v] & mask) - (1 << 20)) + 0.5) * fieldResolution;
+                    Neighbours<5> nn = knn<5>(kdtree, center);
+                    if (!nn.full() || nn.sqDistances[4] >= 1.0)
+                        continue;
+
+                    Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+                    for (int j = 0; j < 5; j++)
+                        mean += clouds[k]->points[nn.indices[j]].getVector3fMap();
+                    mean /= 5;
+                    Eigen::Matrix3f cov = Eigen::Matrix3f::Zero();
+                    for (int j = 0; j < 5; j++)
+                    {
+                        Eigen::Vector3f d = clouds[k]->points[nn.indices[j]].getVector3fMap() - mean;
+                        cov += d * d.transpose();
+                    }
+                    cov /= 5;
+                    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver(cov); // ascending eigenvalues
+
+                    if (k == 1)
+                    {
+                        Eigen::Vector3f n = solver.eigenvectors().col(0);
+                        float d = -n.dot(mean);
+                        bool planeValid = true;
+                        for (int j = 0; j < 5; j++)
+                            if (fabs(n.dot(clouds[k]->points[nn.indices[j]].getVector3fMap()) + d) > 0.2)
+                            {
+                                planeValid = false;
+                                break;
+                            }
+                        if (planeValid)
+                        {
+                            planes[v] = {n(0), n(1), n(2), d};
+                            valid[v] = 1;
+                        }
+                    }
+                    else if (solver.eigenvalues()(2) > 3 * solver.eigenvalues()(1))
+                    {
+                        Eigen::Vector3f dir = solver.eigenvectors().col(2);
+                        lines[v] = {mean(0), mean(1), mean(2), dir(0), dir(1), dir(2)};
+                        valid[v] = 1;
+                    }
+                }
+                for (size_t v = 0; v < voxels.size(); v++)
+                {
+                    if (!valid[v]) continue;
+                    if (k == 1) tile.planes[voxels[v]] = planes[v];
+                    else        tile.lines[voxels[v]] = lines[v];
+                }
+            }
+        }
+
+        MapTile::Ptr loadCompiledTile(int tx, int ty) const
+        {
+            string fileName = compiledDirectory + "/tile_" + std::to_string(tx) + "_" + std::to_string(ty) + ".bin";
+            MapTile::Ptr tile = MapTile::load(fileName, tileSize);
+            if (!tile)
+            {
+                ROLL_ERROR("Cannot read compiled tile %s", fileName.c_str());
+                tile.reset(new MapTile());
+                tile->tx = tx;
+                tile->ty = ty;
+                tile->originX = (double)tx * tileSize;
+                tile->originY = (double)ty * tileSize;
+                tile->corner.reset(new pcl::PointCloud<PointType>());
+                tile->surf.reset(new pcl::PointCloud<PointType>());
+            }
+            return tile;
+        }
+
+        static void decodeKey(int64_t key, int& tx, int& ty)
+        {
+            int64_t mask = (1 << 21) - 1;
+            tx = (int)(((key >> 42) & mask) - (1 << 20));
+            ty = (int)(((key >> 21) & mask) - (1 << 20));
+        }
+
+        // pick up finished background builds, caller holds mtx
+        void collect()
+        {
+            for (auto it = pending.begin(); it != pending.end();)
+            {
+                if (it->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+                {
+                    tiles[it->first] = it->second.get();
+                    built++;
+                    it = pending.erase(it);
+                }
+                else
+                    ++it;
+            }
+        }
+
+    public:
+        void configure(float tileSize_, float cornerLeaf_, float surfLeaf_, int numberOfCores_, float fieldResolution_ = 0)
+        {
+            tileSize = tileSize_;
+            cornerLeaf = cornerLeaf_;
+            surfLeaf = surfLeaf_;
+            numberOfCores = numberOfCores_;
+            fieldResolution = fieldResolution_;
+        }
+
+        float getTileSize() const { return tileSize; }
+        float getCornerLeaf() const { return cornerLeaf; }
+        float getSurfLeaf() const { return surfLeaf; }
+        float getFieldResolution() const { return fieldResolution; }
+
+        // use the tiles written by roll_map_compile, its settings replace the configured ones (call before setIndex)
+        bool loadCompiled(const string& directory)
+        {
+            ifstream fin(directory + "/tiles.txt");
+            if (!fin.is_open())
+            {
+                cout<<directory + "/tiles.txt"<<" is not valid!"<<endl;
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            fin >> tileSize >> cornerLeaf >> surfLeaf >> fieldResolution;
+            int tx, ty;
+            while (fin >> tx >> ty)
+                tileKeyframes[tileKey(tx, ty)];
+            compiledDirectory = directory;
+            tiles.clear();
+            rebuiltTiles.clear();
+            return true;
+        }
+
+        // write every tile of the index, for roll_map_compile; sources(key) provides the keyframes of a tile
+        bool compile(const string& directory, std::function<vector<TileSource>(int64_t)> sources)
+        {
+            vector<int64_t> keys;
+            for (const auto& t : tileKeyframes)
+                keys.push_back(t.first);
+            std::atomic<int> failed(0), done(0);
+            std::atomic<size_t> points(0), fieldSize(0);
+            // one tile per thread, the field fit inside a tile runs serially then
+            #pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
+            for (int i = 0; i < (int)keys.size(); i++)
+            {
+                int tx, ty;
+                decodeKey(keys[i], tx, ty);
+                MapTile::Ptr tile = build(tx, ty, sources(keys[i]));
+                if (!tile->save(directory + "/tile_" + std::to_string(tx) + "_" + std::to_string(ty) + ".bin"))
+                    failed++;
+                points += tile->corner->size() + tile->surf->size();
+                fieldSize += tile->planes.size() + tile->lines.size();
+                int n = ++done;
+                if (n % 10 == 0)
+                    cout << "\r" << std::flush << "compiled " << n << " of " << keys.size() << " tiles";
+            }
+            cout << endl << keys.size() << " tiles, " << points << " feature points, " << fieldSize << " field voxels" << endl;
+            ofstream fout(directory + "/tiles.txt");
+            fout << tileSize << " " << cornerLeaf << " " << surfLeaf << " " << fieldResolution << "\n";
+            for (int64_t key : keys)
+            {
+                int tx, ty;
+                decodeKey(key, tx, ty);
+                fout << tx << " " << ty << "\n";
+            }
+            fout.close();
+            return failed == 0 && !fout.fail();
+        }
+
+        bool isCompiled(int64_t key)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return !compiledDirectory.empty() && !rebuiltTiles.count(key);
+        }
+
+        int64_t tileKey(int tx, int ty) const { return voxelKey(tx, ty, 0); }
+
+        // tiles overlapped by the square around (x, y)
+        vector<int64_t> tilesAround(double x, double y, double radius) const
+        {
+            vector<int64_t> keys;
+            int x0 = floor((x - radius) / tileSize), x1 = floor((x + radius) / tileSize);
+            int y0 = floor((y - radius) / tileSize), y1 = floor((y + radius) / tileSize);
+            for (int tx = x0; tx <= x1; tx++)
+                for (int ty = y0; ty <= y1; ty++)
+                    keys.push_back(tileKey(tx, ty));
+            return keys;
+        }
+
+        // index keyframes by the tiles their points can reach (key pose +- farthest point)
+        void setIndex(const pcl::PointCloud<PointType>& keyPoses, const vector<float>& reach)
+        {
+            std::unordered_map<int64_t, vector<int>> index;
+            for (int i = 0; i < (int)keyPoses.size(); i++)
+                for (int64_t key : tilesAround(keyPoses.points[i].x, keyPoses.points[i].y, reach[i]))
+                    index[key].push_back(i);
+            std::lock_guard<std::mutex> lock(mtx);
+            // compiled tiles stay available even where no keyframe is indexed
+            for (const auto& t : tileKeyframes)
+                if (!compiledDirectory.empty() && !index.count(t.first))
+                    index[t.first];
+            tileKeyframes.swap(index);
+        }
+
+        vector<int> keyframesOf(int64_t key)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = tileKeyframes.find(key);
+            return it == tileKeyframes.end() ? vector<int>() : it->second;
+        }
+
+        // tile has map content and is neither resident nor being built
+        bool needsLoading(int64_t key)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return tileKeyframes.count(key) && !tiles.count(key) && !pending.count(key);
+        }
+
+        // build the tile in the background
+        void request(int64_t key, vector<TileSource> sources)
+        {
+            int tx, ty;
+            decodeKey(key, tx, ty);
+            std::lock_guard<std::mutex> lock(mtx);
+            if (tiles.count(key) || pending.count(key))
+                return;
+            if (!compiledDirectory.empty() && !rebuiltTiles.count(key))
+                pending[key] = std::async(std::launch::async, &TileMap::loadCompiledTile, this, tx, ty).share();
+            else
+                pending[key] = std::async(std::launch::async, &TileMap::build, this, tx, ty, std::move(sources)).share();
+        }
+
+        // resident tile, waiting for it if it is still being built; null if there is nothing there
+        MapTile::Ptr get(int64_t key)
+        {
+            std::shared_future<MapTile::Ptr> future;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                collect();
+                auto it = tiles.find(key);
+                if (it != tiles.end())
+                    return it->second;
+                auto itp = pending.find(key);
+                if (itp == pending.end())
+                    return nullptr;
+                future = itp->second;
+            }
+            TicToc stall;
+            future.wait();
+            std::lock_guard<std::mutex> lock(mtx);
+            stalls++;
+            stallTime += stall.toc();
+            collect();
+            auto it = tiles.find(key);
+            return it == tiles.end() ? nullptr : it->second;
+        }
+
+        // drop resident tiles outside the square around (x, y)
+        void unloadOutside(double x, double y, double radius)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            collect();
+            for (auto it = tiles.begin(); it != tiles.end();)
+            {
+                double cx = it->second->originX + 0.5 * tileSize, cy = it->second->originY + 0.5 * tileSize;
+                if (fabs(cx - x) > radius + 0.5 * tileSize || fabs(cy - y) > radius + 0.5 * tileSize)
+                {
+                    it = tiles.erase(it);
+                    unloaded++;
+                }
+                else
+                    ++it;
+            }
+        }
+
+        // tiles whose keyframes changed are rebuilt on next use, compiled ones from the keyframes from now on
+        void invalidate(const vector<int64_t>& keys)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (int64_t key : keys)
+            {
+                if (!compiledDirectory.empty())
+                    rebuiltTiles.insert(key);
+                auto it = pending.find(key);
+                if (it != pending.end())
+                {
+                    it->second.wait();
+                    pending.erase(it);
+                }
+                tiles.erase(key);
+            }
+        }
+
+        string stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::ostringstream ss;
+            ss << "tiles: " << tiles.size() << " resident, " << pending.size() << " loading, " << built << " built, "
+               << unloaded << " unloaded, " << stalls << " stalls (" << std::fixed << std::setprecision(1) << stallTime << " ms)";
+            return ss.str();
+        }
+};
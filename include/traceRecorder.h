@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// timeline of what every thread of a node did, in the Chrome trace event format (chrome://tracing, ui.perfetto.dev).
+// Each thread writes complete events ("X": name, start, duration) into its own ring buffer, so the newest
+// bufferSize events per thread are kept however long the node runs; dump() merges them into one JSON file.
+// Disabled (the default) a scope costs one relaxed load.
+class TraceRecorder
+{
+    public:
+        static TraceRecorder& instance()
+        {
+            static TraceRecorder recorder;
+            return recorder;
+        }
+
+        static bool enabled() { return enabledFlag().load(std::memory_order_relaxed); }
+
+        // events kept per thread; takes effect for threads that record their first event afterwards
+        static void setEnabled(bool on, int bufferSize = 100000)
+        {
+            instance().capacity = std::max(bufferSize, 1);
+            enabledFlag().store(on, std::memory_order_relaxed);
+        }
+
+        // microseconds on the monotonic clock since the recorder was created
+        static uint64_t now()
+        {
+            static const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+        }
+
+        // shown as the track name; call once at the top of a thread
+        void setThreadName(const std::string& name)
+        {
+            ThreadTrace& local = threadTrace();
+            std::lock_guard<std::mutex> lock(local.mtx);
+            local.name = name;
+        }
+
+        // name and category must be string literals, only the pointers are kept
+        void record(const char* name, const char* category, uint64_t startUs, uint64_t durationUs)
+        {
+            ThreadTrace& local = threadTrace();
+            std::lock_guard<std::mutex> lock(local.mtx); // only contended while dumping
+            if (local.events.size() < local.capacity)
+                local.events.push_back({name, category, startUs, durationUs});
+            else
+                local.events[local.next] = {name, category, startUs, durationUs};
+            local.next = (local.next + 1) % local.capacity;
+        }
+
+        // writes all buffered events, oldest first per thread; returns the number of events or -1
+        long dump(const std::string& fileName)
+        {
+            std::ofstream file(fileName);
+            if (!file)
+                return -1;
+            long count = 0;
+            file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+            std::lock_guard<std::mutex> lock(mtx);
+            for (size_t t = 0; t < threads.size(); t++)
+            {
+                ThreadTrace& thread = *threads[t];
+                std::lock_guard<std::mutex> lockThread(thread.mtx);
+                if (t > 0)
+                    file << ",\n";
+                file << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << t << ",\"name\":\"thread_name\",\"args\":{\"name\":\""
+                     << (thread.name.empty() ? "thread " + std::to_string(t) : thread.name) << "\"}}";
+                size_t n = thread.events.size();
+                size_t first = n < thread.capacity ? 0 : thread.next;
+                for (size_t i = 0; i < n; i++)
+                {
+                    const Event& e = thread.events[(first + i) % n];
+                    file << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << t << ",\"name\":\"" << e.name << "\",\"cat\":\""
+                         << e.category << "\",\"ts\":" << e.startUs << ",\"dur\":" << e.durationUs << "}";
+                }
+                count += n;
+            }
+            file << "\n]}\n";
+            return file ? count : -1;
+        }
+
+    private:
+        struct Event
+        {
+            const char* name;
+            const char* category;
+            uint64_t startUs;
+            uint64_t durationUs;
+        };
+
+        struct ThreadTrace
+        {
+            std::mutex mtx;
+            std::string name;
+            std::vector<Event> events;
+            size_t capacity;
+            size_t next = 0;
+        };
+
+        std::mutex mtx;
+        std::atomic<size_t> capacity{100000};
+        // owned here, the events of finished threads stay in the dump
+        std::vector<std::unique_ptr<ThreadTrace>> threads;
+
+        static std::atomic<bool>& enabledFlag()
+        {
+            static std::atomic<bool> flag{false};
+            return flag;
+        }
+
+        ThreadTrace& threadTrace()
+        {
+            static thread_local ThreadTrace* local = nullptr;
+            if (local == nullptr)
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                threads.emplace_back(new ThreadTrace());
+                local = threads.back().get();
+                local->capacity = capacity;
+            }
+            return *local;
+        }
+};
+
+// one trace event for the enclosing scope
+class TraceScope
+{
+    public:
+        TraceScope(const char* name_, const char* category_)
+            : name(TraceRecorder::enabled() ? name_ : nullptr), category(category_)
+        {
+            if (name != nullptr)
+                start = TraceRecorder::now();
+        }
+
+        ~TraceScope()
+        {
+            if (name != nullptr)
+                TraceRecorder::instance().record(name, category, start, TraceRecorder::now() - start);
+        }
+
+    private:
+        const char* name;
+        const char* category;
+        uint64_t start = 0;
+};
+
+// drop-in for std::mutex that puts the time spent waiting for it ("wait <name>") and holding it ("hold <name>") on
+// the timeline of the locking thread. Works with lock_guard and unique_lock.
+class TracedMutex
+{
+    public:
+        // string literals, see ROLL_TRACED_MUTEX_NAMES
+        TracedMutex(const char* waitName_, const char* holdName_) : waitName(waitName_), holdName(holdName_) {}
+
+        void lock()
+        {
+            if (!TraceRecorder::enabled())
+            {
+                m.lock();
+                holdStart = 0;
+                return;
+            }
+            uint64_t start = TraceRecorder::now();
+            m.lock();
+            holdStart = TraceRecorder::now();
+            if (holdStart > start)
+                TraceRecorder::instance().record(waitName, "lock", start, holdStart - start);
+        }
+
+        bool try_lock()
+        {
+            if (!m.try_lock())
+                return false;
+            holdStart = TraceRecorder::enabled() ? TraceRecorder::now() : 0;
+            return true;
+        }
+
+        void unlock()
+        {
+            // read before unlocking, the next owner overwrites it
+            uint64_t start = holdStart;
+            uint64_t end = start != 0 ? TraceRecorder::now() : 0;
+            m.unlock();
+            if (start != 0)
+                TraceRecorder::instance().record(holdName, "lock", start, end - start);
+        }
+
+    private:
+        std::mutex m;
+        const char* waitName;
+        const char* holdName;
+        uint64_t holdStart = 0; // written by the owner only; 0 while not traced
+};
+
+#define ROLL_TRACE_CONCAT_(a, b) a##b
+#define ROLL_TRACE_CONCAT(a, b) ROLL_TRACE_CONCAT_(a, b)
+// ROLL_TRACE("mapping/loop_closure"); puts the rest of the scope on the timeline
+#define ROLL_TRACE(name) TraceScope ROLL_TRACE_CONCAT(rollTrace, __LINE__)(name, "roll")
+// TracedMutex mtx{ROLL_TRACED_MUTEX_NAMES("mapping/mtx")}; the wait and hold events need their own literals
+#define ROLL_TRACED_MUTEX_NAMES(name) "wait " name, "hold " name
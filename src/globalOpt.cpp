@@ -15,7 +15,6 @@
 // 3. add outlier detection
 
 #include "globalOpt.h"
-#include "Factors.h"
 
 #include <gtsam/geometry/Rot3.h>
 #include <gtsam/geometry/Pose3.h>
@@ -35,13 +34,14 @@ using namespace gtsam;
 
 // keep quaternion input to adapt ceres implementation
 
-GlobalOptimization::GlobalOptimization(int maxNo)
+GlobalOptimization::GlobalOptimization(int maxNo, bool runThread)
 {
 	initGPS = false;
     newGPS = false;
     newGlobalLocPose = false;
 	WGlobal_T_WLocal = Eigen::Matrix4d::Identity();
-    threadOpt = std::thread(&GlobalOptimization::optimize, this);
+    if (runThread)
+        threadOpt = std::thread(&GlobalOptimization::optimize, this);
     maxFrameNum = maxNo;
 
     reInitialize = false;
@@ -57,7 +57,8 @@ void GlobalOptimization::setTgl(Eigen::Matrix4d mat)
 
 GlobalOptimization::~GlobalOptimization()
 {
-    threadOpt.detach();
+    if (threadOpt.joinable())
+        threadOpt.detach();
 }
 
 void GlobalOptimization::affine2qt(const Eigen::Matrix4d aff, Eigen::Vector3d &p, Eigen::Quaterniond &q)
@@ -197,145 +198,11 @@ void gtsamPose2Vector(gtsam::Pose3 pose, vector<double> &qt)
 }
 void GlobalOptimization::optimize()
 {
+    TraceRecorder::instance().setThreadName("global_opt");
     while(true)
     {
         if(newGlobalLocPose)
-        {
-            if (reInitialize == true) reInitialize = false;
-
-            TicToc opt_time;
-            newGlobalLocPose = false;
-            // printf("global optimization using global localization and odometry\n");
-            TicToc globalOptimizationTime;
-
-            // gtsam
-            NonlinearFactorGraph gtSAMgraphTM;
-            Values initialEstimateTM;        
-            ISAM2 *isamTM;
-            Values isamCurrentEstimateTM;
-            ISAM2Params parameters;
-            parameters.relinearizeThreshold = 0.1;
-            parameters.relinearizeSkip = 1;
-            isamTM = new ISAM2(parameters);
-
-            //add param
-            mPoseMap.lock();
-
-            int length = localPoseMap.size();
-            // cout<<" pose no. before opt "<< length<<endl;
-            map<double, vector<double>>::iterator iterIni,iterLIO, iterLIOnext, iterGlobalLoc;
-            iterIni = globalPoseMap.begin();  //using odomTOmap value for initial guess 
-            int i = 0;
-            int found  = 0;
-            // int outlierNO = 0;
-            for (iterLIO = localPoseMap.begin(); iterLIO != localPoseMap.end(); iterLIO++, i++,iterIni++)
-            {
-                //vio factor
-                // cout<<"i lio pose: " <<i<<endl;
-                iterLIOnext = iterLIO;
-                iterLIOnext++;
-                if(iterLIOnext != localPoseMap.end())
-                {
-                    noiseModel::Diagonal::shared_ptr odometryNoise = noiseModel::Diagonal::Variances((Vector(6) <<1e-2, 1e-2, 1e-2, 1e-2, 1e-2, 1e-2 ).finished());
-                    gtsam::Pose3 poseFrom = QT2gtsamPose(iterLIO->second);
-                    gtsam::Pose3 poseTo   = QT2gtsamPose(iterLIOnext->second);
-                    gtSAMgraphTM.add(BetweenFactor<Pose3>(i,i+1, poseFrom.between(poseTo), odometryNoise));
-                }
-   
-                double t = iterLIO->first;
-                iterGlobalLoc = globalLocPoseMap.find(t); // synchronized global loc pose
-                if (iterGlobalLoc != globalLocPoseMap.end())
-                {
-                    gtsam::Pose3 poseGlobal = QT2gtsamPose(iterGlobalLoc->second);
-                    // seeems to be overconfident
-                    // noiseModel::Diagonal::shared_ptr corrNoise = noiseModel::Diagonal::Variances((Vector(6) << 1e-1, 1e-1, 1e-1, 1e-1, 1e-1, 1e-1).finished()); // rad*rad, meter*meter
-                    double tE = iterGlobalLoc->second[7];
-                    double tQ = iterGlobalLoc->second[8];
-                    noiseModel::Diagonal::shared_ptr corrNoise = noiseModel::Diagonal::Variances((Vector(6) << tQ*tQ,tQ*tQ,tQ*tQ,tE*tE,tE*tE,tE*tE).finished()); // rad*rad, meter*meter
-                    gtSAMgraphTM.add(PriorFactor<Pose3>(i, poseGlobal, corrNoise));
-                    found++;
-
-                    // for CC
-                    Eigen::Matrix4d local = Eigen::Matrix4d::Identity();
-                    Eigen::Matrix4d global = Eigen::Matrix4d::Identity();
-                    global.block<3, 3>(0, 0) = Eigen::Quaterniond(iterGlobalLoc->second[3], iterGlobalLoc->second[4], 
-                                                                        iterGlobalLoc->second[5], iterGlobalLoc->second[6]).toRotationMatrix();
-                    global.block<3, 1>(0, 3) = Eigen::Vector3d(iterGlobalLoc->second[0], iterGlobalLoc->second[1], iterGlobalLoc->second[2]);
-                    local.block<3, 3>(0, 0) = Eigen::Quaterniond(iterLIO->second[3], iterLIO->second[4], 
-                                                                        iterLIO->second[5], iterLIO->second[6]).toRotationMatrix();
-                    local.block<3, 1>(0, 3) = Eigen::Vector3d(iterLIO->second[0], iterLIO->second[1], iterLIO->second[2]);
-                    backupTgl = global*local.inverse(); // get the newest Tgl as backup
-                }
-
-                gtsam::Pose3 poseGuess = QT2gtsamPose(iterIni->second);
-                initialEstimateTM.insert(i, poseGuess);
-            }
-
-            if (found == 0)
-            {
-                mPoseMap.unlock();
-                continue;
-            }
-
-            // cout<<"found: "<<found<<endl; // why zero from the start???
-            isamTM->update(gtSAMgraphTM, initialEstimateTM);
-            isamTM->update();
-            isamTM->update();
-            gtSAMgraphTM.resize(0);
-            initialEstimateTM.clear();
-
-            isamCurrentEstimateTM = isamTM->calculateEstimate();
-
-            // cout<<"Estimate size: "<<length<<endl;
-            // update global pose
-            iterIni = globalPoseMap.begin();
-
-            Eigen::Matrix4d start;
-            Eigen::Matrix4d end;
-            Eigen::Matrix4d WVIO_T_body = Eigen::Matrix4d::Identity(); 
-            Eigen::Matrix4d WGPS_T_body = Eigen::Matrix4d::Identity();
-        
-            for (int i = 0; i < length; i++, iterIni++)
-            {
-                // cout<<"i "<<i<<"length :"<<length<<endl;
-                vector<double> globalPose(7,0);
-                gtsamPose2Vector(isamCurrentEstimateTM.at<Pose3>(i),globalPose);
-                iterIni->second = globalPose;
-
-                double t = iterIni->first;
-                WVIO_T_body.block<3, 3>(0, 0) = Eigen::Quaterniond(localPoseMap[t][3], localPoseMap[t][4], 
-                                                                    localPoseMap[t][5], localPoseMap[t][6]).toRotationMatrix();
-                WVIO_T_body.block<3, 1>(0, 3) = Eigen::Vector3d(localPoseMap[t][0], localPoseMap[t][1], localPoseMap[t][2]);
-                WGPS_T_body.block<3, 3>(0, 0) = Eigen::Quaterniond(globalPose[3], globalPose[4], 
-                                                                    globalPose[5], globalPose[6]).toRotationMatrix();
-                WGPS_T_body.block<3, 1>(0, 3) = Eigen::Vector3d(globalPose[0], globalPose[1], globalPose[2]);
-
-                WGlobal_T_WLocal = WGPS_T_body * WVIO_T_body.inverse();
-
-                if (i == 0 ) start = WGlobal_T_WLocal;
-                if (i == length - 1 ) end = WGlobal_T_WLocal;
-            }
-            
-
-            // cout<<"Tgl change "<<deltaTransGL<<endl;
-            // w. consistency check: GTSAM implementation needs CC as well
-            // OR the process will just crash without warning (the opt. time takes more than 500 ms)
-            // Tgl change too much, forfeit this optimization
-            Eigen::Matrix4d TglDelta = start.inverse()*end;
-            // cout<<"x y z: "<<TglDelta(0,3)<<" "<<TglDelta(1,3)<<" "<<TglDelta(2,3)<<endl;
-            double deltaTransGL = sqrt(TglDelta(0,3)*TglDelta(0,3) +  TglDelta(1,3)*TglDelta(1,3) + TglDelta(2,3)*TglDelta(2,3) );
-            if ( deltaTransGL > 0.5)
-            {
-                // cout<<"reset when deltaTgl = "<<deltaTransGL<<endl;
-                resetOptimization(backupTgl);
-            }
-            double opt_t = opt_time.toc();
-            // cout<<"optimization takes: "<<opt_t<<" ms"<<endl; // gtsam implementation usually takes less than 10 ms
-
-            if(opt_t> 100) cout<<"gtsam opt. takes more than 100 ms"<<endl;
-
-            mPoseMap.unlock();
-        }
+            optimizeOnce();
         // waiting for poses to be accumulated
         std::chrono::milliseconds dura(500);
         std::this_thread::sleep_for(dura);
@@ -343,3 +210,142 @@ void GlobalOptimization::optimize()
 	return;
 }
 
+// one optimization over the buffered poses, run by the optimization thread whenever a global localization pose came in
+void GlobalOptimization::optimizeOnce()
+{
+    ROLL_TRACE("globalOpt/optimize");
+    if (reInitialize == true) reInitialize = false;
+
+    TicToc opt_time;
+    newGlobalLocPose = false;
+    // printf("global optimization using global localization and odometry\n");
+    TicToc globalOptimizationTime;
+
+    // gtsam
+    NonlinearFactorGraph gtSAMgraphTM;
+    Values initialEstimateTM;        
+    Values isamCurrentEstimateTM;
+    ISAM2Params parameters;
+    parameters.relinearizeThreshold = 0.1;
+    parameters.relinearizeSkip = 1;
+    std::unique_ptr<ISAM2> isamTM(new ISAM2(parameters));
+
+    //add param
+    mPoseMap.lock();
+
+    int length = localPoseMap.size();
+    // cout<<" pose no. before opt "<< length<<endl;
+    map<double, vector<double>>::iterator iterIni,iterLIO, iterLIOnext, iterGlobalLoc;
+    iterIni = globalPoseMap.begin();  //using odomTOmap value for initial guess 
+    int i = 0;
+    int found  = 0;
+    // int outlierNO = 0;
+    for (iterLIO = localPoseMap.begin(); iterLIO != localPoseMap.end(); iterLIO++, i++,iterIni++)
+    {
+        //vio factor
+        // cout<<"i lio pose: " <<i<<endl;
+        iterLIOnext = iterLIO;
+        iterLIOnext++;
+        if(iterLIOnext != localPoseMap.end())
+        {
+            noiseModel::Diagonal::shared_ptr odometryNoise = noiseModel::Diagonal::Variances((Vector(6) <<1e-2, 1e-2, 1e-2, 1e-2, 1e-2, 1e-2 ).finished());
+            gtsam::Pose3 poseFrom = QT2gtsamPose(iterLIO->second);
+            gtsam::Pose3 poseTo   = QT2gtsamPose(iterLIOnext->second);
+            gtSAMgraphTM.add(BetweenFactor<Pose3>(i,i+1, poseFrom.between(poseTo), odometryNoise));
+        }
+   
+        double t = iterLIO->first;
+        iterGlobalLoc = globalLocPoseMap.find(t); // synchronized global loc pose
+        if (iterGlobalLoc != globalLocPoseMap.end())
+        {
+            gtsam::Pose3 poseGlobal = QT2gtsamPose(iterGlobalLoc->second);
+            // seeems to be overconfident
+            // noiseModel::Diagonal::shared_ptr corrNoise = noiseModel::Diagonal::Variances((Vector(6) << 1e-1, 1e-1, 1e-1, 1e-1, 1e-1, 1e-1).finished()); // rad*rad, meter*meter
+            double tE = iterGlobalLoc->second[7];
+            double tQ = iterGlobalLoc->second[8];
+            noiseModel::Diagonal::shared_ptr corrNoise = noiseModel::Diagonal::Variances((Vector(6) << tQ*tQ,tQ*tQ,tQ*tQ,tE*tE,tE*tE,tE*tE).finished()); // rad*rad, meter*meter
+            gtSAMgraphTM.add(PriorFactor<Pose3>(i, poseGlobal, corrNoise));
+            found++;
+
+            // for CC
+            Eigen::Matrix4d local = Eigen::Matrix4d::Identity();
+            Eigen::Matrix4d global = Eigen::Matrix4d::Identity();
+            global.block<3, 3>(0, 0) = Eigen::Quaterniond(iterGlobalLoc->second[3], iterGlobalLoc->second[4], 
+                                                                iterGlobalLoc->second[5], iterGlobalLoc->second[6]).toRotationMatrix();
+            global.block<3, 1>(0, 3) = Eigen::Vector3d(iterGlobalLoc->second[0], iterGlobalLoc->second[1], iterGlobalLoc->second[2]);
+            local.block<3, 3>(0, 0) = Eigen::Quaterniond(iterLIO->second[3], iterLIO->second[4], 
+                                                                iterLIO->second[5], iterLIO->second[6]).toRotationMatrix();
+            local.block<3, 1>(0, 3) = Eigen::Vector3d(iterLIO->second[0], iterLIO->second[1], iterLIO->second[2]);
+            backupTgl = global*local.inverse(); // get the newest Tgl as backup
+        }
+
+        gtsam::Pose3 poseGuess = QT2gtsamPose(iterIni->second);
+        initialEstimateTM.insert(i, poseGuess);
+    }
+
+    if (found == 0)
+    {
+        mPoseMap.unlock();
+        return;
+    }
+
+    // cout<<"found: "<<found<<endl; // why zero from the start???
+    isamTM->update(gtSAMgraphTM, initialEstimateTM);
+    isamTM->update();
+    isamTM->update();
+    gtSAMgraphTM.resize(0);
+    initialEstimateTM.clear();
+
+    isamCurrentEstimateTM = isamTM->calculateEstimate();
+
+    // cout<<"Estimate size: "<<length<<endl;
+    // update global pose
+    iterIni = globalPoseMap.begin();
+
+    Eigen::Matrix4d start;
+    Eigen::Matrix4d end;
+    Eigen::Matrix4d WVIO_T_body = Eigen::Matrix4d::Identity(); 
+    Eigen::Matrix4d WGPS_T_body = Eigen::Matrix4d::Identity();
+
+    for (int i = 0; i < length; i++, iterIni++)
+    {
+        // cout<<"i "<<i<<"length :"<<length<<endl;
+        vector<double> globalPose(7,0);
+        gtsamPose2Vector(isamCurrentEstimateTM.at<Pose3>(i),globalPose);
+        iterIni->second = globalPose;
+
+        double t = iterIni->first;
+        WVIO_T_body.block<3, 3>(0, 0) = Eigen::Quaterniond(localPoseMap[t][3], localPoseMap[t][4], 
+                                                            localPoseMap[t][5], localPoseMap[t][6]).toRotationMatrix();
+        WVIO_T_body.block<3, 1>(0, 3) = Eigen::Vector3d(localPoseMap[t][0], localPoseMap[t][1], localPoseMap[t][2]);
+        WGPS_T_body.block<3, 3>(0, 0) = Eigen::Quaterniond(globalPose[3], globalPose[4], 
+                                                            globalPose[5], globalPose[6]).toRotationMatrix();
+        WGPS_T_body.block<3, 1>(0, 3) = Eigen::Vector3d(globalPose[0], globalPose[1], globalPose[2]);
+
+        WGlobal_T_WLocal = WGPS_T_body * WVIO_T_body.inverse();
+
+        if (i == 0 ) start = WGlobal_T_WLocal;
+        if (i == length - 1 ) end = WGlobal_T_WLocal;
+    }
+    
+
+    // cout<<"Tgl change "<<deltaTransGL<<endl;
+    // w. consistency check: GTSAM implementation needs CC as well
+    // OR the process will just crash without warning (the opt. time takes more than 500 ms)
+    // Tgl change too much, forfeit this optimization
+    Eigen::Matrix4d TglDelta = start.inverse()*end;
+    // cout<<"x y z: "<<TglDelta(0,3)<<" "<<TglDelta(1,3)<<" "<<TglDelta(2,3)<<endl;
+    double deltaTransGL = sqrt(TglDelta(0,3)*TglDelta(0,3) +  TglDelta(1,3)*TglDelta(1,3) + TglDelta(2,3)*TglDelta(2,3) );
+    if ( deltaTransGL > 0.5)
+    {
+        // cout<<"reset when deltaTgl = "<<deltaTransGL<<endl;
+        resetOptimization(backupTgl);
+    }
+    double opt_t = opt_time.toc();
+    // cout<<"optimization takes: "<<opt_t<<" ms"<<endl; // gtsam implementation usually takes less than 10 ms
+
+    if(opt_t> 100) cout<<"gtsam opt. takes more than 100 ms"<<endl;
+
+    mPoseMap.unlock();
+}
+
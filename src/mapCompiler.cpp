@@ -0,0 +1,114 @@
+#include "utility.h"
+#include "tileMap.h"
+
+// offline map compiler: cuts a saved keyframe map into voxelized feature tiles with their plane/line field,
+// so the localization node reads finished tiles instead of assembling the map from keyframes
+// usage: rosrun roll roll_map_compile [keyframe map directory] [output directory]
+// without arguments loadKeyframeMapDirectory and compiledMapDirectory are used
+class mapCompiler : public ParamServer
+{
+    public:
+        vector<Eigen::Affine3d> keyPoses;
+        pcl::PointCloud<PointType>::Ptr keyPoses3D;
+        vector<CompactCloud::Ptr> cornerKeyFrames;
+        vector<CompactCloud::Ptr> surfKeyFrames;
+        TileMap tileMap;
+
+        mapCompiler()
+        {
+            keyPoses3D.reset(new pcl::PointCloud<PointType>());
+        }
+
+        bool loadKeyframes(const string& directory)
+        {
+            string filePath = directory + "/poses.txt";
+            ifstream fin(filePath);
+            if (!fin.is_open())
+            {
+                cout<<filePath<<" is not valid!"<<endl;
+                return false;
+            }
+            float x, y, z, roll, pitch, yaw, index;
+            int indoor;
+            while (fin>>x>>y>>z>>roll>>pitch>>yaw>>index>>indoor)
+            {
+                keyPoses.push_back(TileSource::keyframePose(x, y, z, roll, pitch, yaw));
+                PointType p;
+                p.x = x;
+                p.y = y;
+                p.z = z;
+                p.intensity = index;
+                keyPoses3D->push_back(p);
+            }
+            int keyframeN = keyPoses.size();
+            ROS_INFO("There are in total %d keyframes", keyframeN);
+            cornerKeyFrames.resize(keyframeN);
+            surfKeyFrames.resize(keyframeN);
+            #pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
+            for (int i = 0; i < keyframeN; i++)
+            {
+                cornerKeyFrames[i] = CompactCloud::loadKeyframe(directory + "/corner" + to_string(i), keyframeResolution, keyframeKeepIntensity);
+                surfKeyFrames[i] = CompactCloud::loadKeyframe(directory + "/surf" + to_string(i), keyframeResolution, keyframeKeepIntensity);
+            }
+            return keyframeN > 0;
+        }
+
+        vector<TileSource> tileSources(int64_t key)
+        {
+            vector<TileSource> sources;
+            for (int i : tileMap.keyframesOf(key))
+            {
+                TileSource source;
+                source.pose = keyPoses[i];
+                source.corner = cornerKeyFrames[i];
+                source.surf = surfKeyFrames[i];
+                sources.push_back(source);
+            }
+            return sources;
+        }
+
+        bool compile(const string& inputDirectory, const string& outputDirectory)
+        {
+            TicToc loadTime;
+            if (!loadKeyframes(inputDirectory))
+                return false;
+            ROS_INFO("Keyframes loaded in %.1f s", loadTime.toc() / 1000.0);
+
+            TicToc buildTime;
+            tileMap.configure(tileSize, mappingCornerLeafSize, mappingSurfLeafSize, numberOfCores, tileFieldResolution);
+            vector<float> reach(keyPoses.size());
+            for (size_t i = 0; i < keyPoses.size(); i++)
+                reach[i] = max(cornerKeyFrames[i]->range(), surfKeyFrames[i]->range());
+            tileMap.setIndex(*keyPoses3D, reach);
+
+            int unused = system((std::string("mkdir -p ") + outputDirectory).c_str());
+            (void)unused;
+            bool ok = tileMap.compile(outputDirectory, std::bind(&mapCompiler::tileSources, this, std::placeholders::_1));
+            double buildSeconds = buildTime.toc() / 1000.0;
+            if (!ok)
+            {
+                ROS_ERROR("Failed to write the compiled map to %s", outputDirectory.c_str());
+                return false;
+            }
+            ROS_INFO("Compiled map written to %s in %.1f s (tile size %.1f m, field resolution %.2f m)",
+                     outputDirectory.c_str(), buildSeconds, tileSize, tileFieldResolution);
+            return true;
+        }
+};
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "roll_map_compile");
+
+    mapCompiler MC;
+    string inputDirectory = argc > 1 ? argv[1] : MC.loadKeyframeMapDirectory;
+    string outputDirectory = argc > 2 ? argv[2] : MC.compiledMapDirectory;
+    if (outputDirectory.empty())
+    {
+        ROS_ERROR("No output directory, pass it as the second argument or set roll/compiledMapDirectory");
+        return 1;
+    }
+
+    ROS_INFO("\033[1;32m----> Compiling the keyframe map in %s.\033[0m", inputDirectory.c_str());
+    return MC.compile(inputDirectory, outputDirectory) ? 0 : 1;
+}
@@ -2,6 +2,7 @@
 //1. generate error cloud for visualization;
 //2. generate error tabulet with features(PCA eigenvalues, FPFH or ISHOT) calculated
 #include "utility.h"
+#include "cloudKdTree.h"
 #include "roll/cloud_info.h"
 #include "roll/save_map.h"
 
@@ -168,8 +169,8 @@ public:
     pcl::PointCloud<PointType>::Ptr lidarCloudCornerFromMapDS;
     pcl::PointCloud<PointType>::Ptr lidarCloudSurfFromMapDS;
 
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap;
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap;
+    CloudKdTree::Ptr kdtreeCornerFromMap;
+    CloudKdTree::Ptr kdtreeSurfFromMap;
 
     pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurroundingKeyPoses;
     pcl::KdTreeFLANN<PointType>::Ptr kdtreeHistoryKeyPoses;
@@ -372,8 +373,8 @@ public:
         lidarCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
         lidarCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
 
-        kdtreeCornerFromMap.reset(new pcl::KdTreeFLANN<PointType>());
-        kdtreeSurfFromMap.reset(new pcl::KdTreeFLANN<PointType>());
+        kdtreeCornerFromMap.reset(new CloudKdTree());
+        kdtreeSurfFromMap.reset(new CloudKdTree());
 
         for (int i = 0; i < 6; ++i){
             transformBeforeMapped[i] = 0;
@@ -628,8 +629,8 @@ public:
     {
         float maxTolDis = 1.0 ;
 
-        kdtreeCornerFromMap.reset(new pcl::KdTreeFLANN<PointType>());
-        kdtreeSurfFromMap.reset(new pcl::KdTreeFLANN<PointType>());
+        kdtreeCornerFromMap.reset(new CloudKdTree());
+        kdtreeSurfFromMap.reset(new CloudKdTree());
         kdtreeCornerFromMap->setInputCloud(lidarCloudCornerFromMapDS);
         kdtreeSurfFromMap->setInputCloud(lidarCloudSurfFromMapDS);
 
@@ -639,18 +640,16 @@ public:
         {
             PointType pointOri = lidarCloudCornerLastDS->points[i];
             PointType pointProj;
-            std::vector<int> pointSearchInd;
-            std::vector<float> pointSearchSqDis;
          
             pointAssociateToMap(&pointOri, &pointProj);
-            kdtreeCornerFromMap->nearestKSearch(pointProj, 1, pointSearchInd, pointSearchSqDis);
+            Neighbours<1> nn = knn<1>(*kdtreeCornerFromMap, pointProj);
 
             // paint the point with intensity normalized with 255 (maxTolDis)
             
-            if (pointSearchSqDis[0] < maxTolDis)
+            if (nn.full() && nn.sqDistances[0] < maxTolDis)
             {
-                PointType errPoint = lidarCloudCornerFromMapDS->points[pointSearchInd[0]];
-                errPoint.intensity = pointSearchSqDis[0]*255/maxTolDis;
+                PointType errPoint = lidarCloudCornerFromMapDS->points[nn.indices[0]];
+                errPoint.intensity = nn.sqDistances[0]*255/maxTolDis;
                 errCloud->push_back(errPoint);
             }   
         }
@@ -659,18 +658,16 @@ public:
         {
             PointType pointOri = lidarCloudSurfLastDS->points[i];
             PointType pointProj;
-            std::vector<int> pointSearchInd;
-            std::vector<float> pointSearchSqDis;
          
             pointAssociateToMap(&pointOri, &pointProj);
-            kdtreeSurfFromMap->nearestKSearch(pointProj, 1, pointSearchInd, pointSearchSqDis);
+            Neighbours<1> nn = knn<1>(*kdtreeSurfFromMap, pointProj);
 
             // paint the point with intensity normalized with 255 (maxTolDis)
             
-            if (pointSearchSqDis[0] < maxTolDis)
+            if (nn.full() && nn.sqDistances[0] < maxTolDis)
             {
-                PointType errPoint = lidarCloudSurfFromMapDS->points[pointSearchInd[0]];
-                errPoint.intensity = pointSearchSqDis[0]*255/maxTolDis;
+                PointType errPoint = lidarCloudSurfFromMapDS->points[nn.indices[0]];
+                errPoint.intensity = nn.sqDistances[0]*255/maxTolDis;
                 errCloud->push_back(errPoint);
             }   
         }
@@ -991,7 +988,7 @@ public:
    
     void keyframeSparsification(pcl::PointCloud<PointType>::Ptr  &cloudKeyPoses3DDS, float resMap,float resPoseIndoor, float resPoseOutdoor)
     {
-        pcl::KdTreeFLANN<PointType>::Ptr kdtreeGlobalKeyPoses(new pcl::KdTreeFLANN<PointType>());
+        CloudKdTree::Ptr kdtreeGlobalKeyPoses(new CloudKdTree());
         kdtreeGlobalKeyPoses->setInputCloud(cloudKeyPoses3D);
 
         // separate indoor or outdoor
@@ -1007,8 +1004,6 @@ public:
                 keyPosesOutdoor->push_back(cloudKeyPoses3D->points[i]);
         }
 
-        std::vector<int> pointSearchIndGlobalMap;
-        std::vector<float> pointSearchSqDisGlobalMap;      
         pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyPosesI;
         //outdoor
         pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyPosesO;
@@ -1018,8 +1013,7 @@ public:
         // fix the keyframe downsample bug
         for(auto& pt : keyPosesIndoorDS->points)
         {
-            kdtreeGlobalKeyPoses->nearestKSearch(pt, 1, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap);
-            pt.intensity = cloudKeyPoses3D->points[pointSearchIndGlobalMap[0]].intensity;
+            pt.intensity = cloudKeyPoses3D->points[knn<1>(*kdtreeGlobalKeyPoses, pt).indices[0]].intensity;
             cloudKeyPoses3DDS->push_back(pt);
         }
         cout<<"indoor: "<<keyPosesIndoorDS->size()<<" frames" <<endl;
@@ -1031,8 +1025,7 @@ public:
         // fix the keyframe downsample bug
         for(auto& pt : keyPosesOutdoorDS->points)
         {
-            kdtreeGlobalKeyPoses->nearestKSearch(pt, 1, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap);
-            pt.intensity = cloudKeyPoses3D->points[pointSearchIndGlobalMap[0]].intensity;
+            pt.intensity = cloudKeyPoses3D->points[knn<1>(*kdtreeGlobalKeyPoses, pt).indices[0]].intensity;
             cloudKeyPoses3DDS->push_back(pt);
         }
         cout<<"outdoor: "<<keyPosesOutdoorDS->size()<<" frames" <<endl;
@@ -1,9 +1,17 @@
 #include "utility.h"
 #include "roll/cloud_info.h"
 #include "roll/save_map.h"
+#include "roll/save_map_status.h"
+#include "roll/dump_trace.h"
 
-#include"LOAMmapping.h"
+#include "registrationFactory.h"
+#include "mapExporter.h"
+#include "keyframeMap.h"
+#include "tileMap.h"
 #include "globalOpt.h"
+#include "boundedQueue.h"
+#include "frameAdmission.h"
+#include "stageLatencyPublisher.h"
 #include <gtsam/geometry/Rot3.h>
 #include <gtsam/geometry/Pose3.h>
 #include <gtsam/slam/PriorFactor.h>
@@ -20,28 +28,6 @@
 
 using namespace gtsam;
 
-/*
-    * A point cloud type that has 6D pose info ([x,y,z,roll,pitch,yaw] intensity is time stamp)
-    */
-
-struct PointXYZIRPYT
-{
-    PCL_ADD_POINT4D
-    PCL_ADD_INTENSITY;                  // preferred way of adding a XYZ+padding
-    float roll;
-    float pitch;
-    float yaw;
-    double time;
-    EIGEN_MAKE_ALIGNED_OPERATOR_NEW   // make sure our new allocators are aligned
-} EIGEN_ALIGN16;                    // enforce SSE padding for correct memory alignment
-
-POINT_CLOUD_REGISTER_POINT_STRUCT (PointXYZIRPYT,
-                                   (float, x, x) (float, y, y)
-                                   (float, z, z) (float, intensity, intensity)
-                                   (float, roll, roll) (float, pitch, pitch) (float, yaw, yaw)
-                                   (double, time, time))
-
-typedef PointXYZIRPYT  PointTypePose;
 typedef geometry_msgs::PoseWithCovarianceStampedConstPtr rvizPoseType;
 
 
@@ -49,8 +35,63 @@ typedef geometry_msgs::PoseWithCovarianceStampedConstPtr rvizPoseType;
 // for trajectory alignment
 GlobalOptimization globalEstimator(500);
 
+// everything the map saver needs, copied under mtx so saving can run beside mapping
+// keyframe clouds are never modified once pushed, so sharing the pointers is enough
+struct MapSnapshot
+{
+    pcl::PointCloud<PointType>::Ptr keyPoses3D;
+    pcl::PointCloud<PointTypePose>::Ptr keyPoses6D;
+    KeyframeStore::View cornerKeyFrames;
+    KeyframeStore::View surfKeyFrames;
+    vector<int> isIndoor;
+    // t x y z qx qy qz qw
+    vector<array<double, 8>> pathMapping;
+    vector<array<double, 8>> pathFusion;
+    vector<array<double, 8>> pathFusionVINS;
+};
 
-class mapOptimization : public ParamServer
+struct SaveMapJob
+{
+    int id = 0;
+    float resMap, resPoseIndoor, resPoseOutdoor, overlapThre;
+    std::atomic<bool> done{false};
+    std::atomic<bool> success{false};
+    std::atomic<int> processed{0};
+    std::atomic<int> total{0};
+    std::shared_future<bool> result;
+
+    void setStage(const string& s)
+    {
+        std::lock_guard<std::mutex> lock(mtxStage);
+        stage = s;
+        processed = 0;
+        total = 0;
+    }
+    string getStage()
+    {
+        std::lock_guard<std::mutex> lock(mtxStage);
+        return stage;
+    }
+
+private:
+    std::mutex mtxStage;
+    string stage = "snapshot";
+};
+
+// one synchronized cloud_info/odometry pair, deserialized and downsampled ahead of registration
+struct MappingFrame
+{
+    ros::Time stamp;
+    Eigen::Affine3f imuToOdom;
+    pcl::PointCloud<PointType>::Ptr corner{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::Ptr surf{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::Ptr raw{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::Ptr cornerDS{new pcl::PointCloud<PointType>()};
+    pcl::PointCloud<PointType>::Ptr surfDS{new pcl::PointCloud<PointType>()};
+};
+
+
+class mapOptimization : public ParamServer, public KeyframeMap
 {
 
 public:
@@ -109,14 +150,16 @@ public:
 
     Eigen::Affine3f correctedPose;
 
-    pcl::PointCloud<PointType>::Ptr cloudKeyPoses3D;
-    pcl::PointCloud<PointTypePose>::Ptr cloudKeyPoses6D;
-
     // for kitti pose save
     Eigen::Affine3f H_init;
     vector<Eigen::Affine3f> pose_kitti_vec;
 
-    bool doneSavingMap = false;
+    std::atomic<bool> doneSavingMap{false};
+
+    // map saving runs in the background on a snapshot
+    std::mutex mtxSaveJob;
+    std::shared_ptr<SaveMapJob> saveMapJob;
+    int saveMapJobCount = 0;
 
     Eigen::Affine3f affine_imu_to_odom; // convert points in lidar frame to odom frame
     Eigen::Affine3f affine_imu_to_map;
@@ -155,6 +198,8 @@ public:
     ros::Publisher pubRecentKeyFrame;
     ros::Publisher pubLoopConstraintEdge;
     ros::Publisher pubKeyPosesTmp;
+    ros::Publisher pubDeadlineMisses;
+    ros::Publisher pubAdmission;
 
     ros::Subscriber subCloud;
     ros::Subscriber subGPS;
@@ -163,19 +208,40 @@ public:
     ros::Subscriber subLidarOdometry;
     ros::Subscriber initialpose_sub;
     ros::ServiceServer srvSaveMap;
+    ros::ServiceServer srvSaveMapStatus;
+    ros::ServiceServer srvDumpTrace;
 
     std::deque<nav_msgs::Odometry> gpsQueue;
     std::deque<nav_msgs::Odometry> gtQueue;
 
-    roll::cloud_info cloudInfo;
     queue<roll::cloud_infoConstPtr> cloudInfoBuffer;
     queue<nav_msgs::Odometry::ConstPtr> lidarOdometryBuffer;
-
-    vector<pcl::PointCloud<PointType>::Ptr> cornerCloudKeyFrames;
-    vector<pcl::PointCloud<PointType>::Ptr> surfCloudKeyFrames;
-
-    vector<pcl::PointCloud<PointType>::Ptr> temporaryCornerCloudKeyFrames;
-    vector<pcl::PointCloud<PointType>::Ptr> temporarySurfCloudKeyFrames;
+    // prepareFrames -> run -> publishFrames
+    BoundedQueue<MappingFrame> frameQueue{(size_t)pipelineQueueSize};
+    BoundedQueue<std::function<void()>> publishQueue{(size_t)pipelineQueueSize};
+    std::unique_ptr<FrameAdmission> admission;
+    StageLatencyPublisher stageLatencyPublisher;
+
+    // localization map served by tiles
+    TileMap tileMap;
+    vector<float> keyframeReach; // distance to the farthest feature point of each keyframe
+    // local map and the registration target are kept while the same tiles are resident
+    vector<MapTile::Ptr> localMapTiles;
+    MapField::Ptr localMapField;
+    // the tile local map is in the frame of a tile corner near the robot, so matching runs on small coordinates;
+    // zero for the keyframe local maps, which are in the map frame
+    Eigen::Vector3d localMapOrigin = Eigen::Vector3d::Zero();
+    Registration::Ptr registration; // scan-to-map backend, created once
+    int localMapFrames = 0;
+    int localMapRebuilds = 0;
+    double localMapTime = 0;        // ms, all frames
+    double localMapRebuildTime = 0; // ms, frames that had to concatenate and index the tiles
+    int registrationFrames = 0;
+    int budgetLimitedFrames = 0;    // registration degraded to stay within registrationTimeBudget
+    int deadlineMisses = 0;         // registration took longer than registrationTimeBudget anyway
+
+    vector<CompactCloud::Ptr> temporaryCornerCloudKeyFrames;
+    vector<CompactCloud::Ptr> temporarySurfCloudKeyFrames;
 
 
     pcl::PointCloud<PointType>::Ptr copy_cloudKeyPoses3D;
@@ -193,20 +259,12 @@ public:
 
 
     map<int, pair<pcl::PointCloud<PointType>, pcl::PointCloud<PointType>>> lidarCloudMapContainer;
-    pcl::PointCloud<PointType>::Ptr lidarCloudCornerFromMap;
-    pcl::PointCloud<PointType>::Ptr lidarCloudSurfFromMap;
-    pcl::PointCloud<PointType>::Ptr lidarCloudCornerFromMapDS;
-    pcl::PointCloud<PointType>::Ptr lidarCloudSurfFromMapDS;
 
 
 
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurroundingKeyPoses;
     pcl::KdTreeFLANN<PointType>::Ptr kdtreeHistoryKeyPoses;
 
-    pcl::VoxelGrid<PointType> downSizeFilterCorner;
-    pcl::VoxelGrid<PointType> downSizeFilterSurf;
     pcl::VoxelGrid<PointType> downSizeFilterICP;
-    pcl::VoxelGrid<PointType> downSizeFilterSurroundingKeyPoses; // for surrounding key poses of scan-to-map optimization
     pcl::VoxelGrid<PointType> downSizeFilterSavingKeyframes; // for surrounding key poses of scan-to-map optimization
     
     ros::Time timeLidarInfoStamp;
@@ -215,15 +273,13 @@ public:
 
     float transformTobeMapped[6];
     
-    std::mutex mtx;
+    TracedMutex mtx{ROLL_TRACED_MUTEX_NAMES("mapping/mtx")};
     std::mutex mtxInit;
     std::mutex mtxLoopInfo;
     std::mutex pose_estimator_mutex;
     // std::mutext mtxReloc;
 
 
-    int lidarCloudCornerFromMapDSNum = 0;
-    int lidarCloudSurfFromMapDSNum = 0;
     int lidarCloudCornerLastDSNum = 0;
     int lidarCloudSurfLastDSNum = 0;
 
@@ -238,6 +294,7 @@ public:
     vector<nav_msgs::Odometry> globalOdometry;
     
     nav_msgs::Path globalPath;
+    double pathPublishTime = -1; // sensor time globalPath was last handed to the publish thread
     nav_msgs::Path globalPathFusion;
     nav_msgs::Path globalPathFusionVINS;
 
@@ -248,7 +305,7 @@ public:
     
     pcl::PointCloud<PointType>::Ptr lidarCloudRaw; 
 
-    mapOptimization()
+    mapOptimization() : KeyframeMap(static_cast<const RollConfig&>(*this))
     {
         pose_log_file.open(saveMapDirectory + "/global_matching_pose_log.txt");
         pose_log_file.setf(ios::fixed, ios::floatfield);  // 设定为 fixed 模式，以小数点表示浮点数
@@ -271,6 +328,8 @@ public:
         initialpose_sub = nh.subscribe("/initialpose", 1, &mapOptimization::initialpose_callback, this);
 
         pubKeyPosesTmp                 = nh.advertise<sensor_msgs::PointCloud2>("/roll/mapping/tmp_key_poses", 1);
+        pubDeadlineMisses = nh.advertise<std_msgs::Int32>("/roll/mapping/deadline_misses", 1);
+        pubAdmission = nh.advertise<std_msgs::Float64MultiArray>("/roll/mapping/admission", 1);
         pubKeyPoses                 = nh.advertise<sensor_msgs::PointCloud2>("/roll/mapping/key_poses", 1);
         pubLidarCloudSurround       = nh.advertise<sensor_msgs::PointCloud2>("/roll/mapping/map_global", 1);
         pubLidarOdometryGlobal      = nh.advertise<nav_msgs::Odometry> ("/roll/mapping/odometry", 1);
@@ -298,11 +357,10 @@ public:
         
 
         srvSaveMap  = nh.advertiseService("/roll/save_map", &mapOptimization::saveMapService, this);
+        srvSaveMapStatus  = nh.advertiseService("/roll/save_map_status", &mapOptimization::saveMapStatusService, this);
+        srvDumpTrace  = nh.advertiseService("/roll/dump_trace", &mapOptimization::dumpTraceService, this);
 
-        downSizeFilterCorner.setLeafSize(mappingCornerLeafSize, mappingCornerLeafSize, mappingCornerLeafSize);
-        downSizeFilterSurf.setLeafSize(mappingSurfLeafSize, mappingSurfLeafSize, mappingSurfLeafSize);
         downSizeFilterICP.setLeafSize(mappingSurfLeafSize, mappingSurfLeafSize, mappingSurfLeafSize);
-        downSizeFilterSurroundingKeyPoses.setLeafSize(surroundingKeyframeDensity, surroundingKeyframeDensity, surroundingKeyframeDensity); // for surrounding key poses of scan-to-map optimization
 
         // gps parameter calculation
         double earthEqu = 6378135;
@@ -312,6 +370,15 @@ public:
         rew = earthEqu*earthEqu/tmp;
 
         allocateMemory();
+        registration = createRegistration(registrationMethod, *this);
+        FrameAdmission::Policy policy = FrameAdmission::LATEST;
+        if (!FrameAdmission::parsePolicy(admissionPolicy, policy))
+            ROS_WARN("Unknown admissionPolicy %s, using latest", admissionPolicy.c_str());
+        admission.reset(new FrameAdmission(policy, admissionBacklog, admissionNth));
+        Instrumentation::setEnabled(stageTiming);
+        if (stageTiming)
+            stageLatencyPublisher.start(nh, "mapping", saveMapDirectory + "/stage_latency_mapping.csv", stageTimingPeriod);
+        TraceRecorder::setEnabled(trace, traceBufferSize);
 
         if (localizationMode)
         { // even ctrl+C won't terminate loading process
@@ -345,20 +412,45 @@ public:
                 }
                 int keyframeN = (int)cloudKeyPoses6D->size();
                 ROS_INFO("There are in total %d keyframes",keyframeN);
+                size_t pointN = 0, compactBytes = 0;
                 for (int i=0;i<keyframeN;i++){
-                    pcl::PointCloud<PointType>::Ptr cornerKeyFrame(new pcl::PointCloud<PointType>());
-                    pcl::PointCloud<PointType>::Ptr surfKeyFrame(new pcl::PointCloud<PointType>());
-                    string cornerFileName = loadKeyframeMapDirectory + "/corner"+ to_string(i) + ".pcd";
-                    string surfFileName = loadKeyframeMapDirectory + "/surf"+ to_string(i) + ".pcd";
-                    if (pcl::io::loadPCDFile<PointType> (cornerFileName, *cornerKeyFrame) == -1) 
-                       cout<< "Couldn't read file"+ cornerFileName <<endl;
-                    if (pcl::io::loadPCDFile<PointType> (surfFileName, *surfKeyFrame) == -1) 
-                       cout<< "Couldn't read file"+ surfFileName <<endl;
+                    CompactCloud::Ptr cornerKeyFrame = CompactCloud::loadKeyframe(loadKeyframeMapDirectory + "/corner"+ to_string(i), keyframeResolution, keyframeKeepIntensity);
+                    CompactCloud::Ptr surfKeyFrame = CompactCloud::loadKeyframe(loadKeyframeMapDirectory + "/surf"+ to_string(i), keyframeResolution, keyframeKeepIntensity);
                     cornerCloudKeyFrames.push_back(cornerKeyFrame);
                     surfCloudKeyFrames.push_back(surfKeyFrame);
+                    pointN += cornerKeyFrame->size() + surfKeyFrame->size();
+                    compactBytes += cornerKeyFrame->bytes() + surfKeyFrame->bytes();
                     if (i%100 == 0)
                         cout << "\r" << std::flush << "Loading feature cloud " << i << " of " << keyframeN-1 << " ...\n";
                 }
+                if (useTileMap)
+                {
+                    tileMap.configure(tileSize, mappingCornerLeafSize, mappingSurfLeafSize, numberOfCores, useMapField ? tileFieldResolution : 0);
+                    if (!compiledMapDirectory.empty() && tileMap.loadCompiled(compiledMapDirectory))
+                    {
+                        ROS_INFO("Compiled map tiles from %s", compiledMapDirectory.c_str());
+                        // the compiled settings are used from here on, the local map follows tileMap.getTileSize()
+                        if (tileMap.getTileSize() != tileSize || tileMap.getCornerLeaf() != mappingCornerLeafSize
+                            || tileMap.getSurfLeaf() != mappingSurfLeafSize)
+                            ROS_WARN("Compiled map has tile size %.1f and leaf sizes %.2f/%.2f, configured are %.1f and %.2f/%.2f; using the compiled ones",
+                                     tileMap.getTileSize(), tileMap.getCornerLeaf(), tileMap.getSurfLeaf(),
+                                     tileSize, mappingCornerLeafSize, mappingSurfLeafSize);
+                        // a map compiled without a field has no planes or lines to look up
+                        if (useMapField && tileMap.getFieldResolution() <= 0)
+                        {
+                            ROS_WARN("Compiled map has no primitive field, useMapField is turned off");
+                            useMapField = false;
+                        }
+                    }
+                    keyframeReach.resize(keyframeN);
+                    #pragma omp parallel for num_threads(numberOfCores)
+                    for (int i = 0; i < keyframeN; i++)
+                        keyframeReach[i] = max(cornerCloudKeyFrames[i]->range(), surfCloudKeyFrames[i]->range());
+                    tileMap.setIndex(*cloudKeyPoses3D, keyframeReach);
+                }
+                ROS_INFO_STREAM(cornerCloudKeyFrames.stats());
+                ROS_INFO_STREAM(surfCloudKeyFrames.stats());
+                ROS_INFO("Keyframe clouds: %zu points, %.1f MB compact (%.1f MB as PointXYZI)", pointN, compactBytes/1048576.0, pointN*sizeof(PointType)/1048576.0);
                 ROS_INFO("************************Keyframe map loaded************************");
                 mapLoaded=true;
             }
@@ -369,9 +461,9 @@ public:
     void allocateMemory()
     {        
         resetISAM();
-        affine_imu_to_body = pcl::getTransformation(-0.11, -0.18, -0.71, 0.0, 0.0, 0.0);
-        affine_lidar_to_body = pcl::getTransformation(0.002, -0.004, -0.957, 0.014084807063594,0.002897246558311,-1.583065991436417);
-        affine_gps_to_body = pcl::getTransformation(-0.24, 0,-1.24, 0,0,0);
+        affine_imu_to_body = trans2Affine3f(imuToBody);
+        affine_lidar_to_body = trans2Affine3f(lidarToBody);
+        affine_gps_to_body = trans2Affine3f(gpsToBody);
 
         affine_lidar_to_imu = affine_imu_to_body.inverse()*affine_lidar_to_body;
 
@@ -384,19 +476,12 @@ public:
 
         lidarCloudRaw.reset(new pcl::PointCloud<PointType>()); 
 
-        cloudKeyPoses3D.reset(new pcl::PointCloud<PointType>());
-        cloudKeyPoses6D.reset(new pcl::PointCloud<PointTypePose>());
-
-        cloudKeyPoses3D.reset(new pcl::PointCloud<PointType>());
-        cloudKeyPoses6D.reset(new pcl::PointCloud<PointTypePose>());
-
         copy_cloudKeyPoses3D.reset(new pcl::PointCloud<PointType>());
         copy_cloudKeyPoses6D.reset(new pcl::PointCloud<PointTypePose>());
 
         temporaryCloudKeyPoses3D.reset(new pcl::PointCloud<PointType>());
         temporaryCloudKeyPoses6D.reset(new pcl::PointCloud<PointTypePose>());
 
-        kdtreeSurroundingKeyPoses.reset(new pcl::KdTreeFLANN<PointType>());
         kdtreeHistoryKeyPoses.reset(new pcl::KdTreeFLANN<PointType>());
 
         lidarCloudCornerLast.reset(new pcl::PointCloud<PointType>()); // corner feature set from odoOptimization
@@ -404,12 +489,6 @@ public:
         lidarCloudCornerLastDS.reset(new pcl::PointCloud<PointType>()); // downsampled corner featuer set from odoOptimization
         lidarCloudSurfLastDS.reset(new pcl::PointCloud<PointType>()); // downsampled surf featuer set from odoOptimization
 
-
-        lidarCloudCornerFromMap.reset(new pcl::PointCloud<PointType>());
-        lidarCloudSurfFromMap.reset(new pcl::PointCloud<PointType>());
-        lidarCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
-        lidarCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
-
         for (int i = 0; i < 6; ++i){
             transformBeforeMapped[i] = 0;
             transformTobeMapped[i] = 0;
@@ -444,13 +523,16 @@ public:
 
     void lidarCloudInfoHandler(const roll::cloud_infoConstPtr& msgIn)
     {
+        ROLL_TRACE("spinner/cloud_info");
         mtx.lock();
         cloudInfoBuffer.push(msgIn);
         mtx.unlock();
+        admission->received();
     }
 
     void lidarOdometryHandler(const nav_msgs::Odometry::ConstPtr& msgIn)
     {
+        ROLL_TRACE("spinner/odometry");
         mtx.lock();
         lidarOdometryBuffer.push(msgIn);
         mtx.unlock();
@@ -594,153 +676,240 @@ public:
         // br.sendTransform(trans_odom_to_lidar);
         mtx.unlock();
     }
-    void run()
+    // pipeline stage 1: pairs cloud_info with odometry, deserializes and downsamples the next frame while the mapping
+    // thread registers the current one
+    void prepareFrames()
     {
-        ros::Rate matchingRate(globalMatchingRate);
-        while(ros::ok()){ // why while(1) is not okay???
-            while (!cloudInfoBuffer.empty() && !lidarOdometryBuffer.empty())
+        TraceRecorder::instance().setThreadName("prepare");
+        double lastFrameTime = -1;
+        while (ros::ok())
+        {
+            // pick the message only once the mapping thread can take it, so it is as fresh as possible
+            if (!frameQueue.waitForSpace())
+                break;
+            roll::cloud_infoConstPtr cloudInfoMsg;
+            nav_msgs::Odometry::ConstPtr lidarOdometryMsg;
+            if (!nextMessagePair(cloudInfoMsg, lidarOdometryMsg))
             {
-                mtx.lock();
-                while (!lidarOdometryBuffer.empty() && lidarOdometryBuffer.front()->header.stamp.toSec() < cloudInfoBuffer.front()->header.stamp.toSec())
-                {
-                    lidarOdometryBuffer.pop();
-                }
-                if (lidarOdometryBuffer.empty()){
-                    mtx.unlock();
-                    break;
-                }
-
-                // lower the global matching frequency to speed up
-                timeLidarInfoStamp = cloudInfoBuffer.front()->header.stamp;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
 
-                cloudInfoTime = cloudInfoBuffer.front()->header.stamp.toSec();
+            // lower the global matching frequency to speed up; sensor time with 10% slack for stamp jitter, so a rate
+            // equal to the LiDAR rate keeps every frame
+            double frameTime = cloudInfoMsg->header.stamp.toSec();
+            if (lastFrameTime > 0 && frameTime - lastFrameTime < 0.9 / globalMatchingRate)
+            {
+                admission->throttled();
+                continue;
+            }
+            lastFrameTime = frameTime;
+
+            ROLL_STAGE("mapping/prepare");
+            MappingFrame frame;
+            frame.stamp = cloudInfoMsg->header.stamp;
+            Eigen::Affine3f tmp;
+            odometryMsgToAffine3f(*lidarOdometryMsg,tmp);
+            // // // use raw, motion-skewed clouds
+            // affine_imu_to_odom =affine_imu_to_body*affine_imu_to_odom*affine_lidar_to_imu;
+            // use deskewed, imu-centered clouds
+            frame.imuToOdom = affine_imu_to_body*tmp;
+            pcl::fromROSMsg(cloudInfoMsg->cloud_corner,  *frame.corner);
+            pcl::fromROSMsg(cloudInfoMsg->cloud_surface, *frame.surf);
+            pcl::fromROSMsg(cloudInfoMsg->cloud_raw,  *frame.raw);
+            downsampleCurrentScan(frame);
+            if (!frameQueue.push(std::move(frame)))
+                admission->droppedInPipeline();
+        }
+    }
 
-                double lidarOdometryTime = lidarOdometryBuffer.front()->header.stamp.toSec();
+    // next cloud_info the admission policy lets through, with its odometry; false if there is none yet
+    bool nextMessagePair(roll::cloud_infoConstPtr& cloudInfoMsg, nav_msgs::Odometry::ConstPtr& lidarOdometryMsg)
+    {
+        std::lock_guard<TracedMutex> lock(mtx);
+        for (int drop = admission->trim(cloudInfoBuffer.size()); drop > 0; drop--)
+            cloudInfoBuffer.pop();
+        while (!cloudInfoBuffer.empty() && !lidarOdometryBuffer.empty())
+        {
+            while (!lidarOdometryBuffer.empty() && lidarOdometryBuffer.front()->header.stamp.toSec() < cloudInfoBuffer.front()->header.stamp.toSec())
+            {
+                lidarOdometryBuffer.pop();
+            }
+            if (lidarOdometryBuffer.empty())
+                return false;
 
-                if(debugMode) cout<<setiosflags(ios::fixed)<<setprecision(3)<<"cloud time: "<<cloudInfoTime-rosTimeStart<<endl;
+            double cloudTime = cloudInfoBuffer.front()->header.stamp.toSec();
+            double lidarOdometryTime = lidarOdometryBuffer.front()->header.stamp.toSec();
+            if (abs(lidarOdometryTime - cloudTime) > 0.05) // normally >, so pop one cloud_info msg
+            {
+                // ROS_WARN("Unsync message!");
+                cloudInfoBuffer.pop();  // pop the old one,otherwise it  will go to dead loop, different from aloam 
+                admission->unsynced();
+                continue;
+            }
 
-                if (rosTimeStart < 0) rosTimeStart = cloudInfoTime;
+            cloudInfoMsg = cloudInfoBuffer.front();
+            lidarOdometryMsg = lidarOdometryBuffer.front();
+            cloudInfoBuffer.pop();
+            lidarOdometryBuffer.pop(); 
+            if (!admission->admit())
+                continue;
+            return true;
+        }
+        return false;
+    }
 
-                if (abs(lidarOdometryTime - cloudInfoTime) > 0.05) // normally >, so pop one cloud_info msg
-                {
-                    // ROS_WARN("Unsync message!");
-                    cloudInfoBuffer.pop();  // pop the old one,otherwise it  will go to dead loop, different from aloam 
-                    mtx.unlock();
-                    break;
-                }
+    // pipeline stage 2: registration and keyframes. Keyframe saving stays here, the next frame's initial guess and
+    // local map are built from the keyframes and corrected poses it produces.
+    void run()
+    {
+        TraceRecorder::instance().setThreadName("mapping");
+        MappingFrame frame;
+        while (frameQueue.pop(frame))
+        {
+            ROLL_STAGE("mapping/frame");
+            timeLidarInfoStamp = frame.stamp;
+            cloudInfoTime = timeLidarInfoStamp.toSec();
+            if(debugMode) cout<<setiosflags(ios::fixed)<<setprecision(3)<<"cloud time: "<<cloudInfoTime-rosTimeStart<<endl;
+            if (rosTimeStart < 0) rosTimeStart = cloudInfoTime;
 
-                // extract info and feature cloud
-                roll::cloud_infoConstPtr cloudInfoMsg = cloudInfoBuffer.front();
-                nav_msgs::Odometry::ConstPtr lidarOdometryMsg =  lidarOdometryBuffer.front();
-
-                lidarCloudRaw.reset(new pcl::PointCloud<PointType>()); 
-                cloudInfo = *cloudInfoMsg;
-                Eigen::Affine3f tmp;
-                odometryMsgToAffine3f(*lidarOdometryMsg,tmp);
-                // // // use raw, motion-skewed clouds
-                // affine_imu_to_odom =affine_imu_to_body*affine_imu_to_odom*affine_lidar_to_imu;
-                // use deskewed, imu-centered clouds
-                affine_imu_to_odom =affine_imu_to_body*tmp;
-
-                pcl::fromROSMsg(cloudInfoMsg->cloud_corner,  *lidarCloudCornerLast);
-                pcl::fromROSMsg(cloudInfoMsg->cloud_surface, *lidarCloudSurfLast);
-                pcl::fromROSMsg(cloudInfoMsg->cloud_raw,  *lidarCloudRaw);
-                // clear
-                lidarOdometryBuffer.pop(); 
-                while (!cloudInfoBuffer.empty())
-                {
-                    cloudInfoBuffer.pop();
-                    // ROS_INFO_STREAM("popping old cloud_info messages for real-time performance");
-                }
-                mtx.unlock();
+            mtx.lock();
+            affine_imu_to_odom = frame.imuToOdom;
+            mtx.unlock();
+            lidarCloudCornerLast = frame.corner;
+            lidarCloudSurfLast = frame.surf;
+            lidarCloudRaw = frame.raw;
+            lidarCloudCornerLastDS = frame.cornerDS;
+            lidarCloudSurfLastDS = frame.surfDS;
+            lidarCloudCornerLastDSNum = lidarCloudCornerLastDS->size();
+            lidarCloudSurfLastDSNum = lidarCloudSurfLastDS->size();
+
+            TicToc mapping;
+            
+            updateInitialGuess(); // actually the same as ALOAM
 
-                TicToc mapping;
+            if (tryReloc == true || relocSuccess == true)
+            {
+                TicToc extract;
+                extractNearby();
                 
-                updateInitialGuess(); // actually the same as ALOAM
-
-                if (tryReloc == true || relocSuccess == true)
+                if(debugMode) cout<<"extract: "<<extract.toc()<<endl;
+                TicToc opt;
+                
+                scan2MapOptimization();
+                
+                float optTime = opt.toc();
+                if(debugMode)  cout<<"optimization: "<<optTime<<endl; // > 90% of the total time
+                
+                TicToc optPose;
                 {
-                    TicToc extract;
-                    extractNearby();
-                    
-                    if(debugMode) cout<<"extract: "<<extract.toc()<<endl;
-                    TicToc downsample;
-                    downsampleCurrentScan();
-
-                    if(debugMode) cout<<"downsample: "<<downsample.toc()<<endl;
-                    TicToc opt;
-                    
-                    scan2MapOptimization();
-                    
-                    float optTime = opt.toc();
-                    if(debugMode)  cout<<"optimization: "<<optTime<<endl; // > 90% of the total time
-                    
-                    TicToc optPose;
+                    ROLL_STAGE("mapping/keyframes");
                     if (localizationMode)
                     {
                         saveTemporaryKeyframes();
-                        updatePathRELOC(cloudInfoMsg);  // for visualizing in rviz
+                        updatePathRELOC(frame.stamp);  // for visualizing in rviz
                     }
                     else
                     {
                         saveKeyFramesAndFactor();
                         correctPoses();
                     }
-                    float optPoseTime = optPose.toc();
-                    if(debugMode)  cout<<"pose opt. takes "<< optPoseTime<<endl;
-                    TicToc publish;
-                    publishLocalMap();
-                    publishOdometry();
-                    transformUpdate();
-                    
-                    frameTobeAbandoned = false;
-                    // cout<<"publish: "<<publish.toc()<<endl;
-                    // printTrans("after mapping: ",transformTobeMapped);
-                    mappingTimeVec.push_back(mapping.toc());
-
-                    // ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart);
-                    if (goodToMergeMap)
+                }
+                float optPoseTime = optPose.toc();
+                if(debugMode)  cout<<"pose opt. takes "<< optPoseTime<<endl;
+                publishOdometry();
+                transformUpdate();
+                publishLocalMap();
+                
+                frameTobeAbandoned = false;
+                // printTrans("after mapping: ",transformTobeMapped);
+                mappingTimeVec.push_back(mapping.toc());
+
+                // ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart);
+                if (goodToMergeMap)
+                {
+                    ROLL_STAGE("mapping/merge");
+                    if (mapUpdateEnabled)
+                        mergeMap();
+                    // downsize temporary maps to slidingWindowSize
+                    auto iteratorKeyPoses3D = temporaryCloudKeyPoses3D->begin();
+                    auto iteratorKeyPoses6D = temporaryCloudKeyPoses6D->begin();
+                    auto iteratorKeyFramesC = temporaryCornerCloudKeyFrames.begin();
+                    auto iteratorKeyFramesS = temporarySurfCloudKeyFrames.begin();
+                    auto iteratorKeyFramesI = isIndoorKeyframeTMM.begin();
+                    // usually added cloud would not be big so just leave the sparsification to savingMap
+                    // ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart<< " sec, Merged map has "<<(int)temporaryCloudKeyPoses3D->size()<< " key poses");
+                    while ((int)temporaryCloudKeyPoses3D->size() > slidingWindowSize)
                     {
-                        if (mapUpdateEnabled)
-                            mergeMap();
-                        // downsize temporary maps to slidingWindowSize
-                        auto iteratorKeyPoses3D = temporaryCloudKeyPoses3D->begin();
-                        auto iteratorKeyPoses6D = temporaryCloudKeyPoses6D->begin();
-                        auto iteratorKeyFramesC = temporaryCornerCloudKeyFrames.begin();
-                        auto iteratorKeyFramesS = temporarySurfCloudKeyFrames.begin();
-                        auto iteratorKeyFramesI = isIndoorKeyframeTMM.begin();
-                        // usually added cloud would not be big so just leave the sparsification to savingMap
-                        // ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart<< " sec, Merged map has "<<(int)temporaryCloudKeyPoses3D->size()<< " key poses");
-                        while ((int)temporaryCloudKeyPoses3D->size() > slidingWindowSize)
-                        {
-                            // automatically +1
-                            temporaryCloudKeyPoses3D->erase(iteratorKeyPoses3D);
-                            temporaryCloudKeyPoses6D->erase(iteratorKeyPoses6D);
-                            temporaryCornerCloudKeyFrames.erase(iteratorKeyFramesC);
-                            temporarySurfCloudKeyFrames.erase(iteratorKeyFramesS);
-                            isIndoorKeyframeTMM.erase(iteratorKeyFramesI);
-                        }
-                        // cout<<temporaryCloudKeyPoses3D->size()<<endl;
-                        // cout<<"reindexing: key poses and key frames are corresponding with respect to the adding sequence"<<endl;
-                        for (int i = 0 ; i< (int)temporaryCloudKeyPoses3D->size(); i++)
-                        {
-                            temporaryCloudKeyPoses3D->points[i].intensity = i;
-                            temporaryCloudKeyPoses6D->points[i].intensity = i;
-                        }
-                        goodToMergeMap = false;
-                        temporaryMappingMode = false;
+                        // automatically +1
+                        temporaryCloudKeyPoses3D->erase(iteratorKeyPoses3D);
+                        temporaryCloudKeyPoses6D->erase(iteratorKeyPoses6D);
+                        temporaryCornerCloudKeyFrames.erase(iteratorKeyFramesC);
+                        temporarySurfCloudKeyFrames.erase(iteratorKeyFramesS);
+                        isIndoorKeyframeTMM.erase(iteratorKeyFramesI);
+                    }
+                    // cout<<temporaryCloudKeyPoses3D->size()<<endl;
+                    // cout<<"reindexing: key poses and key frames are corresponding with respect to the adding sequence"<<endl;
+                    for (int i = 0 ; i< (int)temporaryCloudKeyPoses3D->size(); i++)
+                    {
+                        temporaryCloudKeyPoses3D->points[i].intensity = i;
+                        temporaryCloudKeyPoses6D->points[i].intensity = i;
                     }
-                    if(debugMode)  cout<<"mapping time: "<<mappingTimeVec.back()<<endl;
-                    matchingRate.sleep();
+                    goodToMergeMap = false;
+                    temporaryMappingMode = false;
                 }
-
-             
-                
+                if(debugMode)  cout<<"mapping time: "<<mappingTimeVec.back()<<endl;
+                if(debugMode && keyframeMemoryBudget > 0 && mappingTimeVec.size() % 100 == 0)
+                    cout<<cornerCloudKeyFrames.stats()<<endl<<surfCloudKeyFrames.stats()<<endl;
+                if(debugMode && localizationMode && useTileMap && mappingTimeVec.size() % 100 == 0)
+                    cout<<localMapStats()<<endl;
             }
+            else
+                admission->droppedInPipeline(); // no pose before relocalization
+        }
+    }
+
+    // pipeline stage 3: local map clouds and paths, serialized off the mapping thread
+    void publishFrames()
+    {
+        TraceRecorder::instance().setThreadName("publish");
+        std::function<void()> job;
+        while (publishQueue.pop(job))
+        {
+            ROLL_STAGE("mapping/publish");
+            job();
+        }
+    }
 
+    // writes the trace of all threads; an empty fileName gives saveMapDirectory/roll_trace.json
+    bool dumpTraceService(roll::dump_traceRequest& req, roll::dump_traceResponse& res)
+    {
+        res.fileName = req.fileName.empty() ? saveMapDirectory + "/roll_trace.json" : req.fileName;
+        res.events = dumpTrace(res.fileName);
+        res.success = res.events >= 0;
+        return true;
+    }
 
+    long dumpTrace(const std::string& fileName)
+    {
+        if (!TraceRecorder::enabled())
+        {
+            ROS_WARN("Tracing is off, set roll/trace to record a timeline");
+            return -1;
         }
+        long events = TraceRecorder::instance().dump(fileName);
+        if (events < 0)
+            ROS_WARN("Cannot write trace to %s", fileName.c_str());
+        else
+            ROS_INFO("Trace of %ld events written to %s", events, fileName.c_str());
+        return events;
+    }
 
+    // lets the pipeline threads return after ros::spin
+    void stopPipeline()
+    {
+        admission->droppedInPipeline(frameQueue.close());
+        publishQueue.close();
     }
 
     void mergeMap()
@@ -812,6 +981,7 @@ public:
 
         std::vector<int> keyPoseSearchIdx;
         std::vector<float> keyPoseSearchDist;
+        vector<int64_t> dirtyTiles;
         for (int i = priorNode; i < tempSize; i++)
         {
             // change every loop
@@ -843,10 +1013,17 @@ public:
             if (keyPoseSearchDist[0] < 2*surroundingKeyframeDensity)
             {
                 // cout<<keyPoseSearchIdx[0]<<endl;
+                if (useTileMap)
+                {
+                    const PointType& erased = cloudKeyPoses3D->points[keyPoseSearchIdx[0]];
+                    for (int64_t key : tileMap.tilesAround(erased.x, erased.y, keyframeReach[keyPoseSearchIdx[0]]))
+                        dirtyTiles.push_back(key);
+                    keyframeReach.erase(keyframeReach.begin() + keyPoseSearchIdx[0]);
+                }
                 cloudKeyPoses3D->erase(cloudKeyPoses3D->begin() + keyPoseSearchIdx[0]);
                 cloudKeyPoses6D->erase(cloudKeyPoses6D->begin() + keyPoseSearchIdx[0]);
-                cornerCloudKeyFrames.erase(cornerCloudKeyFrames.begin() + keyPoseSearchIdx[0]);
-                surfCloudKeyFrames.erase(surfCloudKeyFrames.begin() + keyPoseSearchIdx[0]);
+                cornerCloudKeyFrames.erase(keyPoseSearchIdx[0]);
+                surfCloudKeyFrames.erase(keyPoseSearchIdx[0]);
                 isIndoorKeyframe.erase(isIndoorKeyframe.begin() + keyPoseSearchIdx[0]);
             }
             mtx.unlock();
@@ -863,28 +1040,45 @@ public:
 
 
 
-        for (int i = priorNode; i < tempSize; i++)
         {
-            cloudKeyPoses3D->push_back(temporaryCloudKeyPoses3D->points[i]); // no "points." in between!!!
-            cloudKeyPoses6D->push_back(temporaryCloudKeyPoses6D->points[i]);
-            cornerCloudKeyFrames.push_back(temporaryCornerCloudKeyFrames[i]);
-            surfCloudKeyFrames.push_back(temporarySurfCloudKeyFrames[i]); 
-            isIndoorKeyframe.push_back(isIndoorKeyframeTMM[i]);
-        }
-        cout<<"map merge takes "<<t_merge.toc()<< " ms"<<endl; // negligible
+            // the append, reindexing and tile index change together for takeMapSnapshot
+            std::lock_guard<TracedMutex> lock(mtx);
+            for (int i = priorNode; i < tempSize; i++)
+            {
+                cloudKeyPoses3D->push_back(temporaryCloudKeyPoses3D->points[i]); // no "points." in between!!!
+                cloudKeyPoses6D->push_back(temporaryCloudKeyPoses6D->points[i]);
+                cornerCloudKeyFrames.push_back(temporaryCornerCloudKeyFrames[i]);
+                surfCloudKeyFrames.push_back(temporarySurfCloudKeyFrames[i]); 
+                isIndoorKeyframe.push_back(isIndoorKeyframeTMM[i]);
+                if (useTileMap)
+                {
+                    float reach = max(temporaryCornerCloudKeyFrames[i]->range(), temporarySurfCloudKeyFrames[i]->range());
+                    keyframeReach.push_back(reach);
+                    for (int64_t key : tileMap.tilesAround(temporaryCloudKeyPoses3D->points[i].x, temporaryCloudKeyPoses3D->points[i].y, reach))
+                        dirtyTiles.push_back(key);
+                }
+            }
+            // reindexing due to the erasing operation
+            for (int i = 0; i < (int) cloudKeyPoses3D->size(); i++)
+            {
+                cloudKeyPoses3D->points[i].intensity = i;
+                cloudKeyPoses6D->points[i].intensity = i;
+            }
 
-        // reindexing due to the erasing operation
-        for (int i = 0; i < (int) cloudKeyPoses3D->size(); i++)
-        {
-            cloudKeyPoses3D->points[i].intensity = i;
-            cloudKeyPoses6D->points[i].intensity = i;
+            // tiles under the merged keyframes are rebuilt on next use
+            if (useTileMap)
+            {
+                tileMap.setIndex(*cloudKeyPoses3D, keyframeReach);
+                tileMap.invalidate(dirtyTiles);
+            }
         }
+        cout<<"map merge takes "<<t_merge.toc()<< " ms"<<endl; // negligible
 
     }
 
-    void updatePathRELOC(const roll::cloud_infoConstPtr& msgIn){
+    void updatePathRELOC(const ros::Time& stamp){
         geometry_msgs::PoseStamped pose_stamped;
-        pose_stamped.header.stamp = msgIn->header.stamp;
+        pose_stamped.header.stamp = stamp;
         pose_stamped.header.frame_id = mapFrame;
         pose_stamped.pose.position.x = transformTobeMapped[3];
         pose_stamped.pose.position.y = transformTobeMapped[4];
@@ -983,23 +1177,20 @@ public:
 
     pcl::PointCloud<PointType>::Ptr transformPointCloud(pcl::PointCloud<PointType>::Ptr cloudIn, PointTypePose* transformIn)
     {
-        pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
+        Eigen::Affine3f transCur = pcl::getTransformation(transformIn->x, transformIn->y, transformIn->z, transformIn->roll, transformIn->pitch, transformIn->yaw);
+        return ::transformPointCloud(*cloudIn, transCur);
+    }
 
-        int cloudSize = cloudIn->size();
-        cloudOut->resize(cloudSize);
+    pcl::PointCloud<PointType>::Ptr transformPointCloud(CompactCloud::Ptr cloudIn, PointTypePose* transformIn)
+    {
+        return keyframeToMap(*cloudIn, *transformIn);
+    }
 
-        Eigen::Affine3f transCur = pcl::getTransformation(transformIn->x, transformIn->y, transformIn->z, transformIn->roll, transformIn->pitch, transformIn->yaw);
-        
-        // #pragma omp parallel for num_threads(numberOfCores)
-        for (int i = 0; i < cloudSize; ++i)
-        {
-            const auto &pointFrom = cloudIn->points[i];
-            cloudOut->points[i].x = transCur(0,0) * pointFrom.x + transCur(0,1) * pointFrom.y + transCur(0,2) * pointFrom.z + transCur(0,3);
-            cloudOut->points[i].y = transCur(1,0) * pointFrom.x + transCur(1,1) * pointFrom.y + transCur(1,2) * pointFrom.z + transCur(1,3);
-            cloudOut->points[i].z = transCur(2,0) * pointFrom.x + transCur(2,1) * pointFrom.y + transCur(2,2) * pointFrom.z + transCur(2,3);
-            cloudOut->points[i].intensity = pointFrom.intensity;
-        }
-        return cloudOut;
+    bool saveKeyframeCloud(const string& fileName, const CompactCloud& cloud)
+    {
+        if (keyframeFileFormat == "compact")
+            return cloud.save(fileName + ".ckf");
+        return pcl::io::savePCDFileBinary(fileName + ".pcd", *cloud.toCloud()) == 0;
     }
 
     gtsam::Pose3 pclPointTogtsamPose3(PointTypePose thisPoint)
@@ -1016,7 +1207,7 @@ public:
 
     Eigen::Affine3f pclPointToAffine3f(PointTypePose thisPoint)
     { 
-        return pcl::getTransformation(thisPoint.x, thisPoint.y, thisPoint.z, thisPoint.roll, thisPoint.pitch, thisPoint.yaw);
+        return poseToAffine3f(thisPoint);
     }
 
     gtsam::Pose3 Affine3f2gtsamPose(Eigen::Affine3f aff){
@@ -1039,139 +1230,153 @@ public:
 
     
     bool saveMapService(roll::save_mapRequest& req, roll::save_mapResponse& res)
-    {        
-        float resMap,resPoseIndoor,resPoseOutdoor,overlapThre;
-        
-        if(req.resolutionMap != 0)            resMap = req.resolutionMap;
-        else         resMap = 0.4;
+    {
+        std::shared_ptr<SaveMapJob> job;
+        {
+            std::lock_guard<std::mutex> lock(mtxSaveJob);
+            if (saveMapJob && !saveMapJob->done)
+            {
+                ROS_WARN("Map saving job %d is still running, request ignored", saveMapJob->id);
+                res.jobId = saveMapJob->id;
+                res.success = false;
+                return true;
+            }
+            job = std::make_shared<SaveMapJob>();
+            job->id = ++saveMapJobCount;
+            saveMapJob = job;
+        }
+
+        if(req.resolutionMap != 0)            job->resMap = req.resolutionMap;
+        else         job->resMap = 0.4;
 
-        if(req.resPoseIndoor != 0)            resPoseIndoor = req.resPoseIndoor;
-        else         resPoseIndoor = 2.0;
+        if(req.resPoseIndoor != 0)            job->resPoseIndoor = req.resPoseIndoor;
+        else         job->resPoseIndoor = 2.0;
 
-        if(req.resPoseOutdoor != 0)            resPoseOutdoor = req.resPoseOutdoor;
-        else         resPoseOutdoor = 5.0;
+        if(req.resPoseOutdoor != 0)            job->resPoseOutdoor = req.resPoseOutdoor;
+        else         job->resPoseOutdoor = 5.0;
 
-        if(req.overlapThre != 0)            overlapThre = req.overlapThre;
-        else         overlapThre = 0.9;
+        if(req.overlapThre != 0)            job->overlapThre = req.overlapThre;
+        else         job->overlapThre = 0.9;
 
         float mappingTime = accumulate(mappingTimeVec.begin(),mappingTimeVec.end(),0.0);
         cout<<"Average time consumed by mapping is :"<<mappingTime/mappingTimeVec.size()<<" ms"<<endl;
         if (localizationMode) cout<<"Times of entering TMM is :"<<TMMcount<<endl;
+        cout<<cornerCloudKeyFrames.stats()<<endl<<surfCloudKeyFrames.stats()<<endl;
+        if (registrationTimeBudget > 0)
+            cout<<"Registration budget "<<registrationTimeBudget<<" ms: limited in "<<budgetLimitedFrames<<", missed in "
+                <<deadlineMisses<<" of "<<registrationFrames<<" frames"<<endl;
+        if (localizationMode && useTileMap) cout<<tileMap.stats()<<endl<<localMapStats()<<endl;
+        cout<<admission->stats()<<endl;
+
+        // only the snapshot is taken here, writing is left to the background job so mapping is not stalled
+        TicToc snapshotTime;
+        std::shared_ptr<MapSnapshot> snapshot = std::make_shared<MapSnapshot>();
+        takeMapSnapshot(*snapshot);
+        ROS_INFO("Map saving job %d: snapshot of %d keyframes taken in %.3f ms", job->id, (int)snapshot->keyPoses3D->size(), snapshotTime.toc());
+
+        job->result = std::async(std::launch::async, &mapOptimization::saveMapWorker, this, job, snapshot).share();
+
+        res.jobId = job->id;
+        res.success = true;
+        if (req.blocking)
+            res.success = job->result.get();
+        return true;
+    }
+
+    bool saveMapStatusService(roll::save_map_statusRequest& req, roll::save_map_statusResponse& res)
+    {
+        std::lock_guard<std::mutex> lock(mtxSaveJob);
+        res.found = saveMapJob && (req.jobId == 0 || req.jobId == saveMapJob->id);
+        if (!res.found)
+            return true;
+        res.jobId = saveMapJob->id;
+        res.done = saveMapJob->done;
+        res.success = saveMapJob->success;
+        res.stage = saveMapJob->getStage();
+        res.processed = saveMapJob->processed;
+        res.total = saveMapJob->total;
+        return true;
+    }
+
+    void takeMapSnapshot(MapSnapshot& snapshot)
+    {
+        snapshot.keyPoses3D.reset(new pcl::PointCloud<PointType>());
+        snapshot.keyPoses6D.reset(new pcl::PointCloud<PointTypePose>());
+
+        std::lock_guard<TracedMutex> lock(mtx);
+        *snapshot.keyPoses3D = *cloudKeyPoses3D;
+        *snapshot.keyPoses6D = *cloudKeyPoses6D;
+        snapshot.cornerKeyFrames = cornerCloudKeyFrames.view();
+        snapshot.surfKeyFrames = surfCloudKeyFrames.view();
+        snapshot.isIndoor = isIndoorKeyframe;
+        if (!savePose)
+            return;
+        snapshot.pathMapping.reserve(globalOdometry.size());
+        for (const auto& odom : globalOdometry)
+            snapshot.pathMapping.push_back(stampedPoseToArray(odom.header.stamp.toSec(), odom.pose.pose));
+        snapshot.pathFusion.reserve(globalPathFusion.poses.size());
+        for (const auto& pose : globalPathFusion.poses)
+            snapshot.pathFusion.push_back(stampedPoseToArray(pose.header.stamp.toSec(), pose.pose));
+        snapshot.pathFusionVINS.reserve(globalPathFusionVINS.poses.size());
+        for (const auto& pose : globalPathFusionVINS.poses)
+            snapshot.pathFusionVINS.push_back(stampedPoseToArray(pose.header.stamp.toSec(), pose.pose));
+    }
+
+    array<double, 8> stampedPoseToArray(double t, const geometry_msgs::Pose& pose)
+    {
+        return {t, pose.position.x, pose.position.y, pose.position.z,
+                pose.orientation.x, pose.orientation.y, pose.orientation.z, pose.orientation.w};
+    }
+
+    void saveTrajectory(const string& fileName, const vector<array<double, 8>>& path)
+    {
+        ofstream pose_file;
+        pose_file.open(fileName,ios::out);
+        pose_file.setf(ios::fixed, ios::floatfield);  // 设定为 fixed 模式，以小数点表示浮点数
+        pose_file.precision(6); // 固定小数位6
+        for (const auto& pose : path)
+        {
+            double r,p,y;
+            tf::Quaternion q(pose[4], pose[5], pose[6], pose[7]);
+            tf::Matrix3x3(q).getRPY(r,p,y);
+            // save it in micro sec to compare it with the nclt gt
+            pose_file<<pose[0]*1e+6<<" "<<pose[1]<<" "<<pose[2]<<" "<<pose[3]<<" "<<r<<" "<<p<<" "<<y<<" "<<"\n";
+        }
+        pose_file.close();
+    }
+
+    void reportSaveProgress(SaveMapJob& job, int processed)
+    {
+        job.processed = processed;
+        int total = job.total;
+        int step = max(total / 10, 1);
+        if (processed % step == 0 || processed == total)
+            ROS_INFO("Map saving job %d: %s %d/%d", job.id, job.getStage().c_str(), processed, total);
+    }
+
+    // runs on its own thread and only touches the snapshot, so mapping keeps going meanwhile
+    bool saveMapWorker(std::shared_ptr<SaveMapJob> job, std::shared_ptr<MapSnapshot> snapshot)
+    {
+        TicToc saveTime;
+        bool success = true;
+        const MapSnapshot& snap = *snapshot;
+        float resMap = job->resMap;
 
         // saving pose estimates and GPS signals
         if (savePose)
         {
-            // ofstream pose_file;
+            job->setStage("trajectory");
             cout<<"Recording trajectory..."<<endl;
-            // string fileName = saveMapDirectory+"/pose_fusion_kitti.txt";
-            // pose_file.open(fileName,ios::out);
-            // pose_file.setf(std::ios::scientific, std::ios::floatfield);
-            // pose_file.precision(6);
-            // if(!pose_file.is_open())
-            // {
-            //     cout<<"Cannot open "<<fileName<<endl;
-            //     return false;
-            // }
-            // // keyposes: kitti form (z forward x right y downward)
-            // cout<<"Number of poses: "<<pose_kitti_vec.size()<<endl;
-            // for (int i = 0; i <(int)pose_kitti_vec.size(); ++i)
-            // {
-            //     Eigen::Affine3f pose_kitti = pose_kitti_vec[i];
-            //     pose_file<<pose_kitti(0,0)<<" "<<pose_kitti(0,1)<<" "<<pose_kitti(0,2)<<" "<<pose_kitti(0,3)<<" "
-            //         <<pose_kitti(1,0)<<" "<<pose_kitti(1,1)<<" "<<pose_kitti(1,2)<<" "<<pose_kitti(1,3)<<" "
-            //         <<pose_kitti(2,0)<<" "<<pose_kitti(2,1)<<" "<<pose_kitti(2,2)<<" "<<pose_kitti(2,3)<<"\n";
-
-            // }
-            // pose_file.close();
-
-
-            // // 2nd: keyposes
-            // int pointN = (int)globalPath.poses.size();
-            // cout<< "There are "<<pointN<<" keyframes in total"<<endl;
-            // for (int i = 0; i < pointN; ++i)
-            // {
-            //     geometry_msgs::PoseStamped tmp = globalPath.poses[i];
-            //     pose_file<<tmp.pose.position.x<<" "<<tmp.pose.position.y<<" "<<tmp.pose.position.z<<"\n";
-            // }
-            // // 3rd: odometry msgs
-            // int pointN = (int)globalOdometry.size();
-            // cout<< "There are "<<pointN<<" in total"<<endl;
-            // for (int i = 0; i < pointN; ++i)
-            // {
-            //     nav_msgs::Odometry tmp = globalOdometry[i];
-            //     pose_file<<tmp.pose.pose.position.x<<" "<<tmp.pose.pose.position.y<<"\n";
-            // }
-            // pose_file.close();
-
-            // 4th: stamped pose for odometry gt
-            mtx.lock();
-            ofstream pose_file2;
-            string fileName2 = saveMapDirectory+"/path_mapping.txt";
-            pose_file2.open(fileName2,ios::out);
-            pose_file2.setf(ios::fixed, ios::floatfield);  // 设定为 fixed 模式，以小数点表示浮点数
-            pose_file2.precision(6); // 固定小数位6
-            int pointN = (int)globalOdometry.size();
-            cout<<"mapping pose size: "<<pointN<<endl;
-            for (int i = 0; i < pointN; ++i)
-            {
-                nav_msgs::Odometry tmp = globalOdometry[i];
-                double r,p,y;
-                tf::Quaternion q(tmp.pose.pose.orientation.x,tmp.pose.pose.orientation.y, tmp.pose.pose.orientation.z,tmp.pose.pose.orientation.w);
-                tf::Matrix3x3(q).getRPY(r,p,y);
-                // save it in micro sec to compare it with the nclt gt
-                pose_file2<<tmp.header.stamp.toSec()*1e+6<<" "<<tmp.pose.pose.position.x<<" "<<tmp.pose.pose.position.y<<" "<<
-                tmp.pose.pose.position.z<<" "<<r<<" "<<p<<" "<<y<<" "<<"\n";
-            }
-            pose_file2.close();
-            mtx.unlock();
-
-            mtx.lock();
+            cout<<"mapping pose size: "<<snap.pathMapping.size()<<endl;
+            saveTrajectory(saveMapDirectory+"/path_mapping.txt", snap.pathMapping);
             // higher frequency odometry
-            ofstream pose_file3;
-            string fileName3 = saveMapDirectory+"/path_fusion.txt";
-            pose_file3.open(fileName3,ios::out);
-            pose_file3.setf(ios::fixed, ios::floatfield);  // 设定为 fixed 模式，以小数点表示浮点数
-            pose_file3.precision(6); // 固定小数位6
-            int pointN3 = (int)globalPathFusion.poses.size();
-            cout<<"fusion pose size: "<<pointN3<<endl;
-            for (int i = 0; i < pointN3; ++i)
-            {
-                geometry_msgs::PoseStamped tmp = globalPathFusion.poses[i];
-                double r,p,y;
-                tf::Quaternion q(tmp.pose.orientation.x,tmp.pose.orientation.y, tmp.pose.orientation.z,tmp.pose.orientation.w);
-                tf::Matrix3x3(q).getRPY(r,p,y);
-                // save it in nano sec to compare it with the nclt gt
-                pose_file3<<tmp.header.stamp.toSec()*1e+6<<" "<<tmp.pose.position.x<<" "<<tmp.pose.position.y<<" "<<
-                tmp.pose.position.z<<" "<<r<<" "<<p<<" "<<y<<" "<<"\n";
-            }
-            pose_file3.close();
-            mtx.unlock();
-
-            mtx.lock();
-            // higher frequency odometry
-            ofstream pose_file4;
-            string fileName4 = saveMapDirectory+"/path_vinsfusion.txt";
-            pose_file4.open(fileName4,ios::out);
-            pose_file4.setf(ios::fixed, ios::floatfield);  // 设定为 fixed 模式，以小数点表示浮点数
-            pose_file4.precision(6); // 固定小数位6
-            int pointN4 = (int)globalPathFusionVINS.poses.size();
-            cout<<"vinsfusion pose size: "<<pointN4<<endl;
-            for (int i = 0; i < pointN4; ++i)
-            {
-                geometry_msgs::PoseStamped tmp = globalPathFusionVINS.poses[i];
-                double r,p,y;
-                tf::Quaternion q(tmp.pose.orientation.x,tmp.pose.orientation.y, tmp.pose.orientation.z,tmp.pose.orientation.w);
-                tf::Matrix3x3(q).getRPY(r,p,y);
-                // save it in nano sec to compare it with the nclt gt
-                pose_file4<<tmp.header.stamp.toSec()*1e+6<<" "<<tmp.pose.position.x<<" "<<tmp.pose.position.y<<" "<<
-                tmp.pose.position.z<<" "<<r<<" "<<p<<" "<<y<<" "<<"\n";
-            }
-            pose_file4.close();
+            cout<<"fusion pose size: "<<snap.pathFusion.size()<<endl;
+            saveTrajectory(saveMapDirectory+"/path_fusion.txt", snap.pathFusion);
+            cout<<"vinsfusion pose size: "<<snap.pathFusionVINS.size()<<endl;
+            saveTrajectory(saveMapDirectory+"/path_vinsfusion.txt", snap.pathFusionVINS);
             cout<<"Trajectory recording finished!"<<endl;
-            mtx.unlock();
         }
 
-
         // save keyframe map: for every keyframe, save keyframe pose, edge point pcd, surface point pcd
         // keyframe pose in one file
         // every keyframe has two other files: cornerI.pcd surfI.pcd
@@ -1183,46 +1388,16 @@ public:
             cout << "Save destination: " << saveMapDirectory << endl;
 
             // save key frame transformations
-            pcl::io::savePCDFileBinary(saveMapDirectory + "/trajectory.pcd", *cloudKeyPoses3D);
-            pcl::io::savePCDFileBinary(saveMapDirectory + "/transformations.pcd", *cloudKeyPoses6D);
-            // extract global point cloud map
-            pcl::PointCloud<PointType>::Ptr globalCornerCloud(new pcl::PointCloud<PointType>());
-            pcl::PointCloud<PointType>::Ptr globalCornerCloudDS(new pcl::PointCloud<PointType>());
-            pcl::PointCloud<PointType>::Ptr globalSurfCloud(new pcl::PointCloud<PointType>());
-            pcl::PointCloud<PointType>::Ptr globalSurfCloudDS(new pcl::PointCloud<PointType>());
-            pcl::PointCloud<PointType>::Ptr globalMapCloud(new pcl::PointCloud<PointType>());
-            for (int i = 0; i < (int)cloudKeyPoses3D->size(); i++) {
-                int idx = cloudKeyPoses3D->points[i].intensity;
-                *globalCornerCloud += *transformPointCloud(cornerCloudKeyFrames[idx],  &cloudKeyPoses6D->points[idx]);
-                *globalSurfCloud   += *transformPointCloud(surfCloudKeyFrames[idx],    &cloudKeyPoses6D->points[idx]);
-                // cout << "\r" << std::flush << "Processing feature cloud " << i << " of " << cloudKeyPoses6D->size() << " ...\n";
-            }
-
+            pcl::io::savePCDFileBinary(saveMapDirectory + "/trajectory.pcd", *snap.keyPoses3D);
+            pcl::io::savePCDFileBinary(saveMapDirectory + "/transformations.pcd", *snap.keyPoses6D);
             cout << "\n\nSave resolution: " << resMap << endl;
-
-            // down-sample and save corner cloud
-            downSizeFilterCorner.setInputCloud(globalCornerCloud);
-            downSizeFilterCorner.setLeafSize(resMap, resMap, resMap);
-            downSizeFilterCorner.filter(*globalCornerCloudDS);
-            pcl::io::savePCDFileBinary(saveMapDirectory + "/CornerMap.pcd", *globalCornerCloudDS);
-            // down-sample and save surf cloud
-            downSizeFilterSurf.setInputCloud(globalSurfCloud);
-            downSizeFilterSurf.setLeafSize(resMap, resMap, resMap);
-            downSizeFilterSurf.filter(*globalSurfCloudDS);
-            pcl::io::savePCDFileBinary(saveMapDirectory + "/SurfMap.pcd", *globalSurfCloudDS);
-
-            // save global point cloud map
-            *globalMapCloud += *globalCornerCloud;
-            *globalMapCloud += *globalSurfCloud;
-
-            int ret = pcl::io::savePCDFileBinary(saveMapDirectory + "/GlobalMap.pcd", *globalMapCloud);
-            res.success = ret == 0;
+            success = exportGlobalMap(snap, *job, resMap) && success;
 
             cout << "Saving map to pcd files completed\n" << endl;
         }
         
         if(saveKeyframeMap){ 
-            int keyframeN = (int)cloudKeyPoses6D->size();
+            int keyframeN = (int)snap.keyPoses6D->size();
 
             cout<<"Map Saving to "+saveKeyframeMapDirectory<<endl;
             cout<<"There are "<<keyframeN<<" keyframes before downsampling"<<endl;
@@ -1230,9 +1405,8 @@ public:
             cout<<"********************Saving keyframes and poses one by one**************************"<<endl;
             pcl::PointCloud<PointType>::Ptr cloudKeyPoses3DDS(new pcl::PointCloud<PointType>());
 
-            
-            keyframeSparsification(cloudKeyPoses3DDS,resMap,resPoseIndoor,resPoseOutdoor,overlapThre);
-            // keyframeSparsification(cloudKeyPoses3DDS,resMap,resPoseIndoor,resPoseOutdoor);
+            job->setStage("keyframe sparsification");
+            keyframeSparsification(snap, *job, cloudKeyPoses3DDS,resMap,job->resPoseIndoor,job->resPoseOutdoor,job->overlapThre);
 
             int keyframeNDS = cloudKeyPoses3DDS->size();
             cout<<"There are "<<keyframeNDS<<" keyframes after downsampling"<<endl;
@@ -1241,62 +1415,149 @@ public:
             if(!pose_file.is_open())
             {
                 std::cout<<"Cannot open"<<saveKeyframeMapDirectory+"/poses.txt"<<std::endl;
+                job->success = false;
+                job->done = true;
                 return false;
             }
             std::vector<int> keyframeSearchIdx;
             std::vector<float> keyframeSearchDist;
             pcl::KdTreeFLANN<PointType>::Ptr kdtreeKeyframes(new pcl::KdTreeFLANN<PointType>());
-            kdtreeKeyframes->setInputCloud(cloudKeyPoses3D);
+            kdtreeKeyframes->setInputCloud(snap.keyPoses3D);
             int i = 0;
-            
+
+            job->setStage("writing keyframes");
+            job->total = keyframeNDS;
             // recover downsampled intensities
             for(auto& pt:cloudKeyPoses3DDS->points)
             {                
                 kdtreeKeyframes->nearestKSearch(pt,1,keyframeSearchIdx,keyframeSearchDist); 
-                pt.intensity = cloudKeyPoses6D->points[keyframeSearchIdx[0]].intensity;  
-                pcl::io::savePCDFileBinary(saveKeyframeMapDirectory + "/corner" + std::to_string(i)+".pcd", *cornerCloudKeyFrames[pt.intensity]);
-                pcl::io::savePCDFileBinary(saveKeyframeMapDirectory + "/surf" + std::to_string(i)+".pcd", *surfCloudKeyFrames[pt.intensity]);
-                pose_file<<cloudKeyPoses6D->points[pt.intensity].x<<" "<<cloudKeyPoses6D->points[pt.intensity].y<<" "<<cloudKeyPoses6D->points[pt.intensity].z
-                <<" "<<cloudKeyPoses6D->points[pt.intensity].roll<<" "<<cloudKeyPoses6D->points[pt.intensity].pitch<<" "<<cloudKeyPoses6D->points[pt.intensity].yaw
-                << " " << i<<" "<<isIndoorKeyframe[pt.intensity]<<"\n";
+                pt.intensity = snap.keyPoses6D->points[keyframeSearchIdx[0]].intensity;  
+                const PointTypePose& pose = snap.keyPoses6D->points[pt.intensity];
+                saveKeyframeCloud(saveKeyframeMapDirectory + "/corner" + std::to_string(i), *snap.cornerKeyFrames[pt.intensity]);
+                saveKeyframeCloud(saveKeyframeMapDirectory + "/surf" + std::to_string(i), *snap.surfKeyFrames[pt.intensity]);
+                pose_file<<pose.x<<" "<<pose.y<<" "<<pose.z<<" "<<pose.roll<<" "<<pose.pitch<<" "<<pose.yaw
+                << " " << i<<" "<<snap.isIndoor[pt.intensity]<<"\n";
                 i++;
-                if((i+1)%100 == 0) cout<<i<<" keyframes saved!"<<endl;
+                reportSaveProgress(*job, i);
             }
             pose_file.close();
             cout<<"Keyframes Saving Finished!"<<endl;
 
         }
-        res.success = true;
+        job->setStage("finished");
+        ROS_INFO("Map saving job %d finished in %.1f sec", job->id, saveTime.toc()/1000);
+        job->success = success;
+        job->done = true;
         doneSavingMap = true;
-        return true;
+        return success;
+    }
+
+    // streams GlobalMap/CornerMap/SurfMap to disk batch by batch instead of concatenating the whole map first
+    bool exportGlobalMap(const MapSnapshot& snap, SaveMapJob& job, float resMap)
+    {
+        TicToc exportTime;
+        int keyframeN = snap.keyPoses3D->size();
+
+        // a tile can be written once the last keyframe reaching it is in, keyframes reach at most their farthest point
+        vector<float> keyframeRange(keyframeN, 0);
+        #pragma omp parallel for num_threads(numberOfCores)
+        for (int i = 0; i < keyframeN; i++)
+        {
+            int idx = snap.keyPoses3D->points[i].intensity;
+            keyframeRange[i] = max(snap.cornerKeyFrames[idx]->range(), snap.surfKeyFrames[idx]->range());
+        }
+
+        string tileDirectory;
+        if (exportTiledPCD)
+        {
+            tileDirectory = saveMapDirectory + "/tiles";
+            int unused = system((std::string("mkdir -p ") + tileDirectory).c_str());
+            (void)unused;
+        }
+        TiledVoxelAccumulator cornerMap(resMap, exportTileSize, saveMapDirectory + "/CornerMap.pcd", tileDirectory, "corner_");
+        TiledVoxelAccumulator surfMap(resMap, exportTileSize, saveMapDirectory + "/SurfMap.pcd", tileDirectory, "surf_");
+        PCDStreamWriter globalMap;
+        bool ok = globalMap.open(saveMapDirectory + "/GlobalMap.pcd");
+
+        std::unordered_map<int64_t, int> tileLastKeyframe;
+        for (int i = 0; i < keyframeN; i++)
+        {
+            const PointType& pose = snap.keyPoses3D->points[i];
+            float r = keyframeRange[i];
+            int64_t x0 = cornerMap.tileIndexAt(pose.x - r), x1 = cornerMap.tileIndexAt(pose.x + r);
+            int64_t y0 = cornerMap.tileIndexAt(pose.y - r), y1 = cornerMap.tileIndexAt(pose.y + r);
+            for (int64_t tx = x0; tx <= x1; tx++)
+                for (int64_t ty = y0; ty <= y1; ty++)
+                    tileLastKeyframe[voxelKey(tx, ty, 0)] = i;
+        }
+        vector<vector<int64_t>> tilesToRelease(keyframeN);
+        for (const auto& t : tileLastKeyframe)
+            tilesToRelease[t.second].push_back(t.first);
+
+        job.setStage("exporting global map");
+        job.total = keyframeN;
+        int batchSize = max(exportBatchSize, 1);
+        vector<pcl::PointCloud<PointType>::Ptr> cornerBatch(batchSize), surfBatch(batchSize);
+        for (int b = 0; b < keyframeN; b += batchSize)
+        {
+            int n = min(batchSize, keyframeN - b);
+            #pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
+            for (int k = 0; k < n; k++)
+            {
+                int idx = snap.keyPoses3D->points[b + k].intensity;
+                cornerBatch[k] = transformPointCloud(snap.cornerKeyFrames[idx],  &snap.keyPoses6D->points[idx]);
+                surfBatch[k]   = transformPointCloud(snap.surfKeyFrames[idx],    &snap.keyPoses6D->points[idx]);
+            }
+            for (int k = 0; k < n; k++)
+            {
+                cornerMap.add(*cornerBatch[k]);
+                surfMap.add(*surfBatch[k]);
+                globalMap.write(*cornerBatch[k]);
+                globalMap.write(*surfBatch[k]);
+                cornerBatch[k].reset();
+                surfBatch[k].reset();
+                for (int64_t t : tilesToRelease[b + k])
+                {
+                    cornerMap.release(t);
+                    surfMap.release(t);
+                }
+                reportSaveProgress(job, b + k + 1);
+            }
+        }
+        ok = cornerMap.releaseAll() && ok;
+        ok = surfMap.releaseAll() && ok;
+        ok = globalMap.close() && ok;
+
+        cout<<"global map: "<<globalMap.size()<<" points, corner map: "<<cornerMap.size()<<" voxels, surf map: "<<surfMap.size()<<" voxels"<<endl;
+        cout<<"peak resident voxels: "<<cornerMap.peakResidentVoxels() + surfMap.peakResidentVoxels()<<", tiles written: "<<cornerMap.tilesWritten()<<endl;
+        cout<<"exporting takes "<<exportTime.toc()/1000<<" sec "<<endl;
+        return ok;
     }
 
    
-    void keyframeSparsification(pcl::PointCloud<PointType>::Ptr  &cloudKeyPoses3DDS, float resMap, float resPoseIndoor, float resPoseOutdoor,
-                                float overlapThre)
+    void keyframeSparsification(const MapSnapshot& snap, SaveMapJob& job, pcl::PointCloud<PointType>::Ptr  &cloudKeyPoses3DDS, float resMap,
+                                float resPoseIndoor, float resPoseOutdoor, float overlapThre)
     {
 
         TicToc sparsiTime;
         pcl::PointCloud<PointType>::Ptr  cloudKeyPoses3DDSinit(new pcl::PointCloud<PointType>());
 
-        pcl::KdTreeFLANN<PointType>::Ptr kdtreeGlobalKeyPoses(new pcl::KdTreeFLANN<PointType>());
-        kdtreeGlobalKeyPoses->setInputCloud(cloudKeyPoses3D);
+        CloudKdTree::Ptr kdtreeGlobalKeyPoses(new CloudKdTree());
+        kdtreeGlobalKeyPoses->setInputCloud(snap.keyPoses3D);
 
         // separate indoor or outdoor, sparsify crudely
         pcl::PointCloud<PointType>::Ptr keyPosesIndoor(new pcl::PointCloud<PointType>());
         pcl::PointCloud<PointType>::Ptr keyPosesOutdoor(new pcl::PointCloud<PointType>());
         pcl::PointCloud<PointType>::Ptr keyPosesIndoorDS(new pcl::PointCloud<PointType>());
         pcl::PointCloud<PointType>::Ptr keyPosesOutdoorDS(new pcl::PointCloud<PointType>());
-        for (int i = 0; i < (int)cloudKeyPoses3D->points.size();i++)
+        for (int i = 0; i < (int)snap.keyPoses3D->points.size();i++)
         {
-            if (isIndoorKeyframe[cloudKeyPoses3D->points[i].intensity] == 1) 
-                keyPosesIndoor->push_back(cloudKeyPoses3D->points[i]);
+            if (snap.isIndoor[snap.keyPoses3D->points[i].intensity] == 1) 
+                keyPosesIndoor->push_back(snap.keyPoses3D->points[i]);
             else 
-                keyPosesOutdoor->push_back(cloudKeyPoses3D->points[i]);
+                keyPosesOutdoor->push_back(snap.keyPoses3D->points[i]);
         }
 
-        std::vector<int> pointSearchIndGlobalMap;
-        std::vector<float> pointSearchSqDisGlobalMap;      
         pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyPosesI;
 
         //indoor
@@ -1308,8 +1569,7 @@ public:
         // fix the keyframe downsample bug, keep intensity as an index of adding sequence
         for(auto& pt : keyPosesIndoorDS->points)
         {
-            kdtreeGlobalKeyPoses->nearestKSearch(pt, 1, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap);
-            pt.intensity = cloudKeyPoses3D->points[pointSearchIndGlobalMap[0]].intensity;
+            pt.intensity = snap.keyPoses3D->points[knn<1>(*kdtreeGlobalKeyPoses, pt).indices[0]].intensity;
             cloudKeyPoses3DDSinit->push_back(pt);
         }
         cout<<"indoor: "<<keyPosesIndoorDS->size()<<" frames" <<endl;
@@ -1320,90 +1580,145 @@ public:
         // fix the keyframe downsample bug
         for(auto& pt : keyPosesOutdoorDS->points)
         {
-            kdtreeGlobalKeyPoses->nearestKSearch(pt, 1, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap);
-            pt.intensity = cloudKeyPoses3D->points[pointSearchIndGlobalMap[0]].intensity;
+            pt.intensity = snap.keyPoses3D->points[knn<1>(*kdtreeGlobalKeyPoses, pt).indices[0]].intensity;
             cloudKeyPoses3DDSinit->push_back(pt);
         }
          cout<<"outdoor: "<<keyPosesOutdoorDS->size()<<" frames" <<endl;
 
         //starting from small indexes, add frames with overlap less than miu (with no consideration of scene changes!)
         float searchR = 30.0;
-        //init chosen key poses
-        cloudKeyPoses3DDS->push_back(cloudKeyPoses3DDSinit->points[0]);
-        for(int i = 1; i < (int)cloudKeyPoses3DDSinit->size(); i++)
+        int candidateN = cloudKeyPoses3DDSinit->size();
+        job.total = candidateN;
+
+        // selected key poses in a grid of searchR cells, so nearby ones come from the 27 neighbouring cells
+        float invSearchR = 1.0 / searchR;
+        std::unordered_map<int64_t, vector<int>> selectedGrid;
+        // points of the selected keyframes in voxels of the overlap distance (the test is on squared distance, resMap),
+        // so the nearest neighbour closer than that is always in one of the 27 voxels around a point
+        float invLeaf = 1.0 / sqrt(resMap);
+        struct OwnedPoint
         {
-            
-            // find chosen key poses within searchR for the current key pose
-            pcl::KdTreeFLANN<PointType>::Ptr tmpTree(new pcl::KdTreeFLANN<PointType>());
-            vector<int> idxes;
-            vector<float> distances;
-            tmpTree->setInputCloud(cloudKeyPoses3DDS);
-            tmpTree->radiusSearch(cloudKeyPoses3DDSinit->points[i],searchR,idxes, distances);
-
-            if (idxes.empty())           
-            {
-                // cout<<"no nearby key poses, wierd"<<endl;
-                cloudKeyPoses3DDS->push_back(cloudKeyPoses3DDSinit->points[i]);
-                continue;
-            }
+            Eigen::Vector3f p;
+            int owner;
+        };
+        std::unordered_map<int64_t, vector<OwnedPoint>> selectedPoints;
+
+        auto findNearbySelected = [&](const PointType& pt, vector<int>& nearby)
+        {
+            nearby.clear();
+            int64_t cx = floor(pt.x * invSearchR), cy = floor(pt.y * invSearchR), cz = floor(pt.z * invSearchR);
+            for (int dx = -1; dx <= 1; dx++)
+                for (int dy = -1; dy <= 1; dy++)
+                    for (int dz = -1; dz <= 1; dz++)
+                    {
+                        auto it = selectedGrid.find(voxelKey(cx + dx, cy + dy, cz + dz));
+                        if (it == selectedGrid.end()) continue;
+                        for (int j : it->second)
+                            if (pointDistance(pt, cloudKeyPoses3DDS->points[j]) <= searchR)
+                                nearby.push_back((int)cloudKeyPoses3DDS->points[j].intensity);
+                    }
+            sort(nearby.begin(), nearby.end());
+        };
 
-            // build kdtree of the local map using found keyframes
-            pcl::PointCloud<PointType>::Ptr  localMap(new pcl::PointCloud<PointType>());
-            for (int j = 0; j < (int)idxes.size(); j++)
+        // share of the cloud with a point of the nearby selected keyframes closer than sqrt(resMap), the same as the
+        // nearest neighbour test on their local map; -1 if there is no selected keyframe nearby
+        auto overlapRatio = [&](const pcl::PointCloud<PointType>& cloud, const vector<int>& nearby, int cloudSize)
+        {
+            if (nearby.empty()) return -1.0f;
+            int cnt = 0;
+            for (const auto& p : cloud.points)
             {
-                int thisKeyInd = (int)cloudKeyPoses3DDS->points[idxes[j]].intensity;
-                *localMap += *transformPointCloud(cornerCloudKeyFrames[thisKeyInd],  &cloudKeyPoses6D->points[thisKeyInd]);
-                *localMap += *transformPointCloud(surfCloudKeyFrames[thisKeyInd],    &cloudKeyPoses6D->points[thisKeyInd]);
+                Eigen::Vector3f q = p.getVector3fMap();
+                int64_t cx = floor(p.x * invLeaf), cy = floor(p.y * invLeaf), cz = floor(p.z * invLeaf);
+                bool hit = false;
+                for (int dx = -1; dx <= 1 && !hit; dx++)
+                    for (int dy = -1; dy <= 1 && !hit; dy++)
+                        for (int dz = -1; dz <= 1 && !hit; dz++)
+                        {
+                            auto it = selectedPoints.find(voxelKey(cx + dx, cy + dy, cz + dz));
+                            if (it == selectedPoints.end()) continue;
+                            for (const OwnedPoint& sp : it->second)
+                                if ((sp.p - q).squaredNorm() < resMap && binary_search(nearby.begin(), nearby.end(), sp.owner))
+                                {
+                                    hit = true;
+                                    break;
+                                }
+                        }
+                if (hit) cnt++;
             }
+            return (float)(cnt)/cloudSize;
+        };
 
-            // pcl::io::savePCDFileBinary(saveMapDirectory + "/1.pcd",*localMap);
-            // cout<<"nearby key pose size: "<<idxes.size()<<endl;
-            pcl::KdTreeFLANN<PointType>::Ptr tmpTree2(new pcl::KdTreeFLANN<PointType>());
-            vector<int> idxes2;
-            vector<float> distances2;
-            tmpTree2->setInputCloud(localMap);
+        auto addSelected = [&](const PointType& pose, const pcl::PointCloud<PointType>& cloud)
+        {
+            int keyInd = pose.intensity;
+            selectedGrid[voxelKey(pose.x, pose.y, pose.z, invSearchR)].push_back(cloudKeyPoses3DDS->size());
+            cloudKeyPoses3DDS->push_back(pose);
+            for (const auto& p : cloud.points)
+                selectedPoints[voxelKey(p.x, p.y, p.z, invLeaf)].push_back({p.getVector3fMap(), keyInd});
+        };
+
+        auto transformKeyframe = [&](int keyInd)
+        {
+            pcl::PointCloud<PointType>::Ptr cloud = transformPointCloud(snap.cornerKeyFrames[keyInd], &snap.keyPoses6D->points[keyInd]);
+            *cloud += *transformPointCloud(snap.surfKeyFrames[keyInd], &snap.keyPoses6D->points[keyInd]);
+            return cloud;
+        };
 
-            // get overlap ratio of the current keyframe in the local map
-            int cnt = 0;
-            int currentIdx = cloudKeyPoses3DDSinit->points[i].intensity;
+        //init chosen key poses
+        addSelected(cloudKeyPoses3DDSinit->points[0], *transformKeyframe(cloudKeyPoses3DDSinit->points[0].intensity));
+
+        // candidates are scored in parallel batches against the selection made before the batch.
+        // Selecting keyframes only adds to the local map, so a rejected candidate stays rejected;
+        // an accepted one is scored again if something selected within the same batch is nearby.
+        int batchSize = 4 * numberOfCores;
+        vector<pcl::PointCloud<PointType>::Ptr> batchClouds(batchSize);
+        vector<vector<int>> batchNearby(batchSize);
+        vector<float> batchOverlap(batchSize);
+        for (int b = 1; b < candidateN; b += batchSize)
+        {
+            int n = min(batchSize, candidateN - b);
 
-            int sizeCorner = cornerCloudKeyFrames[currentIdx]->size();
-            pcl::PointCloud<PointType>::Ptr  cornerCloud(new pcl::PointCloud<PointType>());
-            cornerCloud = transformPointCloud(cornerCloudKeyFrames[currentIdx],  &cloudKeyPoses6D->points[currentIdx]);
-            for (int k = 0; k < sizeCorner; k++)
+            #pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
+            for (int k = 0; k < n; k++)
             {
-                tmpTree2->nearestKSearch(cornerCloud->points[k],1,idxes2, distances2);
-                if (distances2[0] < resMap) cnt++;
+                const PointType& candidate = cloudKeyPoses3DDSinit->points[b + k];
+                batchClouds[k] = transformKeyframe(candidate.intensity);
+                findNearbySelected(candidate, batchNearby[k]);
+                batchOverlap[k] = overlapRatio(*batchClouds[k], batchNearby[k], batchClouds[k]->size());
             }
 
-            int sizeSurf = surfCloudKeyFrames[currentIdx]->size();
-            pcl::PointCloud<PointType>::Ptr  surfCloud(new pcl::PointCloud<PointType>());
-            surfCloud = transformPointCloud(surfCloudKeyFrames[currentIdx],  &cloudKeyPoses6D->points[currentIdx]);
-            for (int k = 0; k < sizeSurf; k++)
+            int selectedBefore = cloudKeyPoses3DDS->size();
+            for (int k = 0; k < n; k++)
             {
-                tmpTree2->nearestKSearch(surfCloud->points[k],1,idxes2, distances2);
-                if (distances2[0] < resMap) cnt++;
-            }
+                const PointType& candidate = cloudKeyPoses3DDSinit->points[b + k];
+                if (batchOverlap[k] < overlapThre)
+                {
+                    for (int j = selectedBefore; j < (int)cloudKeyPoses3DDS->size(); j++)
+                    {
+                        if (pointDistance(candidate, cloudKeyPoses3DDS->points[j]) <= searchR)
+                        {
+                            findNearbySelected(candidate, batchNearby[k]);
+                            batchOverlap[k] = overlapRatio(*batchClouds[k], batchNearby[k], batchClouds[k]->size());
+                            break;
+                        }
+                    }
+                }
 
-            float overlap = (float)(cnt)/(sizeCorner + sizeSurf);
+                if (batchOverlap[k] < overlapThre)
+                    addSelected(candidate, *batchClouds[k]);
 
-            if (overlap < overlapThre) 
-            {
-                cloudKeyPoses3DDS->push_back(cloudKeyPoses3DDSinit->points[i]);
+                reportSaveProgress(job, b + k + 1);
             }
-
-            // cout<<"overlap: "<<overlap<<" finishing "<<i<<endl;
-            if (i%100 == 0)
-            cout<<"finished processed"<< i <<"keyframes"<<endl;
-
         }
         cout<<"after sparsification: "<<cloudKeyPoses3DDS->size()<<endl;
         cout<<"sparsification takes "<<sparsiTime.toc()/1000<<" sec "<<endl;
-        
+
     }
 
     void visualizeGlobalMapThread()
     {
+        TraceRecorder::instance().setThreadName("visualizer");
         ros::Rate rate(0.2);
         
         while (ros::ok())
@@ -1419,14 +1734,25 @@ public:
         roll::save_mapRequest  req;
         roll::save_mapResponse res;
 
+        // a job triggered by the user may still be writing
+        std::shared_ptr<SaveMapJob> job;
+        {
+            std::lock_guard<std::mutex> lock(mtxSaveJob);
+            job = saveMapJob;
+        }
+        if (job && !job->done)
+            job->result.wait();
+
         if (!doneSavingMap)
         {
-            if(!saveMapService(req, res))   cout << "Fail to save map" << endl;
+            req.blocking = true;
+            if(!saveMapService(req, res) || !res.success)   cout << "Fail to save map" << endl;
         }
     }
 
     void publishGlobalMap()
     {
+        ROLL_TRACE("visualizer/global_map");
         if (pubLidarCloudSurround.getNumSubscribers() == 0 || cloudKeyPoses3D->empty() == true)
         {
             return;
@@ -1484,6 +1810,7 @@ public:
     {
         if (loopClosureEnableFlag == false )
             return;
+        TraceRecorder::instance().setThreadName("loop_closure");
 
         ros::Rate rate(loopClosureFrequency);
         while (ros::ok())
@@ -1501,6 +1828,7 @@ public:
 
     void performLoopClosure()
     {
+        ROLL_STAGE("mapping/loop_closure");
         if (cloudKeyPoses3D->empty() == true)
             return;
 
@@ -1884,106 +2212,132 @@ public:
 
     void extractNearby()
     {
+        ROLL_STAGE("mapping/local_map");
         if (cloudKeyPoses3D->empty() == true) 
             return; 
-        pcl::PointCloud<PointType>::Ptr surroundingKeyPoses(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr surroundingKeyPosesDS(new pcl::PointCloud<PointType>());
-        std::vector<int> pointSearchInd;
-        std::vector<float> pointSearchSqDis;
-
-        // extract all the nearby key poses and downsample them
-        kdtreeSurroundingKeyPoses->setInputCloud(cloudKeyPoses3D); // create kd-tree
+        if (localizationMode && useTileMap)
+        {
+            extractTiles();
+            return;
+        }
         PointType pt;
         pt.x=transformTobeMapped[3];
         pt.y=transformTobeMapped[4];
         pt.z=transformTobeMapped[5];
-        
-        kdtreeSurroundingKeyPoses->radiusSearch(pt, (double)surroundingKeyframeSearchRadius, pointSearchInd, pointSearchSqDis);
-
-        if (pointSearchInd.empty()) 
-        {
-            // cout<<pt.x<< " "<<pt.y <<endl;
-            // ROS_WARN("No nearby keyposes within %f meters",surroundingKeyframeSearchRadius);
-            return;
-        }
+        // the latest 10 s of keyframes only while building a map
+        KeyframeMap::extractNearby(pt, localizationMode ? -1 : cloudInfoTime - 10.0);
+    }
 
-        for (int i = 0; i < (int)pointSearchInd.size(); ++i)
-        {
-            int id = pointSearchInd[i];
-            surroundingKeyPoses->push_back(cloudKeyPoses3D->points[id]);
-        }
+    // local map straight from the resident tiles, they are voxelized already
+    void extractTiles()
+    {
+        double x = transformTobeMapped[3], y = transformTobeMapped[4];
 
-        // downsampling is important especially at places where trajectories overlap when doing slam
-        
-        downSizeFilterSurroundingKeyPoses.setInputCloud(surroundingKeyPoses);
-        downSizeFilterSurroundingKeyPoses.filter(*surroundingKeyPosesDS);
+        // start building what the robot is about to need
+        for (int64_t key : tileMap.tilesAround(x, y, tileLoadRadius))
+            if (tileMap.needsLoading(key))
+                tileMap.request(key, tileSources(key));
 
-        for(auto& pt : surroundingKeyPosesDS->points) // recover the intensity field averaged by voxel filter
+        TicToc assembly;
+        vector<MapTile::Ptr> tiles;
+        for (int64_t key : tileMap.tilesAround(x, y, tileLocalMapRadius))
         {
-            kdtreeSurroundingKeyPoses->nearestKSearch(pt, 1, pointSearchInd, pointSearchSqDis);
-            pt.intensity = cloudKeyPoses3D->points[pointSearchInd[0]].intensity;
+            MapTile::Ptr tile = tileMap.get(key);
+            if (tile)
+                tiles.push_back(tile);
         }
-
-        if (!localizationMode)
+        // same tiles as last frame: the local map and the registration target are still valid
+        bool rebuild = tiles != localMapTiles;
+        if (rebuild)
         {
-            // also extract some latest key frames in case the robot rotates in one position
-            // more recent ones matches better with current frames
-            int numPoses = cloudKeyPoses3D->size();
-            for (int i = numPoses-1; i >= 0; --i)
+            // new clouds rather than clearing, the previous ones may still be referenced by a running registration
+            lidarCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
+            lidarCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
+            double mapTileSize = tileMap.getTileSize();
+            localMapOrigin = Eigen::Vector3d(floor(x / mapTileSize) * mapTileSize, floor(y / mapTileSize) * mapTileSize, 0);
+            for (const auto& tile : tiles)
+                tile->appendTo(*lidarCloudCornerFromMapDS, *lidarCloudSurfFromMapDS, localMapOrigin(0), localMapOrigin(1));
+            if (mortonOrder)
             {
-                if (cloudInfoTime - cloudKeyPoses6D->points[i].time < 10.0)
-                    surroundingKeyPosesDS->push_back(cloudKeyPoses3D->points[i]);
-                else
-                    break;
+                mortonSort(*lidarCloudCornerFromMapDS, mappingCornerLeafSize);
+                mortonSort(*lidarCloudSurfFromMapDS, mappingSurfLeafSize);
             }
+            lidarCloudCornerFromMapDSNum = lidarCloudCornerFromMapDS->size();
+            lidarCloudSurfFromMapDSNum = lidarCloudSurfFromMapDS->size();
+            // for publishLocalMap, which moves them back to the map frame
+            lidarCloudCornerFromMap = lidarCloudCornerFromMapDS;
+            lidarCloudSurfFromMap = lidarCloudSurfFromMapDS;
+            if (useMapField)
+                localMapField.reset(new MapField(tileMap.getTileSize(), tiles, localMapOrigin(0), localMapOrigin(1)));
+            localMapUpdated = true;
+            localMapTiles.swap(tiles);
+        }
+        double assemblyTime = assembly.toc();
+        localMapFrames++;
+        localMapTime += assemblyTime;
+        if (rebuild)
+        {
+            localMapRebuilds++;
+            localMapRebuildTime += assemblyTime;
         }
-        extractCloud(surroundingKeyPosesDS);
+
+        tileMap.unloadOutside(x, y, tileUnloadRadius);
+        if (debugMode) cout<<tileMap.stats()<<endl;
     }
 
-    void extractCloud(pcl::PointCloud<PointType>::Ptr cloudToExtract)
+    // per-frame cost of the tiled local map, and how much a rebuild of it costs relative to that. The ratio is
+    // not a speedup over the old per-frame keyframe extraction, which is not measured here.
+    string localMapStats()
     {
-        // fuse the map
-        lidarCloudCornerFromMap->clear();
-        lidarCloudSurfFromMap->clear(); 
-        // TicToc transPC;
-        for (int i = 0; i < (int)cloudToExtract->size(); ++i)
-        {
-            int thisKeyInd = (int)cloudToExtract->points[i].intensity;
+        std::ostringstream ss;
+        if (localMapFrames == 0)
+            return "local map: no frames";
+        double perFrame = localMapTime / localMapFrames;
+        double perRebuild = localMapRebuilds > 0 ? localMapRebuildTime / localMapRebuilds : 0;
+        ss << "local map: " << std::fixed << std::setprecision(3) << perFrame << " ms per frame, reused in "
+           << localMapFrames - localMapRebuilds << " of " << localMapFrames << " frames, " << perRebuild
+           << " ms per rebuild, rebuild/frame cost ratio " << std::setprecision(1) << (perFrame > 0 ? perRebuild / perFrame : 0);
+        return ss.str();
+    }
 
-            *lidarCloudCornerFromMap += *transformPointCloud(cornerCloudKeyFrames[thisKeyInd],  &cloudKeyPoses6D->points[thisKeyInd]);
-            *lidarCloudSurfFromMap   += *transformPointCloud(surfCloudKeyFrames[thisKeyInd],    &cloudKeyPoses6D->points[thisKeyInd]);    
+    vector<TileSource> tileSources(int64_t key)
+    {
+        vector<TileSource> sources;
+        std::lock_guard<TracedMutex> lock(mtx);
+        for (int i : tileMap.keyframesOf(key))
+        {
+            const PointTypePose& p = cloudKeyPoses6D->points[i];
+            TileSource source;
+            source.pose = TileSource::keyframePose(p.x, p.y, p.z, p.roll, p.pitch, p.yaw);
+            source.corner = cornerCloudKeyFrames[i];
+            source.surf = surfCloudKeyFrames[i];
+            sources.push_back(source);
         }
-        
-        // Downsample the surrounding corner key frames (or map)
-        downSizeFilterCorner.setInputCloud(lidarCloudCornerFromMap);
-        downSizeFilterCorner.filter(*lidarCloudCornerFromMapDS);
-        lidarCloudCornerFromMapDSNum = lidarCloudCornerFromMapDS->size();
-        // Downsample the surrounding surf key frames (or map)
-        downSizeFilterSurf.setInputCloud(lidarCloudSurfFromMap);
-        downSizeFilterSurf.filter(*lidarCloudSurfFromMapDS);
-        lidarCloudSurfFromMapDSNum = lidarCloudSurfFromMapDS->size();
-        
+        return sources;
     }
 
-
-    void downsampleCurrentScan()
+    // runs on the prepare thread, hence its own filters
+    void downsampleCurrentScan(MappingFrame& frame)
     {
-        if (cloudKeyPoses3D->empty() )
-            return;
+        pcl::VoxelGrid<PointType> downSizeFilterScanCorner;
+        pcl::VoxelGrid<PointType> downSizeFilterScanSurf;
         // Downsample cloud from current scan
-        lidarCloudCornerLastDS->clear();
-        downSizeFilterCorner.setInputCloud(lidarCloudCornerLast);
-        downSizeFilterCorner.filter(*lidarCloudCornerLastDS);
-        lidarCloudCornerLastDSNum = lidarCloudCornerLastDS->size();
-        // cout<<"After sampling: "<<lidarCloudCornerLastDSNum<<endl;
-        lidarCloudSurfLastDS->clear();
-        downSizeFilterSurf.setInputCloud(lidarCloudSurfLast);
-        downSizeFilterSurf.filter(*lidarCloudSurfLastDS);
-        lidarCloudSurfLastDSNum = lidarCloudSurfLastDS->size();
+        downSizeFilterScanCorner.setLeafSize(mappingCornerLeafSize, mappingCornerLeafSize, mappingCornerLeafSize);
+        downSizeFilterScanCorner.setInputCloud(frame.corner);
+        downSizeFilterScanCorner.filter(*frame.cornerDS);
+        downSizeFilterScanSurf.setLeafSize(mappingSurfLeafSize, mappingSurfLeafSize, mappingSurfLeafSize);
+        downSizeFilterScanSurf.setInputCloud(frame.surf);
+        downSizeFilterScanSurf.filter(*frame.surfDS);
+        if (mortonOrder)
+        {
+            mortonSort(*frame.cornerDS, mappingCornerLeafSize);
+            mortonSort(*frame.surfDS, mappingSurfLeafSize);
+        }
     }
 
     void scan2MapOptimization()
     {
+        ROLL_STAGE("mapping/registration");
         // no clouds nearby
         if (cloudKeyPoses3D->empty() || lidarCloudCornerFromMapDS->empty() || lidarCloudSurfFromMapDS->empty())
             return;
@@ -1991,88 +2345,142 @@ public:
         // cout<<"corner, surf points: "<<lidarCloudCornerLastDSNum<<" "<<lidarCloudSurfLastDSNum<<endl;
         if (lidarCloudCornerLastDSNum > edgeFeatureMinValidNum && lidarCloudSurfLastDSNum > surfFeatureMinValidNum)
         {
-            // get a copy of those clouds might lower down speed
-            LOAMmapping LM(lidarCloudCornerLastDS, lidarCloudSurfLastDS, lidarCloudCornerFromMapDS, lidarCloudSurfFromMapDS, affine_imu_to_map);
-            LM.match();
-            
-            // // for relocalization in loc mode: only needed when used in actual world
-            // if (LM.inlier_ratio > 0.4 && tryReloc == true)
-            // {
-            //     ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart <<" sec, relocalization succeeds!");
-            //     relocSuccess = true;
-            //     tryReloc = false;
-            //     transformUpdate(); // for giving fusion pose immediate map_odom
-            // }
-
-            if (relocSuccess == true && localizationMode == true)
+            // map-side precomputation (kd-trees, voxel Gaussians, covariances) only when the local map changed
+            TicToc registrationTime;
+            if (localMapUpdated)
             {
-                // for entering TMM: 
-                //inlier_ratio2 is more sensitive to map extension, and will suffice
-                if ( LM.inlier_ratio2 < startTemporaryMappingInlierRatioThre && temporaryMappingMode == false)
+                TicToc targetTime;
+                registration->setTarget(lidarCloudCornerFromMapDS, lidarCloudSurfFromMapDS);
+                registration->setMapField(localizationMode && useTileMap ? localMapField : nullptr);
+                if (localizationMode && useTileMap)
                 {
-                    ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart <<" sec, Entering temporary mapping mode due to poor mapping performace");
-                    ROS_INFO_STREAM("Inlier ratio2: "<< LM.inlier_ratio2);                        
-                    temporaryMappingMode = true; // here is the case for outdated map
-                    startTemporaryMappingIndex = temporaryCloudKeyPoses3D->size();
-                    frameTobeAbandoned = true;
-                    TMMcount++;                   
-                }
-                
-                // more strict to exit TMM for map updating
-                if (LM.inlier_ratio2 > exitTemporaryMappingInlierRatioThre && int(temporaryCloudKeyPoses3D->size()) > slidingWindowSize + 10 && temporaryMappingMode == true)
-                {
-                    correctedPose = LM.affine_out;// notice: the correction cannot be simply the correction for last keyframe!
-                    affine_imu_to_map = LM.affine_out;
-                    // LM.getTransformation(transformTobeMapped); // don't change it here, need original one as odom factor
-                    goodToMergeMap = true;
-                    cout<<"Now it is okay to merge the temporary map"<<endl;
+                    localMapTime += targetTime.toc();
+                    localMapRebuildTime += targetTime.toc();
                 }
+                localMapUpdated = false;
             }
-            // only correct pose from fastlio when mapping quality is good
-            // if (temporaryMappingMode == false && LM.isDegenerate == false)  // worse
-            // when building a map, it is better to fuse LIO and global matching
-            if (temporaryMappingMode == false || localizationMode == false) 
-            {
-                // fusion with gtsam 
-                // // TicToc opt_gtsam;
-                // Eigen::Affine3f affine_imu_to_map_smooth = gtsamOptimize(affine_imu_to_map,LM.affine_out, 0.5*(1-LM.inlier_ratio));
-                // // cout<<"gtsam opt takes:"<<opt_gtsam.toc()<<" ms"<<endl;
-                
+            registration->setSource(lidarCloudCornerLastDS, lidarCloudSurfLastDS);
+            // whatever the map and scan preparation used is taken from the budget of the iterations
+            if (registrationTimeBudget > 0)
+                registration->setTimeBudget(max(registrationTimeBudget - (float)registrationTime.toc(), 0.0f));
+            registration->align(toLocalMap(affine_imu_to_map));
+            if (debugMode) cout<<registration->name()<<": "<<registration->stats()<<endl;
+            if (registrationTimeBudget > 0)
+                deadlineCheck(registrationTime.toc(), registration->budgetLimited);
+
+            useRegistration(*registration, fromLocalMap(registration->affine_out));
+        } 
+        else 
+        {
+            ROS_WARN("Not enough features! Only %d edge and %d planar features available.", lidarCloudCornerLastDSNum, lidarCloudSurfLastDSNum);
+        }
+    }
 
-                // // primitive fusion
-                // affine_imu_to_map = LM.affine_out;
-                            
-                // fusion with ceres: currently only for smoothing, not for pose guess.
-                // cannot update Tgl immediately because opt takes time, getting a delayed Tgl is rather forfeiting it
+    // map pose to the frame of the local map and back, the origin is applied in double
+    Eigen::Affine3f toLocalMap(const Eigen::Affine3f& pose)
+    {
+        Eigen::Affine3d local = pose.cast<double>();
+        local.translation() -= localMapOrigin;
+        return local.cast<float>();
+    }
 
-                if (goodToMergeMap) // reset for the frame of merging
-                    globalEstimator.resetOptimization(LM.affine_out.matrix().cast<double>());
-                else 
-                    globalEstimator.inputGlobalLocPose(cloudInfoTime, LM.affine_out.matrix().cast<double>(), 0.5, 0.1);             
-                
-                affine_imu_to_map = LM.affine_out;
-                Affine3f2Trans(affine_imu_to_map,transformTobeMapped);
-                // printTrans("trans: ",transformTobeMapped);
+    Eigen::Affine3f fromLocalMap(const Eigen::Affine3f& pose)
+    {
+        Eigen::Affine3d map = pose.cast<double>();
+        map.translation() += localMapOrigin;
+        return map.cast<float>();
+    }
+
+    void deadlineCheck(double registrationTime, bool budgetLimited)
+    {
+        registrationFrames++;
+        if (budgetLimited) budgetLimitedFrames++;
+        if (registrationTime > registrationTimeBudget)
+        {
+            deadlineMisses++;
+            if (debugMode) ROS_WARN("Scan-to-map registration took %.1f ms, budget %.1f ms", registrationTime, registrationTimeBudget);
+        }
+        std_msgs::Int32 misses;
+        misses.data = deadlineMisses;
+        pubDeadlineMisses.publish(misses);
+    }
+
+    // pose and temporary mapping decisions from a finished scan-to-map registration, affine_out is its result in
+    // the map frame
+    void useRegistration(const Registration& LM, const Eigen::Affine3f& affine_out)
+    {
+        // // for relocalization in loc mode: only needed when used in actual world
+        // if (LM.inlier_ratio > 0.4 && tryReloc == true)
+        // {
+        //     ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart <<" sec, relocalization succeeds!");
+        //     relocSuccess = true;
+        //     tryReloc = false;
+        //     transformUpdate(); // for giving fusion pose immediate map_odom
+        // }
+
+        if (relocSuccess == true && localizationMode == true)
+        {
+            // for entering TMM: 
+            //inlier_ratio2 is more sensitive to map extension, and will suffice
+            if ( LM.inlier_ratio2 < startTemporaryMappingInlierRatioThre && temporaryMappingMode == false)
+            {
+                ROS_INFO_STREAM("At time "<< cloudInfoTime - rosTimeStart <<" sec, Entering temporary mapping mode due to poor mapping performace");
+                ROS_INFO_STREAM("Inlier ratio2: "<< LM.inlier_ratio2);                        
+                temporaryMappingMode = true; // here is the case for outdated map
+                startTemporaryMappingIndex = temporaryCloudKeyPoses3D->size();
+                frameTobeAbandoned = true;
+                TMMcount++;                   
             }
-     
-            if(saveLog)
+            
+            // more strict to exit TMM for map updating
+            if (LM.inlier_ratio2 > exitTemporaryMappingInlierRatioThre && int(temporaryCloudKeyPoses3D->size()) > slidingWindowSize + 10 && temporaryMappingMode == true)
             {
-                // for recording mapping logs
-                double mappingTime = mappingTimeVec.empty()?0:mappingTimeVec.back();
-                mtx.lock(); // need lock for fitnessScore
-                pose_log_file<<setw(20)<<cloudInfoTime<<" "<<transformTobeMapped[0]<<" "<<transformTobeMapped[1]<<" "<<transformTobeMapped[2]<<" "
-                    <<transformTobeMapped[3]<<" "<<transformTobeMapped[4]<<" "<<transformTobeMapped[5]<<" "<< LM.inlier_ratio<<" "
-                    <<LM.inlier_ratio2<<" " <<LM.regiError<<" "<<temporaryMappingMode<<" "<<mappingTime<<" "<<fitnessScore<<"\n";
-                mtx.unlock();
+                correctedPose = affine_out;// notice: the correction cannot be simply the correction for last keyframe!
+                affine_imu_to_map = affine_out;
+                // LM.getTransformation(transformTobeMapped); // don't change it here, need original one as odom factor
+                goodToMergeMap = true;
+                cout<<"Now it is okay to merge the temporary map"<<endl;
             }
+        }
+        // only correct pose from fastlio when mapping quality is good
+        // if (temporaryMappingMode == false && LM.isDegenerate == false)  // worse
+        // when building a map, it is better to fuse LIO and global matching
+        if (temporaryMappingMode == false || localizationMode == false) 
+        {
+            // fusion with gtsam 
+            // // TicToc opt_gtsam;
+            // Eigen::Affine3f affine_imu_to_map_smooth = gtsamOptimize(affine_imu_to_map,affine_out, 0.5*(1-LM.inlier_ratio));
+            // // cout<<"gtsam opt takes:"<<opt_gtsam.toc()<<" ms"<<endl;
+            
 
-            // ROS_INFO_STREAM("error: "<<regiError <<" inlier ratio: "<<  inlier_ratio);
-              
-        } 
-        else 
+            // // primitive fusion
+            // affine_imu_to_map = affine_out;
+                        
+            // fusion with ceres: currently only for smoothing, not for pose guess.
+            // cannot update Tgl immediately because opt takes time, getting a delayed Tgl is rather forfeiting it
+
+            if (goodToMergeMap) // reset for the frame of merging
+                globalEstimator.resetOptimization(affine_out.matrix().cast<double>());
+            else 
+                globalEstimator.inputGlobalLocPose(cloudInfoTime, affine_out.matrix().cast<double>(), 0.5, 0.1);             
+            
+            affine_imu_to_map = affine_out;
+            Affine3f2Trans(affine_imu_to_map,transformTobeMapped);
+            // printTrans("trans: ",transformTobeMapped);
+        }
+ 
+        if(saveLog)
         {
-            ROS_WARN("Not enough features! Only %d edge and %d planar features available.", lidarCloudCornerLastDSNum, lidarCloudSurfLastDSNum);
+            // for recording mapping logs
+            double mappingTime = mappingTimeVec.empty()?0:mappingTimeVec.back();
+            mtx.lock(); // need lock for fitnessScore
+            pose_log_file<<setw(20)<<cloudInfoTime<<" "<<transformTobeMapped[0]<<" "<<transformTobeMapped[1]<<" "<<transformTobeMapped[2]<<" "
+                <<transformTobeMapped[3]<<" "<<transformTobeMapped[4]<<" "<<transformTobeMapped[5]<<" "<< LM.inlier_ratio<<" "
+                <<LM.inlier_ratio2<<" " <<LM.regiError<<" "<<temporaryMappingMode<<" "<<mappingTime<<" "<<fitnessScore<<"\n";
+            mtx.unlock();
         }
+
+        // ROS_INFO_STREAM("error: "<<regiError <<" inlier ratio: "<<  inlier_ratio);
     }
 
     void resetISAM(){
@@ -2160,25 +2568,10 @@ public:
         // the frame for merging should be keyframe
         if (cloudKeyPoses3D->empty() || goodToMergeMap == true)    return isIndoorJudgement();
         // allow overlapped area to display loop closures
-        Eigen::Affine3f transStart;
-        if (localizationMode)
-        {
-            if (temporaryCloudKeyPoses6D->empty() == true ) return isIndoorJudgement(); 
-            transStart = pclPointToAffine3f(temporaryCloudKeyPoses6D->back());  
-        }            
-        else
-            transStart = pclPointToAffine3f(cloudKeyPoses6D->back());
-
-        Eigen::Affine3f transFinal = pcl::getTransformation(transformTobeMapped[3], transformTobeMapped[4], transformTobeMapped[5], 
-                                                            transformTobeMapped[0], transformTobeMapped[1], transformTobeMapped[2]);
-        Eigen::Affine3f transBetween = transStart.inverse() * transFinal;
-        float x, y, z, roll, pitch, yaw;
-        pcl::getTranslationAndEulerAngles(transBetween, x, y, z, roll, pitch, yaw);
-
-        float dist = sqrt(x*x + y*y + z*z);
-        if (dist > surroundingkeyframeAddingDistThreshold) // for paranomic lidar angle threshold is not needed
+        if (localizationMode && temporaryCloudKeyPoses6D->empty() == true) return isIndoorJudgement();
+        const PointTypePose& last = localizationMode ? temporaryCloudKeyPoses6D->back() : cloudKeyPoses6D->back();
+        if (isKeyframe(last, trans2Affine3f(transformTobeMapped)))
             return isIndoorJudgement();
-        // cout<<"dist: "<<dist<<endl;
         return -1;
     }
 
@@ -2345,10 +2738,8 @@ public:
         temporaryCloudKeyPoses3D->push_back(thisPose3D);
         temporaryCloudKeyPoses6D->push_back(thisPose6D);
         // save all the received edge and surf points
-        pcl::PointCloud<PointType>::Ptr thisCornerKeyFrame(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr thisSurfKeyFrame(new pcl::PointCloud<PointType>());
-        pcl::copyPointCloud(*lidarCloudCornerLast,  *thisCornerKeyFrame);
-        pcl::copyPointCloud(*lidarCloudSurfLast,    *thisSurfKeyFrame);
+        CompactCloud::Ptr thisCornerKeyFrame = encode(*lidarCloudCornerLast);
+        CompactCloud::Ptr thisSurfKeyFrame = encode(*lidarCloudSurfLast);
         // save key frame cloud
         temporaryCornerCloudKeyFrames.push_back(thisCornerKeyFrame); // 这个全局都存着，但每次局部匹配只搜索50m内的关键帧
         temporarySurfCloudKeyFrames.push_back(thisSurfKeyFrame);
@@ -2376,7 +2767,6 @@ public:
         if ( indoorJudgement < 0)
             return;
         
-        isIndoorKeyframe.push_back(indoorJudgement);
         // odom factor
         addOdomFactor();
 
@@ -2409,24 +2799,25 @@ public:
         // cout << "****************************************************" << endl;
         // isamCurrentEstimate.print("gtsam current estimate: ");
 
+        // save all the received edge and surf points
+        CompactCloud::Ptr thisCornerKeyFrame = encode(*lidarCloudCornerLast);
+        CompactCloud::Ptr thisSurfKeyFrame = encode(*lidarCloudSurfLast);
+
         //save key poses
-        PointType thisPose3D;
         PointTypePose thisPose6D;
-        thisPose3D.x = latestEstimate.translation().x();
-        thisPose3D.y = latestEstimate.translation().y();
-        thisPose3D.z = latestEstimate.translation().z();
-        thisPose3D.intensity = cloudKeyPoses3D->size(); // this can be used as keyframe index
-        cloudKeyPoses3D->push_back(thisPose3D);
-
-        thisPose6D.x = thisPose3D.x;
-        thisPose6D.y = thisPose3D.y;
-        thisPose6D.z = thisPose3D.z;
-        thisPose6D.intensity = thisPose3D.intensity ; // this can be used as index
+        thisPose6D.x = latestEstimate.translation().x();
+        thisPose6D.y = latestEstimate.translation().y();
+        thisPose6D.z = latestEstimate.translation().z();
         thisPose6D.roll  = latestEstimate.rotation().roll();
         thisPose6D.pitch = latestEstimate.rotation().pitch();
         thisPose6D.yaw   = latestEstimate.rotation().yaw();
         thisPose6D.time = cloudInfoTime;
-        cloudKeyPoses6D->push_back(thisPose6D);
+
+        // poses and keyframes go in together, the map saver snapshots them from another thread
+        mtx.lock();
+        addKeyframe(thisPose6D, thisCornerKeyFrame, thisSurfKeyFrame);
+        isIndoorKeyframe.push_back(indoorJudgement);
+        mtx.unlock();
 
         // cout << "****************************************************" << endl;
         // cout << "Pose covariance:" << isam->marginalCovariance(isamCurrentEstimate.size()-1) << endl;
@@ -2447,14 +2838,6 @@ public:
         // globalEstimator.resetOptimization(affine_imu_to_map.matrix().cast<double>());
 
         // cout<<"After opt: "<< transformTobeMapped[3]<<endl;
-        // save all the received edge and surf points
-        pcl::PointCloud<PointType>::Ptr thisCornerKeyFrame(new pcl::PointCloud<PointType>());
-        pcl::PointCloud<PointType>::Ptr thisSurfKeyFrame(new pcl::PointCloud<PointType>());       
-        // if pushing the original, it changes in the vec along with lidarCloudCornerLast
-        pcl::copyPointCloud(*lidarCloudCornerLast,  *thisCornerKeyFrame);
-        pcl::copyPointCloud(*lidarCloudSurfLast,    *thisSurfKeyFrame); 
-        cornerCloudKeyFrames.push_back(thisCornerKeyFrame); 
-        surfCloudKeyFrames.push_back(thisSurfKeyFrame);
 
         // save path for visualization
         updatePath(thisPose6D);
@@ -2473,10 +2856,12 @@ public:
         {
             // clear map cache
             lidarCloudMapContainer.clear();
-            // clear path
+            // clear path, the corrected one is published with the next frame
             globalPath.poses.clear();
+            pathPublishTime = -1;
             // update key poses
             int numPoses = isamCurrentEstimate.size();
+            mtx.lock();
             for (int i = 0; i < numPoses; ++i)
             {
                 cloudKeyPoses3D->points[i].x = isamCurrentEstimate.at<Pose3>(i).translation().x();
@@ -2491,6 +2876,7 @@ public:
                 cloudKeyPoses6D->points[i].yaw   = isamCurrentEstimate.at<Pose3>(i).rotation().yaw();
                 updatePath(cloudKeyPoses6D->points[i]);
             }
+            mtx.unlock();
 
             aLoopIsClosed = false;
         }
@@ -2525,34 +2911,76 @@ public:
         // cout<<transformTobeMapped[3]<<" "<<transformTobeMapped[4]<<" "<<endl;
         lidarOdometryROS.pose.pose.orientation = tf::createQuaternionMsgFromRollPitchYaw(transformTobeMapped[0], transformTobeMapped[1], transformTobeMapped[2]);
         pubLidarOdometryGlobal.publish(lidarOdometryROS);
-        globalOdometry.push_back(lidarOdometryROS);
+        {
+            std::lock_guard<TracedMutex> lock(mtx);
+            globalOdometry.push_back(lidarOdometryROS);
+        }
+
+        // end to end, from the LiDAR stamp to this pose
+        admission->published((ros::Time::now() - timeLidarInfoStamp).toSec() * 1000);
+        std_msgs::Float64MultiArray admissionMsg;
+        admissionMsg.layout.dim.resize(1);
+        admissionMsg.layout.dim[0].label = "received,published,dropped_policy,dropped_unsynced,dropped_rate,dropped_pipeline,latency_p50_ms,latency_p99_ms";
+        admissionMsg.layout.dim[0].size = 8;
+        admissionMsg.layout.dim[0].stride = 8;
+        admissionMsg.data = admission->summary();
+        pubAdmission.publish(admissionMsg);
     }
 
+    // gathers what is needed by value, assembling and serializing the clouds is left to the publish thread
     void publishLocalMap()
     {
-        pcl::PointCloud<PointType>::Ptr cloudLocal(new pcl::PointCloud<PointType>());
-        if (temporaryMappingMode == false)
-        {        
-            *cloudLocal += *lidarCloudSurfFromMap;
-            *cloudLocal += *lidarCloudCornerFromMap; 
+        ros::Time stamp = timeLidarInfoStamp;
+        bool temporary = temporaryMappingMode;
+        pcl::PointCloud<PointType>::Ptr surfFromMap = lidarCloudSurfFromMap;
+        pcl::PointCloud<PointType>::Ptr cornerFromMap = lidarCloudCornerFromMap;
+        Eigen::Affine3f localMapToMap(Eigen::Translation3f(localMapOrigin.cast<float>()));
+        pcl::PointCloud<PointType>::Ptr keyPoses3D(new pcl::PointCloud<PointType>(*temporaryCloudKeyPoses3D));
+        pcl::PointCloud<PointTypePose>::Ptr keyPoses6D(new pcl::PointCloud<PointTypePose>(*temporaryCloudKeyPoses6D));
+        vector<CompactCloud::Ptr> surfKeyFrames, cornerKeyFrames;
+        if (temporary)
+        {
+            surfKeyFrames = temporarySurfCloudKeyFrames;
+            cornerKeyFrames = temporaryCornerCloudKeyFrames;
         }
-        else
+        // the path grows with every frame, so it is copied for the publish thread only every pathPublishInterval
+        std::shared_ptr<const nav_msgs::Path> path;
+        if (pathPublishTime < 0 || cloudInfoTime - pathPublishTime >= pathPublishInterval)
+        {
+            std::shared_ptr<nav_msgs::Path> snapshot(new nav_msgs::Path(globalPath));
+            snapshot->header.stamp = stamp;
+            snapshot->header.frame_id = mapFrame;
+            path = snapshot;
+            pathPublishTime = cloudInfoTime;
+        }
+
+        publishQueue.push([=]()
         {
-            for (int i=0;i<(int)temporaryCloudKeyPoses3D->size();i++)
+            pcl::PointCloud<PointType>::Ptr cloudLocal(new pcl::PointCloud<PointType>());
+            if (temporary == false)
+            {        
+                *cloudLocal += *surfFromMap;
+                *cloudLocal += *cornerFromMap; 
+                if (!localMapToMap.matrix().isIdentity())
+                    pcl::transformPointCloud(*cloudLocal, *cloudLocal, localMapToMap);
+            }
+            else
             {
-                int idx = temporaryCloudKeyPoses3D->points[i].intensity;
-                *cloudLocal += *transformPointCloud(temporarySurfCloudKeyFrames[idx],&temporaryCloudKeyPoses6D->points[i]);
-                *cloudLocal += *transformPointCloud(temporaryCornerCloudKeyFrames[idx],&temporaryCloudKeyPoses6D->points[i]);
+                for (int i=0;i<(int)keyPoses3D->size();i++)
+                {
+                    int idx = keyPoses3D->points[i].intensity;
+                    *cloudLocal += *transformPointCloud(surfKeyFrames[idx],&keyPoses6D->points[i]);
+                    *cloudLocal += *transformPointCloud(cornerKeyFrames[idx],&keyPoses6D->points[i]);
+                }
             }
-        }
-        publishCloud(&pubRecentKeyFrames, cloudLocal, timeLidarInfoStamp, mapFrame);
+            publishCloud(&pubRecentKeyFrames, cloudLocal, stamp, mapFrame);
 
-        //publish temporary keyposes for visualization
-        publishCloud(&pubKeyPosesTmp,temporaryCloudKeyPoses3D,timeLidarInfoStamp, mapFrame);
+            //publish temporary keyposes for visualization
+            publishCloud(&pubKeyPosesTmp, keyPoses3D, stamp, mapFrame);
 
-        globalPath.header.stamp = timeLidarInfoStamp;
-        globalPath.header.frame_id = mapFrame;
-        pubPath.publish(globalPath);
+            if (path)
+                pubPath.publish(*path);
+        });
     }
 };
 
@@ -2567,12 +2995,20 @@ int main(int argc, char** argv)
     
     std::thread loopthread(&mapOptimization::loopClosureThread, &MO);
     std::thread visualizeMapThread(&mapOptimization::visualizeGlobalMapThread, &MO);
+    std::thread prepareThread{&mapOptimization::prepareFrames,&MO};
     std::thread mappingThread{&mapOptimization::run,&MO};
+    std::thread publishThread{&mapOptimization::publishFrames,&MO};
+    TraceRecorder::instance().setThreadName("spinner");
     ros::spin();
 
+    MO.stopPipeline();
     loopthread.join();
     visualizeMapThread.join();
+    prepareThread.join();
     mappingThread.join();
+    publishThread.join();
+    if (TraceRecorder::enabled())
+        MO.dumpTrace(MO.saveMapDirectory + "/roll_trace.json");
     
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,464 @@
+#include "rollCommon.h"
+#include "featureExtractor.h"
+#include "LOAMmapping.h"
+#include "globalOpt.h"
+
+#include <random>
+#include <benchmark/benchmark.h>
+
+// microbenchmarks of the kernels on the mapping path, on the inputs of one recorded frame so that two builds are
+// compared on the same data. Results go to JSON with Google Benchmark's own flags, and two files compare with
+// its tools/compare.py:
+// usage: rosrun roll roll_benchmark [--config params.yaml] [--set name=value]... [--fixture dir]
+//        [--benchmark_filter=loam] [--benchmark_out=results.json --benchmark_out_format=json]
+// A fixture directory is written by roll_replay --fixture from NCLT HDL-32 scans: scan.pcd (raw scan),
+// corner.pcd and surf.pcd (downsampled scan features), map_corner.pcd and map_surf.pcd (local map), guess.txt
+// (initial guess) and trajectory.txt (poses for the global optimization). Without --fixture a street scene is
+// ray cast for an HDL-32 instead, deterministic as well. Without --config the defaults are used, with N_SCAN 32.
+
+struct BenchmarkFixture
+{
+    RollConfig config;
+    string source = "synthetic HDL-32 street";
+    pcl::PointCloud<PointType>::Ptr scan;
+    // scan features before and after the mapping downsampling
+    pcl::PointCloud<PointType>::Ptr featureCorner, featureSurf;
+    pcl::PointCloud<PointType>::Ptr corner, surf;
+    pcl::PointCloud<PointType>::Ptr mapCorner, mapSurf;
+    Eigen::Affine3f guess = Eigen::Affine3f::Identity();
+    vector<std::pair<double, Eigen::Affine3f>, Eigen::aligned_allocator<std::pair<double, Eigen::Affine3f>>> trajectory;
+};
+
+static BenchmarkFixture fixture;
+
+static pcl::PointCloud<PointType>::Ptr downsample(const pcl::PointCloud<PointType>::Ptr& cloud, float leafSize)
+{
+    pcl::PointCloud<PointType>::Ptr cloudDS(new pcl::PointCloud<PointType>());
+    pcl::VoxelGrid<PointType> downSizeFilter;
+    downSizeFilter.setLeafSize(leafSize, leafSize, leafSize);
+    downSizeFilter.setInputCloud(cloud);
+    downSizeFilter.filter(*cloudDS);
+    return cloudDS;
+}
+
+// one HDL-32 revolution from origin in a street: ground 1 m below the sensor, house fronts 6 m to either side, a
+// cross wall 40 m ahead and behind, and poles along the kerbs for the corners. 32 rings 4/3 deg apart from -30 deg,
+// the ring centres scanRegistration expects, 0.16 deg between firings in firing order like the NCLT scans; 1 cm range
+// noise.
+static pcl::PointCloud<PointType>::Ptr rayCastStreet(const Eigen::Vector3f& origin, std::mt19937& rng)
+{
+    const int rings = 32, firings = 2250;
+    const float ground = -1.0, street = 6.0, length = 40.0, wallHeight = 8.0, poleRadius = 0.15, poleHeight = 4.0;
+    std::normal_distribution<float> noise(0, 0.01);
+    pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>());
+    for (int k = 0; k < firings; k++)
+    {
+        float azimuth = -2 * M_PI * k / firings;
+        for (int r = 0; r < rings; r++)
+        {
+            float elevation = deg2rad(-92.0 / 3.0 + (r + 0.5) * 4.0 / 3.0);
+            Eigen::Vector3f d(cos(elevation) * cos(azimuth), cos(elevation) * sin(azimuth), sin(elevation));
+            float range = FLT_MAX;
+            if (d.z() < 0)
+                range = min(range, (ground - origin.z()) / d.z());
+            for (float side : {-street, street})
+                if (d.y() * side > 0)
+                {
+                    float t = (side - origin.y()) / d.y();
+                    if (origin.z() + t * d.z() < wallHeight)
+                        range = min(range, t);
+                }
+            for (float end : {-length, length})
+                if (d.x() * end > 0)
+                {
+                    float t = (end - origin.x()) / d.x();
+                    if (origin.z() + t * d.z() < wallHeight)
+                        range = min(range, t);
+                }
+            float dxy = d.head<2>().squaredNorm();
+            for (float x = -length + 4; x < length; x += 8)
+                for (float y : {-street + 1.5f, street - 1.5f})
+                {
+                    // |o + t d - c|^2 = r^2 in the xy plane
+                    Eigen::Vector2f oc = origin.head<2>() - Eigen::Vector2f(x, y);
+                    float b = oc.dot(d.head<2>()), c = oc.squaredNorm() - poleRadius * poleRadius;
+                    float disc = b * b - dxy * c;
+                    if (disc < 0 || dxy < 1e-9)
+                        continue;
+                    float t = (-b - sqrt(disc)) / dxy;
+                    if (t > 0 && origin.z() + t * d.z() < poleHeight)
+                        range = min(range, t);
+                }
+            if (range < 1.0 || range > 80.0)
+                continue;
+            range += noise(rng);
+            PointType p;
+            p.getVector3fMap() = range * d;
+            p.intensity = r;
+            cloud->push_back(p);
+        }
+    }
+    return cloud;
+}
+
+static void makeSyntheticFixture()
+{
+    std::mt19937 rng(42);
+    fixture.scan = rayCastStreet(Eigen::Vector3f::Zero(), rng);
+
+    // the map: scans from 3 m behind to 3 m ahead, features downsampled as the keyframes are
+    FeatureExtractor extractor(fixture.config);
+    pcl::PointCloud<PointType>::Ptr mapCorner(new pcl::PointCloud<PointType>());
+    pcl::PointCloud<PointType>::Ptr mapSurf(new pcl::PointCloud<PointType>());
+    for (float x = -3; x <= 3; x += 1.5)
+    {
+        FeatureClouds features;
+        if (!extractor.extract(rayCastStreet(Eigen::Vector3f(x, 0, 0), rng), features))
+            continue;
+        Eigen::Affine3f pose(Eigen::Translation3f(x, 0, 0));
+        *mapCorner += *transformPointCloud(*features.corner, pose);
+        *mapSurf += *transformPointCloud(*features.surface, pose);
+    }
+    fixture.mapCorner = downsample(mapCorner, fixture.config.mappingCornerLeafSize);
+    fixture.mapSurf = downsample(mapSurf, fixture.config.mappingSurfLeafSize);
+    fixture.guess = Eigen::Translation3f(0.1, -0.05, 0.02) * Eigen::AngleAxisf(deg2rad(0.5), Eigen::Vector3f::UnitZ());
+
+    // 1 m/s along the street with a slow swing of the heading, at 10 Hz
+    for (int i = 0; i < 1000; i++)
+    {
+        Eigen::Affine3f pose = Eigen::Translation3f(0.1 * i, sin(0.01 * i), 0)
+                               * Eigen::AngleAxisf(0.1 * cos(0.01 * i), Eigen::Vector3f::UnitZ());
+        fixture.trajectory.emplace_back(0.1 * i, pose);
+    }
+}
+
+static bool loadFixture(const string& directory)
+{
+    fixture.source = directory;
+    fixture.scan.reset(new pcl::PointCloud<PointType>());
+    fixture.corner.reset(new pcl::PointCloud<PointType>());
+    fixture.surf.reset(new pcl::PointCloud<PointType>());
+    fixture.mapCorner.reset(new pcl::PointCloud<PointType>());
+    fixture.mapSurf.reset(new pcl::PointCloud<PointType>());
+    if (pcl::io::loadPCDFile(directory + "/corner.pcd", *fixture.corner) != 0
+        || pcl::io::loadPCDFile(directory + "/surf.pcd", *fixture.surf) != 0
+        || pcl::io::loadPCDFile(directory + "/map_corner.pcd", *fixture.mapCorner) != 0
+        || pcl::io::loadPCDFile(directory + "/map_surf.pcd", *fixture.mapSurf) != 0)
+        return false;
+    // a fixture recorded from a bag has features only
+    if (pcl::io::loadPCDFile(directory + "/scan.pcd", *fixture.scan) != 0)
+        fixture.scan.reset();
+
+    ifstream guess(directory + "/guess.txt");
+    for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++)
+            guess >> fixture.guess.matrix()(r, c);
+    if (!guess)
+        return false;
+
+    ifstream trajectory(directory + "/trajectory.txt");
+    double time;
+    float x, y, z, qx, qy, qz, qw;
+    while (trajectory >> time >> x >> y >> z >> qx >> qy >> qz >> qw)
+        fixture.trajectory.emplace_back(time, Eigen::Translation3f(x, y, z) * Eigen::Quaternionf(qw, qx, qy, qz));
+    return true;
+}
+
+// the features the mapping node gets for the scan, then downsampled as in mapping/prepare
+static void prepareFixture()
+{
+    if (fixture.scan)
+    {
+        FeatureExtractor extractor(fixture.config);
+        FeatureClouds features;
+        pcl::PointCloud<PointType>::Ptr scan(new pcl::PointCloud<PointType>(*fixture.scan));
+        extractor.extract(scan, features);
+        fixture.featureCorner = features.corner;
+        fixture.featureSurf = features.surface;
+    }
+    else
+    {
+        fixture.featureCorner = fixture.corner;
+        fixture.featureSurf = fixture.surf;
+    }
+    if (!fixture.corner)
+    {
+        fixture.corner = downsample(fixture.featureCorner, fixture.config.mappingCornerLeafSize);
+        fixture.surf = downsample(fixture.featureSurf, fixture.config.mappingSurfLeafSize);
+    }
+    if (fixture.config.mortonOrder)
+    {
+        mortonSort(*fixture.corner, fixture.config.mappingCornerLeafSize);
+        mortonSort(*fixture.surf, fixture.config.mappingSurfLeafSize);
+        mortonSort(*fixture.mapCorner, fixture.config.mappingCornerLeafSize);
+        mortonSort(*fixture.mapSurf, fixture.config.mappingSurfLeafSize);
+    }
+}
+
+// scanRegistration
+
+// a fixture recorded from a bag has no raw scan
+static bool hasScan(benchmark::State& state)
+{
+    if (!fixture.scan)
+        state.SkipWithError("the fixture has no scan.pcd");
+    return (bool)fixture.scan;
+}
+
+static void BM_FeatureProjection(benchmark::State& state)
+{
+    if (!hasScan(state))
+        return;
+    FeatureExtractor extractor(fixture.config);
+    pcl::PointCloud<PointType>::Ptr projected;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        pcl::PointCloud<PointType>::Ptr scan(new pcl::PointCloud<PointType>(*fixture.scan));
+        state.ResumeTiming();
+        extractor.project(scan, projected);
+    }
+    state.SetItemsProcessed(state.iterations() * fixture.scan->size());
+}
+
+static void BM_FeatureCurvature(benchmark::State& state)
+{
+    if (!hasScan(state))
+        return;
+    FeatureExtractor extractor(fixture.config);
+    pcl::PointCloud<PointType>::Ptr scan(new pcl::PointCloud<PointType>(*fixture.scan));
+    pcl::PointCloud<PointType>::Ptr projected;
+    extractor.project(scan, projected);
+    for (auto _ : state)
+        extractor.computeCurvature(projected);
+    state.SetItemsProcessed(state.iterations() * projected->size());
+}
+
+// the selection sorts the curvature in place, it is recomputed untimed before every run
+static void BM_FeatureSelection(benchmark::State& state)
+{
+    if (!hasScan(state))
+        return;
+    FeatureExtractor extractor(fixture.config);
+    pcl::PointCloud<PointType>::Ptr scan(new pcl::PointCloud<PointType>(*fixture.scan));
+    pcl::PointCloud<PointType>::Ptr projected;
+    extractor.project(scan, projected);
+    FeatureClouds features;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        extractor.computeCurvature(projected);
+        state.ResumeTiming();
+        extractor.selectFeatures(projected, features);
+    }
+    state.SetItemsProcessed(state.iterations() * projected->size());
+    state.counters["corners"] = features.corner->size();
+    state.counters["surfaces"] = features.surface->size();
+}
+
+// voxel filters of mapping/prepare (scan features) and mapping/local_map (map)
+
+enum VoxelInput { SCAN_CORNER, SCAN_SURF, MAP_SURF };
+
+static void BM_VoxelGrid(benchmark::State& state, VoxelInput input)
+{
+    pcl::PointCloud<PointType>::Ptr cloud = input == SCAN_CORNER ? fixture.featureCorner
+                                          : (input == SCAN_SURF ? fixture.featureSurf : fixture.mapSurf);
+    float leafSize = input == SCAN_CORNER ? fixture.config.mappingCornerLeafSize : fixture.config.mappingSurfLeafSize;
+    pcl::VoxelGrid<PointType> downSizeFilter;
+    downSizeFilter.setLeafSize(leafSize, leafSize, leafSize);
+    pcl::PointCloud<PointType> cloudDS;
+    for (auto _ : state)
+    {
+        downSizeFilter.setInputCloud(cloud);
+        downSizeFilter.filter(cloudDS);
+    }
+    state.SetItemsProcessed(state.iterations() * cloud->size());
+}
+
+static void BM_TransformPointCloud(benchmark::State& state)
+{
+    for (auto _ : state)
+        benchmark::DoNotOptimize(transformPointCloud(*fixture.mapSurf, fixture.guess));
+    state.SetItemsProcessed(state.iterations() * fixture.mapSurf->size());
+}
+
+// kd-trees of the map
+
+static void BM_KdTreeBuild(benchmark::State& state)
+{
+    CloudKdTree kdtree;
+    for (auto _ : state)
+        kdtree.setInputCloud(fixture.mapSurf);
+    state.SetItemsProcessed(state.iterations() * fixture.mapSurf->size());
+}
+
+// 5 nearest neighbours of every surface point of the scan at the guess, as surfOptimization searches
+static void BM_KdTreeQuery(benchmark::State& state)
+{
+    CloudKdTree kdtree;
+    kdtree.setInputCloud(fixture.mapSurf);
+    pcl::PointCloud<PointType>::Ptr queries = transformPointCloud(*fixture.surf, fixture.guess);
+    for (auto _ : state)
+        for (const PointType& point : queries->points)
+            benchmark::DoNotOptimize(kdtree.knn<5>(point));
+    state.SetItemsProcessed(state.iterations() * queries->size());
+}
+
+// LOAMmapping
+
+// the registration of a frame from the guess: all pyramid levels, each a match() to convergence
+static void BM_LoamMatch(benchmark::State& state)
+{
+    LOAMmapping loam(fixture.config);
+    loam.setTarget(fixture.mapCorner, fixture.mapSurf);
+    loam.setSource(fixture.corner, fixture.surf);
+    for (auto _ : state)
+        loam.align(fixture.guess);
+    state.counters["iterations"] = loam.iterCount;
+    state.counters["inlier_ratio"] = loam.inlier_ratio;
+}
+
+// one iteration's correspondences at the registered pose, full resolution
+static void BM_LoamCornerOptimization(benchmark::State& state)
+{
+    LOAMmapping loam(fixture.config);
+    loam.setTarget(fixture.mapCorner, fixture.mapSurf);
+    loam.setSource(fixture.corner, fixture.surf);
+    loam.align(fixture.guess);
+    for (auto _ : state)
+        loam.cornerOptimization(0);
+    state.SetItemsProcessed(state.iterations() * loam.lidarCloudCornerLastDSNum);
+}
+
+static void BM_LoamSurfOptimization(benchmark::State& state)
+{
+    LOAMmapping loam(fixture.config);
+    loam.setTarget(fixture.mapCorner, fixture.mapSurf);
+    loam.setSource(fixture.corner, fixture.surf);
+    loam.align(fixture.guess);
+    for (auto _ : state)
+        loam.surfOptimization(0);
+    state.SetItemsProcessed(state.iterations() * loam.lidarCloudSurfLastDSNum);
+}
+
+// the Gauss-Newton step over one iteration's residuals; iteration 0 includes the degeneracy check
+static void BM_LoamLMOptimization(benchmark::State& state)
+{
+    LOAMmapping loam(fixture.config);
+    loam.setTarget(fixture.mapCorner, fixture.mapSurf);
+    loam.setSource(fixture.corner, fixture.surf);
+    loam.align(fixture.guess);
+    loam.lidarCloudOri->clear();
+    loam.coeffSel->clear();
+    loam.cornerOptimization(0);
+    loam.surfOptimization(0);
+    loam.combineOptimizationCoeffs();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(loam.LMOptimization(state.range(0)));
+    state.SetItemsProcessed(state.iterations() * loam.lidarCloudOri->size());
+}
+
+// GlobalOptimization
+
+// one optimization over a window of range(0) odometry poses with a global localization pose for every 5th, as the
+// localization mode feeds it
+static void BM_GlobalOptimization(benchmark::State& state)
+{
+    int window = min<int>(state.range(0), fixture.trajectory.size());
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        // the optimization may reset the estimator, so a fresh one every run
+        GlobalOptimization estimator(window, false);
+        for (int i = 0; i < window; i++)
+        {
+            const auto& pose = fixture.trajectory[fixture.trajectory.size() - window + i];
+            estimator.inputOdom(pose.first, pose.second.matrix().cast<double>());
+            if (i % 5 == 0)
+                estimator.inputGlobalLocPose(pose.first, pose.second.matrix().cast<double>(), 0.5, 0.1);
+        }
+        state.ResumeTiming();
+        estimator.optimizeOnce();
+    }
+    state.SetItemsProcessed(state.iterations() * window);
+}
+
+BENCHMARK(BM_FeatureProjection)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_FeatureCurvature)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_FeatureSelection)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_VoxelGrid, scan_corner, SCAN_CORNER)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_VoxelGrid, scan_surf, SCAN_SURF)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_VoxelGrid, map_surf, MAP_SURF)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_TransformPointCloud)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_KdTreeBuild)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_KdTreeQuery)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoamMatch)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoamCornerOptimization)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoamSurfOptimization)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoamLMOptimization)->ArgName("iteration")->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_GlobalOptimization)->ArgName("window")->Arg(100)->Arg(500)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv)
+{
+    // our options out of argv, the rest is for Google Benchmark
+    YamlParamReader params;
+    bool configured = false;
+    string fixtureDirectory;
+    int kept = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--config" && hasValue)
+        {
+            if (!params.load(argv[++i]))
+            {
+                cout<<"Cannot read "<<argv[i]<<endl;
+                return 1;
+            }
+            configured = true;
+        }
+        else if (option == "--set" && hasValue && string(argv[i + 1]).find('=') != string::npos)
+        {
+            string value = argv[++i];
+            params.set(value.substr(0, value.find('=')), value.substr(value.find('=') + 1));
+        }
+        else if (option == "--fixture" && hasValue)
+            fixtureDirectory = argv[++i];
+        else
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+    if (!configured)
+        params.set("N_SCAN", "32");
+    if (!fixture.config.read(params))
+    {
+        cout<<"Invalid sensor type (must be either 'velodyne' or 'ouster'): "<<fixture.config.sensorName<<endl;
+        return 1;
+    }
+
+    if (!fixtureDirectory.empty())
+    {
+        if (!loadFixture(fixtureDirectory))
+        {
+            cout<<"Cannot read the fixture in "<<fixtureDirectory<<endl;
+            return 1;
+        }
+    }
+    else
+        makeSyntheticFixture();
+    prepareFixture();
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::AddCustomContext("fixture", fixture.source);
+    benchmark::AddCustomContext("registration_points", std::to_string(fixture.corner->size()) + " corner, "
+                                + std::to_string(fixture.surf->size()) + " surf");
+    benchmark::AddCustomContext("map_points", std::to_string(fixture.mapCorner->size()) + " corner, "
+                                + std::to_string(fixture.mapSurf->size()) + " surf");
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
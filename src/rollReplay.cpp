@@ -0,0 +1,469 @@
+#include "utility.h"
+#include "featureExtractor.h"
+#include "registrationFactory.h"
+#include "keyframeMap.h"
+#include "roll/cloud_info.h"
+
+#include <cstring>
+#include <dirent.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+// offline replay for throughput measurements: feeds recorded frames through feature extraction and scan-to-map
+// registration as fast as they can be processed, single threaded and without roscore, so two runs over the same
+// data do the same work. Reports frames per second and the latency histograms of every stage.
+// usage: rosrun roll roll_replay --config params.yaml (--nclt velodyne_sync_dir --poses groundtruth.csv | --bag file.bag)
+//        [--set name=value]... [--frames N] [--trajectory out.txt] [--csv stages.csv] [--fixture dir]
+// --nclt reads raw NCLT scans (<utime>.bin) with poses from an NCLT pose file (ground truth or odometry csv);
+// --bag reads cloud_info and odometry as recorded from the feature node and FAST_LIO, skipping feature extraction.
+// The poses only give the initial guess, as the odometry does for the mapping node.
+// --fixture records the inputs of the last frame (raw scan, scan features, local map, guess) and the trajectory into
+// an existing directory, for roll_benchmark.
+
+// one synchronized frame: a raw scan (extracted here) or the features of a recorded cloud_info
+struct ReplayFrame
+{
+    double time = 0;
+    Eigen::Affine3f lidarToOdom = Eigen::Affine3f::Identity();
+    pcl::PointCloud<PointType>::Ptr raw;
+    pcl::PointCloud<PointType>::Ptr corner;
+    pcl::PointCloud<PointType>::Ptr surf;
+};
+
+class ReplaySource
+{
+    public:
+        virtual ~ReplaySource() {}
+        // false at the end of the data
+        virtual bool next(ReplayFrame& frame) = 0;
+        int unsynced = 0; // frames dropped without a pose within 0.05 s
+};
+
+// NCLT velodyne_sync: 8 bytes per point, x, y, z as uint16 (0.005 m steps from -100 m), intensity and laser id as uint8.
+// NCLT frames have z pointing down; scans and poses are turned by 180 deg about x, so rings come out in the order
+// scanRegistration expects and the map is z-up.
+class NcltSource : public ReplaySource
+{
+    public:
+        bool open(const string& scanDirectory, const string& poseFile, const Eigen::Affine3f& lidarToBody)
+        {
+            DIR* dir = opendir(scanDirectory.c_str());
+            if (dir == nullptr)
+            {
+                cout<<"Cannot open "<<scanDirectory<<endl;
+                return false;
+            }
+            while (dirent* entry = readdir(dir))
+            {
+                string name = entry->d_name;
+                if (name.size() > 4 && name.substr(name.size() - 4) == ".bin")
+                    scans.emplace_back(atoll(name.c_str()), scanDirectory + "/" + name);
+            }
+            closedir(dir);
+            std::sort(scans.begin(), scans.end());
+
+            ifstream fin(poseFile);
+            if (!fin.is_open())
+            {
+                cout<<"Cannot open "<<poseFile<<endl;
+                return false;
+            }
+            Eigen::Affine3f flip(Eigen::AngleAxisf(M_PI, Eigen::Vector3f::UnitX()));
+            string line;
+            while (getline(fin, line))
+            {
+                double utime, x, y, z, roll, pitch, yaw;
+                if (sscanf(line.c_str(), "%lf,%lf,%lf,%lf,%lf,%lf,%lf", &utime, &x, &y, &z, &roll, &pitch, &yaw) != 7)
+                    continue;
+                if (std::isnan(x) || std::isnan(roll))
+                    continue;
+                Eigen::Affine3f bodyToOdom = pcl::getTransformation(x, y, z, roll, pitch, yaw);
+                poses[utime * 1e-6] = flip * bodyToOdom * lidarToBody * flip;
+            }
+            cout<<scans.size()<<" scans, "<<poses.size()<<" poses"<<endl;
+            return !scans.empty() && !poses.empty();
+        }
+
+        bool next(ReplayFrame& frame) override
+        {
+            while (current < scans.size())
+            {
+                const auto& scan = scans[current++];
+                double time = scan.first * 1e-6;
+                if (!poseAt(time, frame.lidarToOdom))
+                {
+                    unsynced++;
+                    continue;
+                }
+                frame.time = time;
+                frame.raw.reset(new pcl::PointCloud<PointType>());
+                return read(scan.second, *frame.raw);
+            }
+            return false;
+        }
+
+    private:
+        vector<std::pair<long long, string>> scans;
+        size_t current = 0;
+        std::map<double, Eigen::Affine3f, std::less<double>,
+                 Eigen::aligned_allocator<std::pair<const double, Eigen::Affine3f>>> poses;
+
+        bool poseAt(double time, Eigen::Affine3f& pose)
+        {
+            auto after = poses.lower_bound(time);
+            auto best = after;
+            if (after == poses.end() || (after != poses.begin() && time - std::prev(after)->first < after->first - time))
+                best = std::prev(after);
+            if (best == poses.end() || abs(best->first - time) > 0.05)
+                return false;
+            pose = best->second;
+            return true;
+        }
+
+        static bool read(const string& fileName, pcl::PointCloud<PointType>& cloud)
+        {
+            ifstream fin(fileName, ios::binary);
+            if (!fin.is_open())
+                return false;
+            vector<char> data((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+            int n = data.size() / 8;
+            cloud.resize(n);
+            for (int i = 0; i < n; i++)
+            {
+                const char* p = &data[i * 8];
+                uint16_t x, y, z;
+                memcpy(&x, p, 2);
+                memcpy(&y, p + 2, 2);
+                memcpy(&z, p + 4, 2);
+                PointType& point = cloud.points[i];
+                point.x = x * 0.005 - 100.0;
+                point.y = -(y * 0.005 - 100.0);
+                point.z = -(z * 0.005 - 100.0);
+                point.intensity = (uint8_t)p[6];
+            }
+            return true;
+        }
+};
+
+// cloud_info and odometry recorded on /roll/feature/cloud_info and /Odometry
+class BagSource : public ReplaySource
+{
+    public:
+        // imuToBody: as the mapping node does with deskewed, imu-centered clouds
+        bool open(const string& fileName, const string& cloudTopic, const string& odomTopic, const Eigen::Affine3f& imuToBody)
+        {
+            try
+            {
+                bag.open(fileName, rosbag::bagmode::Read);
+            }
+            catch (const rosbag::BagException& e)
+            {
+                cout<<"Cannot open "<<fileName<<": "<<e.what()<<endl;
+                return false;
+            }
+            // odometry is small, it is read up front
+            rosbag::View odomView(bag, rosbag::TopicQuery(odomTopic));
+            for (const rosbag::MessageInstance& m : odomView)
+            {
+                nav_msgs::Odometry::ConstPtr odom = m.instantiate<nav_msgs::Odometry>();
+                if (odom == nullptr)
+                    continue;
+                const auto& p = odom->pose.pose;
+                Eigen::Quaternionf q(p.orientation.w, p.orientation.x, p.orientation.y, p.orientation.z);
+                Eigen::Affine3f pose = Eigen::Translation3f(p.position.x, p.position.y, p.position.z) * q;
+                poses.emplace_back(odom->header.stamp.toSec(), imuToBody * pose);
+            }
+            cloudView.reset(new rosbag::View(bag, rosbag::TopicQuery(cloudTopic)));
+            it = cloudView->begin();
+            cout<<cloudView->size()<<" cloud_info messages, "<<poses.size()<<" odometry messages"<<endl;
+            return cloudView->size() > 0 && !poses.empty();
+        }
+
+        bool next(ReplayFrame& frame) override
+        {
+            for (; it != cloudView->end(); ++it)
+            {
+                roll::cloud_infoConstPtr cloudInfo = it->instantiate<roll::cloud_info>();
+                if (cloudInfo == nullptr)
+                    continue;
+                double time = cloudInfo->header.stamp.toSec();
+                // the first odometry not older than the cloud, as in the mapping node
+                while (odomIndex < poses.size() && poses[odomIndex].first < time)
+                    odomIndex++;
+                if (odomIndex == poses.size() || poses[odomIndex].first - time > 0.05)
+                {
+                    unsynced++;
+                    continue;
+                }
+                frame.time = time;
+                frame.lidarToOdom = poses[odomIndex].second;
+                frame.raw.reset();
+                frame.corner.reset(new pcl::PointCloud<PointType>());
+                frame.surf.reset(new pcl::PointCloud<PointType>());
+                pcl::fromROSMsg(cloudInfo->cloud_corner, *frame.corner);
+                pcl::fromROSMsg(cloudInfo->cloud_surface, *frame.surf);
+                ++it;
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        rosbag::Bag bag;
+        std::unique_ptr<rosbag::View> cloudView;
+        rosbag::View::iterator it;
+        vector<std::pair<double, Eigen::Affine3f>, Eigen::aligned_allocator<std::pair<double, Eigen::Affine3f>>> poses;
+        size_t odomIndex = 0;
+};
+
+// the scan-to-map front end of mapOptimization in mapping mode: local map and keyframes through the node's
+// KeyframeMap, registration through the same backend, setTarget only when the local map changed. Keyframe poses
+// are the registered ones, there is no factor graph, loop closure, gps or localization mode (tile map), and nothing
+// is published; mapping/local_map and mapping/registration compare with the node's, mapping/keyframes does not.
+class ReplayMapper : public RollConfig, public KeyframeMap
+{
+    public:
+        vector<std::pair<double, Eigen::Affine3f>, Eigen::aligned_allocator<std::pair<double, Eigen::Affine3f>>> trajectory;
+
+        explicit ReplayMapper(const RollConfig& config) : RollConfig(config), KeyframeMap(static_cast<const RollConfig&>(*this))
+        {
+            registration = createRegistration(registrationMethod, config);
+            downSizeFilterScanCorner.setLeafSize(mappingCornerLeafSize, mappingCornerLeafSize, mappingCornerLeafSize);
+            downSizeFilterScanSurf.setLeafSize(mappingSurfLeafSize, mappingSurfLeafSize, mappingSurfLeafSize);
+        }
+
+        void process(double time, const Eigen::Affine3f& lidarToOdom, pcl::PointCloud<PointType>::Ptr corner,
+                     pcl::PointCloud<PointType>::Ptr surf)
+        {
+            pcl::PointCloud<PointType>::Ptr cornerDS(new pcl::PointCloud<PointType>());
+            pcl::PointCloud<PointType>::Ptr surfDS(new pcl::PointCloud<PointType>());
+            {
+                ROLL_STAGE("mapping/prepare");
+                downSizeFilterScanCorner.setInputCloud(corner);
+                downSizeFilterScanCorner.filter(*cornerDS);
+                downSizeFilterScanSurf.setInputCloud(surf);
+                downSizeFilterScanSurf.filter(*surfDS);
+                if (mortonOrder)
+                {
+                    mortonSort(*cornerDS, mappingCornerLeafSize);
+                    mortonSort(*surfDS, mappingSurfLeafSize);
+                }
+            }
+
+            Eigen::Affine3f pose = odomToMap * lidarToOdom;
+            if (!cloudKeyPoses3D->empty())
+            {
+                {
+                    ROLL_STAGE("mapping/local_map");
+                    PointType position;
+                    position.x = pose.translation().x();
+                    position.y = pose.translation().y();
+                    position.z = pose.translation().z();
+                    extractNearby(position, time - 10.0);
+                }
+                ROLL_STAGE("mapping/registration");
+                if ((int)cornerDS->size() > edgeFeatureMinValidNum && (int)surfDS->size() > surfFeatureMinValidNum
+                    && !lidarCloudCornerFromMapDS->empty() && !lidarCloudSurfFromMapDS->empty())
+                {
+                    if (localMapUpdated)
+                    {
+                        registration->setTarget(lidarCloudCornerFromMapDS, lidarCloudSurfFromMapDS);
+                        localMapUpdated = false;
+                    }
+                    registration->setSource(cornerDS, surfDS);
+                    lastCorner = cornerDS;
+                    lastSurf = surfDS;
+                    lastGuess = pose;
+                    registration->align(pose);
+                    pose = registration->affine_out;
+                }
+                else
+                    notEnoughFeatures++;
+            }
+            odomToMap = pose * lidarToOdom.inverse();
+            trajectory.emplace_back(time, pose);
+
+            ROLL_STAGE("mapping/keyframes");
+            if (cloudKeyPoses6D->empty() || isKeyframe(cloudKeyPoses6D->back(), pose))
+            {
+                PointTypePose pose6D;
+                pcl::getTranslationAndEulerAngles(pose, pose6D.x, pose6D.y, pose6D.z, pose6D.roll, pose6D.pitch, pose6D.yaw);
+                pose6D.time = time;
+                addKeyframe(pose6D, encode(*corner), encode(*surf));
+            }
+        }
+
+        int keyframes() const { return cloudKeyPoses3D->size(); }
+        int notEnoughFeatures = 0;
+
+        // the local map, scan features and initial guess of the last registration, the fixtures of roll_benchmark
+        bool saveFixture(const string& directory) const
+        {
+            if (!lastCorner)
+                return false;
+            if (pcl::io::savePCDFileBinary(directory + "/map_corner.pcd", *lidarCloudCornerFromMapDS) != 0
+                || pcl::io::savePCDFileBinary(directory + "/map_surf.pcd", *lidarCloudSurfFromMapDS) != 0
+                || pcl::io::savePCDFileBinary(directory + "/corner.pcd", *lastCorner) != 0
+                || pcl::io::savePCDFileBinary(directory + "/surf.pcd", *lastSurf) != 0)
+                return false;
+            ofstream fout(directory + "/guess.txt");
+            fout<<std::setprecision(9)<<lastGuess.matrix()<<endl;
+            return (bool)fout;
+        }
+
+    private:
+        Registration::Ptr registration;
+        Eigen::Affine3f odomToMap = Eigen::Affine3f::Identity();
+        pcl::VoxelGrid<PointType> downSizeFilterScanCorner;
+        pcl::VoxelGrid<PointType> downSizeFilterScanSurf;
+        pcl::PointCloud<PointType>::Ptr lastCorner;
+        pcl::PointCloud<PointType>::Ptr lastSurf;
+        Eigen::Affine3f lastGuess = Eigen::Affine3f::Identity();
+};
+
+static void saveTrajectory(const string& fileName, const ReplayMapper& mapper)
+{
+    ofstream fout(fileName);
+    fout<<std::fixed<<std::setprecision(6);
+    for (const auto& entry : mapper.trajectory)
+    {
+        Eigen::Quaternionf q(entry.second.rotation());
+        Eigen::Vector3f t = entry.second.translation();
+        fout<<entry.first<<" "<<t.x()<<" "<<t.y()<<" "<<t.z()<<" "<<q.x()<<" "<<q.y()<<" "<<q.z()<<" "<<q.w()<<"\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    YamlParamReader params;
+    string ncltDirectory, poseFile, bagFile, trajectoryFile, csvFile, fixtureDirectory;
+    string cloudTopic = "/roll/feature/cloud_info", odomTopic = "/Odometry";
+    long maxFrames = -1;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        string option = argv[i], value = argv[i + 1];
+        if (option == "--config")
+        {
+            if (!params.load(value))
+            {
+                cout<<"Cannot read "<<value<<endl;
+                return 1;
+            }
+        }
+        else if (option == "--set" && value.find('=') != string::npos)
+            params.set(value.substr(0, value.find('=')), value.substr(value.find('=') + 1));
+        else if (option == "--nclt") ncltDirectory = value;
+        else if (option == "--poses") poseFile = value;
+        else if (option == "--bag") bagFile = value;
+        else if (option == "--cloud-topic") cloudTopic = value;
+        else if (option == "--odom-topic") odomTopic = value;
+        else if (option == "--frames") maxFrames = atol(value.c_str());
+        else if (option == "--trajectory") trajectoryFile = value;
+        else if (option == "--csv") csvFile = value;
+        else if (option == "--fixture") fixtureDirectory = value;
+        else
+        {
+            cout<<"Unknown option "<<option<<endl;
+            return 1;
+        }
+    }
+
+    RollConfig config;
+    if (!config.read(params))
+    {
+        cout<<"Invalid sensor type (must be either 'velodyne' or 'ouster'): "<<config.sensorName<<endl;
+        return 1;
+    }
+
+    std::unique_ptr<ReplaySource> source;
+    if (!ncltDirectory.empty())
+    {
+        NcltSource* nclt = new NcltSource();
+        source.reset(nclt);
+        if (!nclt->open(ncltDirectory, poseFile, trans2Affine3f(config.lidarToBody)))
+            return 1;
+    }
+    else if (!bagFile.empty())
+    {
+        BagSource* bag = new BagSource();
+        source.reset(bag);
+        if (!bag->open(bagFile, cloudTopic, odomTopic, trans2Affine3f(config.imuToBody)))
+            return 1;
+    }
+    else
+    {
+        cout<<"usage: roll_replay --config params.yaml (--nclt velodyne_sync_dir --poses poses.csv | --bag file.bag)"
+            <<" [--set name=value]... [--frames N] [--trajectory out.txt] [--csv stages.csv] [--fixture dir]"<<endl;
+        return 1;
+    }
+
+    Instrumentation::setEnabled(true);
+    FeatureExtractor extractor(config);
+    ReplayMapper mapper(config);
+
+    pcl::PointCloud<PointType>::Ptr lastScan;
+    long frames = 0, emptyFrames = 0;
+    double readTime = 0, processTime = 0;
+    ReplayFrame frame;
+    while (maxFrames < 0 || frames < maxFrames)
+    {
+        TicToc readClock;
+        bool more;
+        {
+            ROLL_STAGE("replay/read");
+            more = source->next(frame);
+        }
+        readTime += readClock.toc();
+        if (!more)
+            break;
+
+        TicToc processClock;
+        {
+            ROLL_STAGE("replay/frame");
+            if (frame.raw)
+            {
+                lastScan = frame.raw;
+                FeatureClouds features;
+                bool ok;
+                {
+                    ROLL_STAGE("feature/frame");
+                    ok = extractor.extract(frame.raw, features);
+                }
+                if (ok)
+                    mapper.process(frame.time, frame.lidarToOdom, features.corner, features.surface);
+                else
+                    emptyFrames++;
+            }
+            else
+                mapper.process(frame.time, frame.lidarToOdom, frame.corner, frame.surf);
+        }
+        processTime += processClock.toc();
+        frames++;
+        if (frames % 100 == 0)
+            cout<<frames<<" frames, "<<frames / (processTime * 1e-3)<<" frames/s"<<endl;
+    }
+
+    cout<<std::fixed<<std::setprecision(3);
+    cout<<frames<<" frames replayed ("<<source->unsynced<<" without a pose, "<<emptyFrames<<" too sparse, "
+        <<mapper.notEnoughFeatures<<" with too few features), "<<mapper.keyframes()<<" keyframes"<<endl;
+    cout<<"processing "<<processTime * 1e-3<<" s, "<<(processTime > 0 ? frames / (processTime * 1e-3) : 0)
+        <<" frames/s; reading "<<readTime * 1e-3<<" s"<<endl;
+    std::vector<StageStats> stats = Instrumentation::instance().snapshot();
+    cout<<std::left<<std::setw(24)<<"stage"<<std::right<<std::setw(8)<<"count"<<std::setw(10)<<"mean ms"
+        <<std::setw(10)<<"p50"<<std::setw(10)<<"p90"<<std::setw(10)<<"p99"<<std::setw(10)<<"max"<<endl;
+    for (const auto& s : stats)
+        cout<<std::left<<std::setw(24)<<s.stage<<std::right<<std::setw(8)<<s.count<<std::setw(10)<<s.meanMs
+            <<std::setw(10)<<s.p50Ms<<std::setw(10)<<s.p90Ms<<std::setw(10)<<s.p99Ms<<std::setw(10)<<s.maxMs<<endl;
+    if (!csvFile.empty() && !Instrumentation::instance().appendCsv(csvFile, processTime * 1e-3, stats))
+        cout<<"Cannot write "<<csvFile<<endl;
+    if (!trajectoryFile.empty())
+        saveTrajectory(trajectoryFile, mapper);
+    if (!fixtureDirectory.empty())
+    {
+        saveTrajectory(fixtureDirectory + "/trajectory.txt", mapper);
+        if ((lastScan && pcl::io::savePCDFileBinary(fixtureDirectory + "/scan.pcd", *lastScan) != 0)
+            || !mapper.saveFixture(fixtureDirectory))
+            cout<<"Cannot write the fixture to "<<fixtureDirectory<<endl;
+    }
+    return 0;
+}